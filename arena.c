@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "arena.h"
+
+void mne_arena_init(mne_arena *arena, size_t item_bytes) {
+  arena->item_bytes = item_bytes;
+  arena->chunks = NULL;
+  arena->num_chunks = 0;
+  arena->chunks_size = 0;
+  arena->count = 0;
+  arena->num_retired = 0;
+}
+
+void mne_arena_free(mne_arena *arena) {
+  unsigned int i;
+
+  for (i = 0; i < arena->num_chunks; i++)
+    free(arena->chunks[i]);
+  free(arena->chunks);
+  for (i = 0; i < arena->num_retired; i++)
+    free(arena->retired[i]);
+  mne_arena_init(arena, arena->item_bytes);
+}
+
+/* Empties arena, keeping up to MNE_ARENA_KEEP_CHUNKS chunks for reuse. */
+void mne_arena_reset(mne_arena *arena) {
+  while (arena->num_chunks > MNE_ARENA_KEEP_CHUNKS)
+    free(arena->chunks[--arena->num_chunks]);
+  while (arena->num_retired > 0)
+    free(arena->retired[--arena->num_retired]);
+  arena->count = 0;
+}
+
+/* Adds a chunk; the items already in arena stay where they are. */
+void mne_arena_grow(mne_arena *arena) {
+  char **chunks = arena->chunks;
+
+  if (arena->num_chunks == arena->chunks_size) {
+    arena->chunks_size = arena->chunks_size > 0 ? arena->chunks_size * 2 : 4;
+    chunks = malloc(sizeof(char*) * arena->chunks_size);
+    assert(chunks != NULL);
+    if (arena->num_chunks > 0)
+      memcpy(chunks, arena->chunks, sizeof(char*) * arena->num_chunks);
+    if (arena->chunks != NULL) {
+      assert(arena->num_retired < MNE_ARENA_MAX_RETIRED);
+      arena->retired[arena->num_retired++] = arena->chunks;
+    }
+  }
+
+  chunks[arena->num_chunks] = malloc(arena->item_bytes * MNE_ARENA_CHUNK_ITEMS);
+  assert(chunks[arena->num_chunks] != NULL);
+
+  /* The new list is complete before anyone can see it. */
+  __sync_synchronize();
+  arena->chunks = chunks;
+  arena->num_chunks++;
+}
@@ -0,0 +1,50 @@
+#ifndef MEANIE_ARENA_H
+#define MEANIE_ARENA_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+/*
+ * A growable array of fixed-size items, kept in chunks so items never move
+ * once written: growing allocates a new chunk instead of reallocating. Each
+ * search thread appends to its own arenas, so they need no locking. Resetting
+ * keeps the first few chunks for the next query and frees the rest.
+ *
+ * Another thread may read items it was told about (through a barrier) while
+ * the arena grows: the list of chunks is copied rather than reallocated, and
+ * the old lists are only freed on reset.
+ */
+
+#define MNE_ARENA_CHUNK_ITEMS 4096
+#define MNE_ARENA_KEEP_CHUNKS 16
+#define MNE_ARENA_MAX_RETIRED 32
+
+typedef struct {
+	size_t item_bytes;
+	char ** volatile chunks;
+	unsigned int num_chunks;
+	unsigned int chunks_size;
+	unsigned int count;
+	char **retired[MNE_ARENA_MAX_RETIRED]; /* Chunk lists readers may still be using. */
+	unsigned int num_retired;
+} mne_arena;
+
+void mne_arena_init(mne_arena*, size_t);
+void mne_arena_free(mne_arena*);
+void mne_arena_reset(mne_arena*);
+void mne_arena_grow(mne_arena*);
+
+/* The i-th item of arena. */
+static inline void *mne_arena_get(const mne_arena *arena, unsigned int i) {
+  return arena->chunks[i / MNE_ARENA_CHUNK_ITEMS] + (size_t)(i % MNE_ARENA_CHUNK_ITEMS) * arena->item_bytes;
+}
+
+/* Appends an item to arena and returns it, uninitialized. */
+static inline void *mne_arena_push(mne_arena *arena) {
+  if (unlikely(arena->count == arena->num_chunks * MNE_ARENA_CHUNK_ITEMS))
+    mne_arena_grow(arena);
+  return mne_arena_get(arena, arena->count++);
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "cache.h"
+
+/*
+ * A small array searched linearly: lookups happen once per query, and the
+ * implication test has to look at every entry anyway. The least recently
+ * used entries go first when the byte budget runs out.
+ */
+
+static mne_cache_entry entries[MNE_CACHE_MAX_ENTRIES];
+static unsigned int num_entries = 0, generation = 0;
+static size_t cache_bytes = 0, max_bytes = 0;
+static unsigned long cache_clock = 0;
+static unsigned long hits = 0, refinements = 0, misses = 0, evictions = 0;
+
+static void mne_cache_remove(unsigned int);
+static void mne_cache_evict();
+
+void mne_cache_init(size_t bytes) {
+  max_bytes = bytes;
+}
+
+void mne_cache_free() {
+  while (num_entries > 0)
+    mne_cache_remove(num_entries - 1);
+}
+
+/* The corpus changed: nothing cached so far can be trusted. */
+void mne_cache_advance() {
+  generation++;
+  mne_cache_free();
+}
+
+/*
+ * Returns the entry for pattern itself if there is one, or else the smallest
+ * entry whose literal every match of plan contains, or NULL. Either way the
+ * blobs matching pattern are among the entry's.
+ */
+const mne_cache_entry *mne_cache_lookup(const char *pattern, int flags, const mne_plan_node *plan) {
+  mne_cache_entry *best = NULL;
+  unsigned int i;
+  int exact = 0;
+
+  if (max_bytes == 0)
+    return NULL;
+
+  for (i = 0; i < num_entries; i++) {
+    mne_cache_entry *entry = &entries[i];
+    if (entry->generation != generation || entry->flags != flags)
+      continue;
+
+    if (strcmp(entry->pattern, pattern) == 0) {
+      best = entry;
+      exact = 1;
+      break;
+    }
+
+    if (entry->literal != NULL && (best == NULL || entry->num_blobs < best->num_blobs) &&
+        mne_plan_implies(plan, entry->literal, entry->length, entry->caseless))
+      best = entry;
+  }
+
+  if (best == NULL) {
+    misses++;
+    return NULL;
+  }
+
+  if (exact)
+    hits++;
+  else
+    refinements++;
+  best->used = ++cache_clock;
+  return best;
+}
+
+/* Remembers the blobs pattern matched; the query must have run to completion. */
+void mne_cache_store(const char *pattern, int flags, const mne_plan_node *plan, const unsigned int *blobs,
+    unsigned int count) {
+  int exact = mne_plan_exact(pattern) && plan->op == MNE_PLAN_LITERAL;
+  size_t bytes = sizeof(mne_cache_entry) + strlen(pattern) + 1 + sizeof(unsigned int) * count;
+  unsigned int i;
+
+  if (exact)
+    bytes += plan->length + 1;
+
+  if (bytes > max_bytes)
+    return;
+
+  for (i = 0; i < num_entries; i++) {
+    if (entries[i].flags == flags && strcmp(entries[i].pattern, pattern) == 0) {
+      mne_cache_remove(i);
+      break;
+    }
+  }
+
+  while (num_entries == MNE_CACHE_MAX_ENTRIES || cache_bytes + bytes > max_bytes)
+    mne_cache_evict();
+
+  mne_cache_entry *entry = &entries[num_entries++];
+  entry->pattern = strdup(pattern);
+  assert(entry->pattern != NULL);
+  entry->flags = flags;
+  entry->generation = generation;
+  entry->literal = NULL;
+  entry->length = 0;
+  entry->caseless = 0;
+
+  if (exact) {
+    entry->literal = malloc(plan->length + 1);
+    assert(entry->literal != NULL);
+    memcpy(entry->literal, plan->literal, plan->length + 1);
+    entry->length = plan->length;
+    entry->caseless = plan->caseless;
+  }
+
+  entry->blobs = malloc(sizeof(unsigned int) * (count + 1));
+  assert(entry->blobs != NULL);
+  memcpy(entry->blobs, blobs, sizeof(unsigned int) * count);
+  entry->num_blobs = count;
+  entry->bytes = bytes;
+  entry->used = ++cache_clock;
+  cache_bytes += bytes;
+}
+
+void mne_cache_print_stats() {
+  unsigned long lookups = hits + refinements + misses;
+
+  printf("Cache: %u entries, %.2fkb of %.2fkb, %lu hits, %lu refinements, %lu misses (%.1f%% hit rate), "
+    "%lu evictions.\n", num_entries, cache_bytes / 1024.0, max_bytes / 1024.0, hits, refinements, misses,
+    lookups > 0 ? 100.0 * (hits + refinements) / lookups : 0.0, evictions);
+}
+
+static void mne_cache_remove(unsigned int i) {
+  mne_cache_entry *entry = &entries[i];
+
+  cache_bytes -= entry->bytes;
+  free(entry->pattern);
+  free(entry->literal);
+  free(entry->blobs);
+  entries[i] = entries[--num_entries];
+}
+
+static void mne_cache_evict() {
+  unsigned int i, oldest = 0;
+
+  for (i = 1; i < num_entries; i++) {
+    if (entries[i].used < entries[oldest].used)
+      oldest = i;
+  }
+
+  mne_cache_remove(oldest);
+  evictions++;
+}
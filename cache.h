@@ -0,0 +1,37 @@
+#ifndef MEANIE_CACHE_H
+#define MEANIE_CACHE_H
+
+#include <stddef.h>
+
+#include "plan.h"
+
+/*
+ * Remembers which blobs completed queries matched, keyed by pattern, compile
+ * flags and corpus generation. A later query can rescan just those blobs if
+ * it is the same query, or if the cached pattern is a plain literal that
+ * every match of the new one must contain (foo, then foo_bar).
+ */
+
+#define MNE_CACHE_MAX_ENTRIES 256
+
+typedef struct {
+	char *pattern;
+	int flags;
+	unsigned int generation;
+	char *literal; /* Set when the pattern matches exactly where this occurs. */
+	int length;
+	int caseless;
+	unsigned int *blobs;
+	unsigned int num_blobs;
+	size_t bytes;
+	unsigned long used;
+} mne_cache_entry;
+
+void mne_cache_init(size_t);
+void mne_cache_free();
+void mne_cache_advance();
+const mne_cache_entry *mne_cache_lookup(const char*, int, const mne_plan_node*);
+void mne_cache_store(const char*, int, const mne_plan_node*, const unsigned int*, unsigned int);
+void mne_cache_print_stats();
+
+#endif
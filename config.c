@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+mne_config config;
+
+static void mne_config_usage(const char*);
+static size_t mne_config_size(const char*, const char*);
+static unsigned long mne_config_duration(const char*, const char*);
+static int mne_config_workers(const char*, const char*);
+static int mne_config_format(const char*, const char*);
+
+void mne_config_parse(int argc, char **argv) {
+  int opt;
+
+  config.repo_path = NULL;
+  config.index_path = NULL; /* Defaults to <git dir>/meanie. */
+  config.segment_bytes = MNE_CONFIG_SEGMENT_BYTES;
+  config.max_match_bytes = MNE_CONFIG_MAX_MATCH_BYTES;
+  config.jit_stack_bytes = MNE_CONFIG_JIT_STACK_BYTES;
+  config.match_limit = MNE_CONFIG_MATCH_LIMIT;
+  config.recursion_limit = MNE_CONFIG_RECURSION_LIMIT;
+  config.timeout_ms = MNE_CONFIG_TIMEOUT_MS;
+  config.max_results = MNE_CONFIG_MAX_RESULTS;
+  config.mode = MNE_MODE_MATCHES;
+  config.captures = 1;
+  config.stream = 0;
+  config.format = MNE_FORMAT_TEXT;
+  config.cache_bytes = MNE_CONFIG_CACHE_BYTES;
+  config.workers = MNE_WORKERS_CORES;
+  config.pin = 1;
+  config.dfa_bytes = MNE_CONFIG_DFA_BYTES;
+
+  while ((opt = getopt(argc, argv, "i:s:m:j:l:r:t:n:cfLNSo:C:w:Pd:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        config.index_path = optarg;
+        break;
+      case 's':
+        config.segment_bytes = mne_config_size(argv[0], optarg);
+        break;
+      case 'm':
+        config.max_match_bytes = mne_config_size(argv[0], optarg);
+        break;
+      case 'j':
+        config.jit_stack_bytes = mne_config_size(argv[0], optarg);
+        break;
+      case 'l':
+        config.match_limit = mne_config_size(argv[0], optarg);
+        break;
+      case 'r':
+        config.recursion_limit = mne_config_size(argv[0], optarg);
+        break;
+      case 't':
+        config.timeout_ms = mne_config_duration(argv[0], optarg);
+        break;
+      case 'n':
+        config.max_results = mne_config_size(argv[0], optarg);
+        break;
+      case 'c':
+        config.mode = MNE_MODE_COUNT;
+        break;
+      case 'f':
+        config.mode = MNE_MODE_FILES;
+        break;
+      case 'L':
+        config.mode = MNE_MODE_LINES;
+        break;
+      case 'N':
+        config.captures = 0;
+        break;
+      case 'S':
+        config.stream = 1;
+        break;
+      case 'o':
+        config.format = mne_config_format(argv[0], optarg);
+        break;
+      case 'C':
+        config.cache_bytes = mne_config_size(argv[0], optarg);
+        break;
+      case 'w':
+        config.workers = mne_config_workers(argv[0], optarg);
+        break;
+      case 'P':
+        config.pin = 0;
+        break;
+      case 'd':
+        config.dfa_bytes = mne_config_size(argv[0], optarg);
+        break;
+      default:
+        mne_config_usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1)
+    mne_config_usage(argv[0]);
+
+  config.repo_path = argv[optind];
+}
+
+/* Parses a byte count with an optional k, m or g suffix. */
+static size_t mne_config_size(const char *name, const char *value) {
+  char *end;
+  unsigned long long size = strtoull(value, &end, 10);
+
+  if (end == value)
+    mne_config_usage(name);
+
+  switch (*end) {
+    case 'k': case 'K': size <<= 10; end++; break;
+    case 'm': case 'M': size <<= 20; end++; break;
+    case 'g': case 'G': size <<= 30; end++; break;
+  }
+
+  if (*end != 0)
+    mne_config_usage(name);
+
+  return (size_t)size;
+}
+
+/* Parses a duration in milliseconds, or seconds or minutes with an s or m suffix. */
+static unsigned long mne_config_duration(const char *name, const char *value) {
+  char *end;
+  unsigned long ms = strtoul(value, &end, 10);
+
+  if (end == value)
+    mne_config_usage(name);
+
+  if (strcmp(end, "s") == 0)
+    ms *= 1000;
+  else if (strcmp(end, "m") == 0)
+    ms *= 60 * 1000;
+  else if (*end != 0 && strcmp(end, "ms") != 0)
+    mne_config_usage(name);
+
+  return ms;
+}
+
+/* Parses a worker policy, cores or threads, or a thread count. */
+static int mne_config_workers(const char *name, const char *value) {
+  char *end;
+
+  if (strcmp(value, "cores") == 0)
+    return MNE_WORKERS_CORES;
+  if (strcmp(value, "threads") == 0)
+    return MNE_WORKERS_THREADS;
+
+  long workers = strtol(value, &end, 10);
+  if (end == value || *end != 0 || workers < 1)
+    mne_config_usage(name);
+
+  return workers;
+}
+
+/* Parses an output format: text, json or msgpack. */
+static int mne_config_format(const char *name, const char *value) {
+  if (strcmp(value, "text") == 0)
+    return MNE_FORMAT_TEXT;
+  if (strcmp(value, "json") == 0)
+    return MNE_FORMAT_JSON;
+  if (strcmp(value, "msgpack") == 0)
+    return MNE_FORMAT_MSGPACK;
+
+  mne_config_usage(name);
+  return MNE_FORMAT_TEXT;
+}
+
+static void mne_config_usage(const char *name) {
+  printf("Usage: %s [-i index_dir] [-s segment_size] [-m max_match_length] [-j jit_stack_size] [-l match_limit]\n"
+    "  [-r recursion_limit] [-t timeout] [-n max_results] [-c | -f | -L] [-N] [-S]\n"
+    "  [-o text|json|msgpack] [-C cache_size] [-w cores|threads|count] [-P] [-d dfa_cache_size]\n"
+    "  path/to/git/repo\n", name);
+  printf("  -s  split blobs larger than this into line-aligned segments searched in parallel (0 disables, default 4m)\n");
+  printf("  -m  longest match segments must be able to see past their end (default 64k)\n");
+  printf("  -j  maximum PCRE JIT stack per search thread (default 1m)\n");
+  printf("  -l  PCRE match limit per pcre_exec call (default 10000000)\n");
+  printf("  -r  PCRE recursion limit when not using the JIT (default 5000)\n");
+  printf("  -t  stop each query after this long and show what it found (500ms, 2s, 1m; default none)\n");
+  printf("  -n  stop each query after this many matches (files in -f), 0 for no limit (default 0; 'limit n' in the REPL)\n");
+  printf("  -c  only count matches per file; -f only list the files that match ('mode count|files|matches' in the REPL)\n");
+  printf("  -L  report each matching line once, with ^ and $ matching at every line ('mode lines' in the REPL)\n");
+  printf("  -N  groups don't capture (PCRE_NO_AUTO_CAPTURE), which is faster; backreferences need named groups ('captures off' in the REPL)\n");
+  printf("  -S  print results as they are found instead of in path order ('stream on|off' in the REPL)\n");
+  printf("  -o  write results as text, JSON Lines or MessagePack records; records get stdout, everything else goes to stderr ('format' in the REPL)\n");
+  printf("  -C  memory for remembering which blobs earlier queries matched, 0 disables (default 16m; 'cache' shows stats)\n");
+  printf("  -w  search threads: one per physical core, one per logical CPU, or a count (default cores)\n");
+  printf("  -P  don't pin search threads to CPUs\n");
+  printf("  -d  bytes of DFA states each search thread may cache per query, 0 always uses PCRE (default 1m)\n");
+  exit(1);
+}
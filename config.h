@@ -0,0 +1,55 @@
+#ifndef MEANIE_CONFIG_H
+#define MEANIE_CONFIG_H
+
+#include <stddef.h>
+
+#define MNE_CONFIG_SEGMENT_BYTES (4 * 1024 * 1024)
+#define MNE_CONFIG_MAX_MATCH_BYTES (64 * 1024)
+#define MNE_CONFIG_JIT_STACK_BYTES (1024 * 1024)
+#define MNE_CONFIG_MATCH_LIMIT 10000000
+#define MNE_CONFIG_RECURSION_LIMIT 5000
+#define MNE_CONFIG_TIMEOUT_MS 0
+#define MNE_CONFIG_MAX_RESULTS 0
+#define MNE_CONFIG_CACHE_BYTES (16 * 1024 * 1024)
+#define MNE_CONFIG_DFA_BYTES (1024 * 1024)
+
+/* What a query reports: every match, a count per file, just the files, or each matching line once. */
+#define MNE_MODE_MATCHES 0
+#define MNE_MODE_COUNT 1
+#define MNE_MODE_FILES 2
+#define MNE_MODE_LINES 3
+
+/* How results are written: coloured text for people, or records for programs. */
+#define MNE_FORMAT_TEXT 0
+#define MNE_FORMAT_JSON 1
+#define MNE_FORMAT_MSGPACK 2
+
+/* How many search threads to run, when not given as a count. */
+#define MNE_WORKERS_CORES 0
+#define MNE_WORKERS_THREADS -1
+
+typedef struct {
+	char *repo_path;
+	char *index_path;
+	size_t segment_bytes;
+	size_t max_match_bytes;
+	size_t jit_stack_bytes;
+	unsigned long match_limit;
+	unsigned long recursion_limit;
+	unsigned long timeout_ms;
+	unsigned long max_results;
+	int mode;
+	int captures;
+	int stream;
+	int format;
+	size_t cache_bytes;
+	int workers;
+	int pin;
+	size_t dfa_bytes;
+} mne_config;
+
+extern mne_config config;
+
+void mne_config_parse(int, char**);
+
+#endif
@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "dfa.h"
+#include "common.h"
+
+/*
+ * The syntax tree is emitted twice: once forwards and once with every
+ * concatenation reversed.
+ *
+ * The forward search keeps its NFA threads in PCRE's order of preference,
+ * restarting at each byte with the lowest preference of all. A thread that
+ * matches drops every thread behind it, so the last match seen before the
+ * threads run out ends where PCRE's would (the leftmost-first match). The
+ * reverse program then runs back from that end, anchored and preferring the
+ * longest match, which lands on the leftmost start.
+ */
+
+#define MNE_DFA_OP_MATCH 0
+#define MNE_DFA_OP_CLASS 1
+#define MNE_DFA_OP_SPLIT 2
+#define MNE_DFA_OP_ASSERT 3
+
+/* The low bits of a state's flags hold a MNE_DFA_KIND_*. */
+#define MNE_DFA_KIND_MASK 7
+#define MNE_DFA_MATCH 8
+#define MNE_DFA_RESTART 16
+#define MNE_DFA_DEAD 32
+
+#define MNE_DFA_BUCKETS 1024
+
+static void mne_dfa_build(mne_dfa_prog*, const mne_syntax_node*, int);
+static int mne_dfa_emit(mne_dfa_prog*, const mne_syntax_node*, int);
+static int mne_dfa_inst_new(mne_dfa_prog*, int);
+static int mne_dfa_set_add(mne_dfa_prog*, const unsigned char*);
+static void mne_dfa_classify(mne_dfa_prog*);
+static void mne_dfa_prog_free(mne_dfa_prog*);
+static void mne_dfa_side_init(mne_dfa_side*, const mne_dfa_prog*, size_t);
+static void mne_dfa_side_free(mne_dfa_side*);
+static void mne_dfa_flush(mne_dfa_side*);
+static unsigned int mne_dfa_hash(unsigned int, const int*, int);
+static void mne_dfa_grow(mne_dfa_side*);
+static mne_dfa_state *mne_dfa_intern(mne_dfa_side*, unsigned int, const int*, int);
+static mne_dfa_state *mne_dfa_start(mne_dfa_side*, int);
+static mne_dfa_state *mne_dfa_step(mne_dfa_side*, mne_dfa_state*, int);
+static int mne_dfa_holds(int, int, int);
+static int mne_dfa_thrashing(mne_dfa_side*, unsigned long);
+/*
+ * Called after a flush, walked bytes into a scan. Whether the cache filled
+ * up again too fast to be worth rebuilding: RE2's rule, fewer than
+ * MNE_DFA_MIN_BYTES_PER_STATE bytes scanned per state it held.
+ */
+static int mne_dfa_thrashing(mne_dfa_side *side, unsigned long walked) {
+  unsigned long scanned = side->scanned + walked;
+  int thrashing = scanned - side->flush_scanned < (unsigned long)MNE_DFA_MIN_BYTES_PER_STATE * side->flushed_states;
+
+  side->flush_scanned = scanned;
+  return thrashing;
+}
+
+static inline int mne_dfa_symbol(const mne_dfa_prog*, const char*, int, int);
+static int mne_dfa_forward(mne_dfa_side*, const char*, int, int, int);
+static int mne_dfa_backward(mne_dfa_side*, const char*, int, int, int, int);
+
+/*
+ * Compiles the syntax tree of a pattern, or returns NULL with unsupported
+ * saying why the DFA can't run it.
+ */
+mne_dfa *mne_dfa_compile(const mne_syntax_node *root, const char **unsupported) {
+  mne_dfa *dfa = malloc(sizeof(mne_dfa));
+  assert(dfa != NULL);
+  mne_dfa_build(&dfa->forward, root, 0);
+  mne_dfa_build(&dfa->reverse, root, 1);
+
+  if (dfa->forward.failed != NULL || dfa->reverse.failed != NULL) {
+    *unsupported = dfa->forward.failed != NULL ? dfa->forward.failed : dfa->reverse.failed;
+    mne_dfa_free(dfa);
+    return NULL;
+  }
+
+  *unsupported = NULL;
+  return dfa;
+}
+
+void mne_dfa_free(mne_dfa *dfa) {
+  if (dfa == NULL)
+    return;
+
+  mne_dfa_prog_free(&dfa->forward);
+  mne_dfa_prog_free(&dfa->reverse);
+  free(dfa);
+}
+
+/* A cache of up to bytes of states, for one thread to use. */
+mne_dfa_cache *mne_dfa_cache_new(const mne_dfa *dfa, size_t bytes) {
+  mne_dfa_cache *cache = malloc(sizeof(mne_dfa_cache));
+  assert(cache != NULL);
+  mne_dfa_side_init(&cache->forward, &dfa->forward, bytes / 2);
+  mne_dfa_side_init(&cache->reverse, &dfa->reverse, bytes / 2);
+  return cache;
+}
+
+void mne_dfa_cache_free(mne_dfa_cache *cache) {
+  if (cache == NULL)
+    return;
+
+  mne_dfa_side_free(&cache->forward);
+  mne_dfa_side_free(&cache->reverse);
+  free(cache);
+}
+
+/*
+ * Finds the match pcre_exec would find in subject[0, length) from offset,
+ * setting start and end. Returns 1 for a match, 0 for none,
+ * MNE_DFA_GAVE_UP if the cache keeps filling up, or MNE_DFA_MISMATCH.
+ */
+int mne_dfa_exec(mne_dfa_cache *cache, const char *subject, int length, int offset, int *start, int *end) {
+  int final = length > 0 && subject[length - 1] == '\n' ? length - 1 : -1;
+  int last = mne_dfa_forward(&cache->forward, subject, length, offset, final);
+
+  if (last < 0)
+    return last == MNE_DFA_GAVE_UP ? MNE_DFA_GAVE_UP : 0;
+
+  int first = mne_dfa_backward(&cache->reverse, subject, length, offset, last, final);
+  if (first == MNE_DFA_GAVE_UP)
+    return MNE_DFA_GAVE_UP;
+
+  /* The reverse program should always find the start of what the forward one matched. */
+  if (unlikely(first < offset || first > last))
+    return MNE_DFA_MISMATCH;
+
+  *start = first;
+  *end = last;
+  return 1;
+}
+
+static void mne_dfa_build(mne_dfa_prog *prog, const mne_syntax_node *root, int reverse) {
+  memset(prog, 0, sizeof(mne_dfa_prog));
+  prog->reverse = reverse;
+  int match = mne_dfa_inst_new(prog, MNE_DFA_OP_MATCH);
+  prog->start = mne_dfa_emit(prog, root, match);
+  mne_dfa_classify(prog);
+}
+
+/* Emits node ahead of the instruction next, returning where node begins. */
+static int mne_dfa_emit(mne_dfa_prog *prog, const mne_syntax_node *node, int next) {
+  int i, pc, entry, body, width;
+
+  if (prog->failed)
+    return next;
+
+  switch (node->op) {
+    case MNE_SYNTAX_SET:
+      pc = mne_dfa_inst_new(prog, MNE_DFA_OP_CLASS);
+      prog->insts[pc].x = next;
+      prog->insts[pc].set = mne_dfa_set_add(prog, node->set);
+      return pc;
+
+    case MNE_SYNTAX_ASSERT:
+      pc = mne_dfa_inst_new(prog, MNE_DFA_OP_ASSERT);
+      prog->insts[pc].x = next;
+      prog->insts[pc].assertion = node->assertion;
+      prog->contextual = 1;
+      return pc;
+
+    case MNE_SYNTAX_CAT:
+      if (prog->reverse) {
+        for (i = 0; i < node->num_children; i++)
+          next = mne_dfa_emit(prog, node->children[i], next);
+      } else {
+        for (i = node->num_children - 1; i >= 0; i--)
+          next = mne_dfa_emit(prog, node->children[i], next);
+      }
+      return next;
+
+    case MNE_SYNTAX_ALT:
+      entry = mne_dfa_emit(prog, node->children[node->num_children - 1], next);
+      for (i = node->num_children - 2; i >= 0; i--) {
+        body = mne_dfa_emit(prog, node->children[i], next);
+        pc = mne_dfa_inst_new(prog, MNE_DFA_OP_SPLIT);
+        prog->insts[pc].x = body;
+        prog->insts[pc].y = entry;
+        entry = pc;
+      }
+      return entry;
+
+    case MNE_SYNTAX_REPEAT:
+      if ((node->max < 0 ? node->min : node->max) > MNE_DFA_MAX_WIDE_REPEAT &&
+          node->children[0]->op == MNE_SYNTAX_SET) {
+        for (i = 0, width = 0; i < 256; i++)
+          width += MNE_SYNTAX_HAS(node->children[0]->set, i) != 0;
+        if (width > MNE_DFA_WIDE_CLASS) {
+          prog->failed = "a long counted repeat of a wide class";
+          return next;
+        }
+      }
+
+      entry = next;
+      if (node->max < 0) {
+        entry = mne_dfa_inst_new(prog, MNE_DFA_OP_SPLIT);
+        body = mne_dfa_emit(prog, node->children[0], entry);
+        prog->insts[entry].x = node->greedy ? body : next;
+        prog->insts[entry].y = node->greedy ? next : body;
+      } else {
+        /* x{1,3} is x(x(x)?)?: each optional copy skips straight to next. */
+        for (i = node->min; i < node->max && !prog->failed; i++) {
+          body = mne_dfa_emit(prog, node->children[0], entry);
+          pc = mne_dfa_inst_new(prog, MNE_DFA_OP_SPLIT);
+          prog->insts[pc].x = node->greedy ? body : next;
+          prog->insts[pc].y = node->greedy ? next : body;
+          entry = pc;
+        }
+      }
+      for (i = 0; i < node->min && !prog->failed; i++)
+        entry = mne_dfa_emit(prog, node->children[0], entry);
+      return entry;
+
+    default:
+      return next;
+  }
+}
+
+static int mne_dfa_inst_new(mne_dfa_prog *prog, int op) {
+  if (prog->num_insts == MNE_DFA_MAX_INSTS) {
+    prog->failed = "pattern too large";
+    return 0;
+  }
+
+  if ((prog->num_insts & (prog->num_insts - 1)) == 0) {
+    prog->insts = realloc(prog->insts, sizeof(mne_dfa_inst) * (prog->num_insts > 0 ? prog->num_insts * 2 : 16));
+    assert(prog->insts != NULL);
+  }
+
+  mne_dfa_inst *inst = &prog->insts[prog->num_insts];
+  memset(inst, 0, sizeof(mne_dfa_inst));
+  inst->op = op;
+  return prog->num_insts++;
+}
+
+static int mne_dfa_set_add(mne_dfa_prog *prog, const unsigned char *set) {
+  int i;
+
+  for (i = 0; i < prog->num_sets; i++) {
+    if (memcmp(prog->sets[i], set, 32) == 0)
+      return i;
+  }
+
+  if ((prog->num_sets & (prog->num_sets - 1)) == 0) {
+    prog->sets = realloc(prog->sets, 32 * (prog->num_sets > 0 ? prog->num_sets * 2 : 16));
+    assert(prog->sets != NULL);
+  }
+
+  memcpy(prog->sets[prog->num_sets], set, 32);
+  return prog->num_sets++;
+}
+
+/*
+ * Splits the bytes into classes no set tells apart, starting from word
+ * bytes, newline and the rest so assertions can tell those apart too. Then
+ * two symbols follow the byte classes: the edge of the subject and a
+ * newline that ends it (which $ matches before).
+ */
+static void mne_dfa_classify(mne_dfa_prog *prog) {
+  int remap[256][2], c, s, n;
+
+  for (c = 0; c < 256; c++)
+    prog->classes[c] = c == '\n' ? 1 : (MNE_SYNTAX_WORD(c) ? 0 : 2);
+  n = 3;
+
+  for (s = 0; s < prog->num_sets; s++) {
+    memset(remap, -1, sizeof(remap));
+    n = 0;
+    for (c = 0; c < 256; c++) {
+      int *id = &remap[prog->classes[c]][MNE_SYNTAX_HAS(prog->sets[s], c) != 0];
+      if (*id < 0)
+        *id = n++;
+      prog->classes[c] = *id;
+    }
+  }
+
+  prog->num_classes = n;
+  prog->num_symbols = n + 2;
+
+  for (c = 255; c >= 0; c--)
+    prog->symbol_bytes[prog->classes[c]] = c;
+  prog->symbol_bytes[n] = -1;
+  prog->symbol_bytes[n + 1] = '\n';
+
+  for (s = 0; s < n; s++) {
+    c = prog->symbol_bytes[s];
+    prog->symbol_kinds[s] = c == '\n' ? MNE_DFA_KIND_NEWLINE : (MNE_SYNTAX_WORD(c) ? MNE_DFA_KIND_WORD :
+      MNE_DFA_KIND_OTHER);
+  }
+  prog->symbol_kinds[n] = MNE_DFA_KIND_EDGE;
+  prog->symbol_kinds[n + 1] = MNE_DFA_KIND_FINAL_NEWLINE;
+}
+
+static void mne_dfa_prog_free(mne_dfa_prog *prog) {
+  free(prog->insts);
+  free(prog->sets);
+}
+
+static void mne_dfa_side_init(mne_dfa_side *side, const mne_dfa_prog *prog, size_t budget) {
+  memset(side, 0, sizeof(mne_dfa_side));
+  side->prog = prog;
+  side->budget = budget;
+  side->num_buckets = MNE_DFA_BUCKETS;
+  side->buckets = calloc(side->num_buckets, sizeof(mne_dfa_state*));
+  assert(side->buckets != NULL);
+
+  /* A closure pushes at most two instructions for each one it visits. */
+  side->stack = malloc(sizeof(int) * (3 * prog->num_insts + 1));
+  side->expanded = malloc(sizeof(int) * (prog->num_insts + 1));
+  side->list = malloc(sizeof(int) * (prog->num_insts + 1));
+  side->marks = calloc(prog->num_insts + 1, sizeof(unsigned int));
+  assert(side->stack != NULL && side->expanded != NULL && side->list != NULL && side->marks != NULL);
+}
+
+static void mne_dfa_side_free(mne_dfa_side *side) {
+  mne_dfa_flush(side);
+  free(side->buckets);
+  free(side->stack);
+  free(side->expanded);
+  free(side->list);
+  free(side->marks);
+}
+
+/* Drops every state; the next steps rebuild the ones still in use. */
+static void mne_dfa_flush(mne_dfa_side *side) {
+  unsigned int i;
+
+  for (i = 0; i < side->num_buckets; i++) {
+    mne_dfa_state *state = side->buckets[i];
+    while (state != NULL) {
+      mne_dfa_state *chain = state->chain;
+      free(state);
+      state = chain;
+    }
+    side->buckets[i] = NULL;
+  }
+
+  memset(side->starts, 0, sizeof(side->starts));
+  side->num_states = 0;
+  side->bytes = 0;
+}
+
+static unsigned int mne_dfa_hash(unsigned int flags, const int *insts, int num_insts) {
+  unsigned int hash = 2166136261u ^ flags;
+  int i;
+
+  for (i = 0; i < num_insts; i++)
+    hash = (hash ^ insts[i]) * 16777619u;
+  return hash;
+}
+
+/* Doubles the buckets once chains average two states. */
+static void mne_dfa_grow(mne_dfa_side *side) {
+  unsigned int i, num_buckets = side->num_buckets * 2;
+  mne_dfa_state **buckets = calloc(num_buckets, sizeof(mne_dfa_state*));
+  assert(buckets != NULL);
+
+  for (i = 0; i < side->num_buckets; i++) {
+    mne_dfa_state *state = side->buckets[i];
+    while (state != NULL) {
+      mne_dfa_state *chain = state->chain;
+      unsigned int bucket = mne_dfa_hash(state->flags, state->insts, state->num_insts) & (num_buckets - 1);
+      state->chain = buckets[bucket];
+      buckets[bucket] = state;
+      state = chain;
+    }
+  }
+
+  free(side->buckets);
+  side->buckets = buckets;
+  side->num_buckets = num_buckets;
+}
+
+/* Returns the state for flags and insts, building it if it isn't cached. */
+static mne_dfa_state *mne_dfa_intern(mne_dfa_side *side, unsigned int flags, const int *insts, int num_insts) {
+  unsigned int hash = mne_dfa_hash(flags, insts, num_insts);
+  mne_dfa_state *state;
+
+  for (state = side->buckets[hash & (side->num_buckets - 1)]; state != NULL; state = state->chain) {
+    if (state->flags == flags && state->num_insts == num_insts &&
+        memcmp(state->insts, insts, sizeof(int) * num_insts) == 0)
+      return state;
+  }
+
+  size_t bytes = sizeof(mne_dfa_state) + sizeof(mne_dfa_state*) * side->prog->num_symbols + sizeof(int) * num_insts;
+
+  if (side->bytes + bytes > side->budget && side->num_states > 0) {
+    side->flushed_states = side->num_states;
+    mne_dfa_flush(side);
+    side->flushes++;
+  }
+
+  state = malloc(bytes);
+  assert(state != NULL);
+  memset(state->next, 0, sizeof(mne_dfa_state*) * side->prog->num_symbols);
+  state->flags = flags;
+  state->num_insts = num_insts;
+  state->insts = (int*)(state->next + side->prog->num_symbols);
+  memcpy(state->insts, insts, sizeof(int) * num_insts);
+
+  state->chain = side->buckets[hash & (side->num_buckets - 1)];
+  side->buckets[hash & (side->num_buckets - 1)] = state;
+  side->num_states++;
+  side->bytes += bytes;
+  side->built++;
+
+  if (side->num_states > 2 * side->num_buckets)
+    mne_dfa_grow(side);
+  return state;
+}
+
+/* The state a search starts in, next to a byte of the given kind. */
+static mne_dfa_state *mne_dfa_start(mne_dfa_side *side, int kind) {
+  const mne_dfa_prog *prog = side->prog;
+
+  if (!prog->contextual)
+    kind = MNE_DFA_KIND_EDGE;
+
+  if (side->starts[kind] == NULL) {
+    /* Forward searches are unanchored, reverse ones start at a known end. */
+    unsigned int flags = kind | (prog->reverse ? 0 : MNE_DFA_RESTART);
+    mne_dfa_state *state = mne_dfa_intern(side, flags, &prog->start, 1);
+    side->starts[kind] = state;
+  }
+
+  return side->starts[kind];
+}
+
+/*
+ * Builds the transition out of state on sym. Forwards, the first thread to
+ * match stops the rest, as PCRE would never try them; backwards, the
+ * longest match wins.
+ */
+static mne_dfa_state *mne_dfa_step(mne_dfa_side *side, mne_dfa_state *state, int sym) {
+  const mne_dfa_prog *prog = side->prog;
+  int i, num_expanded = 0, num_list = 0, matched = 0, cut = 0, byte = prog->symbol_bytes[sym];
+  int kind = prog->symbol_kinds[sym], context = state->flags & MNE_DFA_KIND_MASK;
+  int before = prog->reverse ? kind : context, after = prog->reverse ? context : kind;
+  unsigned long flushes = side->flushes;
+
+  if (side->mark >= 0xfffffffe) {
+    memset(side->marks, 0, sizeof(unsigned int) * prog->num_insts);
+    side->mark = 0;
+  }
+  unsigned int seen = ++side->mark;
+
+  for (i = 0; i < state->num_insts; i++) {
+    int top = 0;
+    side->stack[top++] = state->insts[i];
+
+    while (top > 0) {
+      int pc = side->stack[--top];
+      const mne_dfa_inst *inst = &prog->insts[pc];
+
+      if (side->marks[pc] == seen)
+        continue;
+      side->marks[pc] = seen;
+
+      switch (inst->op) {
+        case MNE_DFA_OP_SPLIT:
+          side->stack[top++] = inst->y;
+          side->stack[top++] = inst->x;
+          break;
+        case MNE_DFA_OP_ASSERT:
+          if (mne_dfa_holds(inst->assertion, before, after))
+            side->stack[top++] = inst->x;
+          break;
+        default:
+          side->expanded[num_expanded++] = pc;
+      }
+    }
+  }
+
+  seen = ++side->mark;
+
+  for (i = 0; i < num_expanded; i++) {
+    const mne_dfa_inst *inst = &prog->insts[side->expanded[i]];
+
+    if (inst->op == MNE_DFA_OP_MATCH) {
+      matched = 1;
+      if (!prog->reverse) {
+        cut = 1;
+        break;
+      }
+    } else if (byte >= 0 && MNE_SYNTAX_HAS(prog->sets[inst->set], byte) && side->marks[inst->x] != seen) {
+      side->marks[inst->x] = seen;
+      side->list[num_list++] = inst->x;
+    }
+  }
+
+  /* A new attempt starts at every byte until something matches. */
+  unsigned int flags = (prog->contextual ? kind : 0) | (matched ? MNE_DFA_MATCH : 0);
+  if ((state->flags & MNE_DFA_RESTART) && !cut) {
+    flags |= MNE_DFA_RESTART;
+    if (side->marks[prog->start] != seen)
+      side->list[num_list++] = prog->start;
+  }
+  if (num_list == 0)
+    flags |= MNE_DFA_DEAD;
+
+  mne_dfa_state *next = mne_dfa_intern(side, flags, side->list, num_list);
+
+  /* A flush freed state along with everything else. */
+  if (side->flushes == flushes)
+    state->next[sym] = next;
+
+  return next;
+}
+
+/* Whether assertion holds between bytes of kind before and after. */
+static int mne_dfa_holds(int assertion, int before, int after) {
+  switch (assertion) {
+    case MNE_SYNTAX_BEGIN_TEXT:
+      return before == MNE_DFA_KIND_EDGE;
+    case MNE_SYNTAX_END_TEXT:
+      return after == MNE_DFA_KIND_EDGE;
+    case MNE_SYNTAX_END_TEXT_NEWLINE:
+      return after == MNE_DFA_KIND_EDGE || after == MNE_DFA_KIND_FINAL_NEWLINE;
+    case MNE_SYNTAX_BEGIN_LINE:
+      /* Not after a newline that ends the subject. */
+      return before == MNE_DFA_KIND_EDGE || (before == MNE_DFA_KIND_NEWLINE && after != MNE_DFA_KIND_EDGE);
+    case MNE_SYNTAX_END_LINE:
+      return after == MNE_DFA_KIND_EDGE || after == MNE_DFA_KIND_NEWLINE || after == MNE_DFA_KIND_FINAL_NEWLINE;
+    case MNE_SYNTAX_WORD_BOUNDARY:
+      return (before == MNE_DFA_KIND_WORD) != (after == MNE_DFA_KIND_WORD);
+    default:
+      return (before == MNE_DFA_KIND_WORD) == (after == MNE_DFA_KIND_WORD);
+  }
+}
+
+static inline int mne_dfa_symbol(const mne_dfa_prog *prog, const char *subject, int p, int final) {
+  return p == final ? prog->num_classes + 1 : prog->classes[(unsigned char)subject[p]];
+}
+
+/* Returns where the leftmost-first match from offset ends, -1 if there is none, or MNE_DFA_GAVE_UP. */
+static int mne_dfa_forward(mne_dfa_side *side, const char *subject, int length, int offset, int final) {
+  const mne_dfa_prog *prog = side->prog;
+  int p, last = -1;
+  int kind = offset == 0 ? MNE_DFA_KIND_EDGE : prog->symbol_kinds[mne_dfa_symbol(prog, subject, offset - 1, final)];
+  mne_dfa_state *state = mne_dfa_start(side, kind), *next;
+  unsigned long flushes = side->flushes;
+
+  for (p = offset; p < length; p++) {
+    int sym = mne_dfa_symbol(prog, subject, p, final);
+
+    if (unlikely((next = state->next[sym]) == NULL)) {
+      next = mne_dfa_step(side, state, sym);
+      if (unlikely(side->flushes != flushes)) {
+        if (mne_dfa_thrashing(side, p - offset))
+          return MNE_DFA_GAVE_UP;
+        flushes = side->flushes;
+      }
+    }
+    state = next;
+
+    if (unlikely(state->flags & (MNE_DFA_MATCH | MNE_DFA_DEAD))) {
+      if (state->flags & MNE_DFA_MATCH)
+        last = p;
+      if (state->flags & MNE_DFA_DEAD)
+        break;
+    }
+  }
+
+  side->scanned += p - offset;
+  if (p < length)
+    return last;
+
+  if ((next = state->next[prog->num_classes]) == NULL)
+    next = mne_dfa_step(side, state, prog->num_classes);
+  return next->flags & MNE_DFA_MATCH ? length : last;
+}
+
+/*
+ * Returns where the longest match ending at end starts, no earlier than
+ * offset, -1 if there is none, or MNE_DFA_GAVE_UP.
+ */
+static int mne_dfa_backward(mne_dfa_side *side, const char *subject, int length, int offset, int end, int final) {
+  const mne_dfa_prog *prog = side->prog;
+  int p, first = -1;
+  int kind = end == length ? MNE_DFA_KIND_EDGE : prog->symbol_kinds[mne_dfa_symbol(prog, subject, end, final)];
+  mne_dfa_state *state = mne_dfa_start(side, kind), *next;
+  unsigned long flushes = side->flushes;
+
+  for (p = end - 1; p >= offset; p--) {
+    int sym = mne_dfa_symbol(prog, subject, p, final);
+
+    if (unlikely((next = state->next[sym]) == NULL)) {
+      next = mne_dfa_step(side, state, sym);
+      if (unlikely(side->flushes != flushes)) {
+        if (mne_dfa_thrashing(side, end - 1 - p))
+          return MNE_DFA_GAVE_UP;
+        flushes = side->flushes;
+      }
+    }
+    state = next;
+
+    if (state->flags & MNE_DFA_MATCH)
+      first = p + 1;
+    if (state->flags & MNE_DFA_DEAD)
+      break;
+  }
+
+  side->scanned += end - 1 - p;
+  if (p >= offset)
+    return first;
+
+  int sym = offset == 0 ? prog->num_classes : mne_dfa_symbol(prog, subject, offset - 1, final);
+  if ((next = state->next[sym]) == NULL)
+    next = mne_dfa_step(side, state, sym);
+  return next->flags & MNE_DFA_MATCH ? offset : first;
+}
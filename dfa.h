@@ -0,0 +1,117 @@
+#ifndef MEANIE_DFA_H
+#define MEANIE_DFA_H
+
+#include <stddef.h>
+
+#include "syntax.h"
+
+/*
+ * A lazily built DFA for the patterns that don't need backtracking: no
+ * backreferences, lookaround, atomic groups, possessive quantifiers,
+ * recursion or UTF-8. The forward program finds where the match PCRE would
+ * report ends, the reverse one where it starts; both look at each byte once,
+ * so a scan is linear in what it reads whatever the pattern.
+ *
+ * States are built on first use and kept in a per-thread cache with a byte
+ * budget. When the budget runs out the cache is flushed and rebuilt from
+ * the state in hand, so memory stays bounded. A pattern that keeps filling
+ * the cache builds a state for nearly every byte, which is slower than
+ * PCRE; then the scan gives up and says so.
+ */
+
+#define MNE_DFA_MAX_INSTS 4096
+
+/* As in RE2: a cache flushed before scanning this many bytes per state it held gives up. */
+#define MNE_DFA_MIN_BYTES_PER_STATE 10
+
+/* Counted repeats of a class this wide and this long can be in nearly every state at once. */
+#define MNE_DFA_WIDE_CLASS 128
+#define MNE_DFA_MAX_WIDE_REPEAT 16
+
+/* What mne_dfa_exec returns besides 1 for a match and 0 for none. */
+#define MNE_DFA_GAVE_UP -2
+#define MNE_DFA_MISMATCH -3 /* The reverse program found no start for the forward one's match. */
+
+/* What a state's context bits record about the byte next to it. */
+#define MNE_DFA_KIND_EDGE 0
+#define MNE_DFA_KIND_WORD 1
+#define MNE_DFA_KIND_NEWLINE 2
+#define MNE_DFA_KIND_OTHER 3
+#define MNE_DFA_KIND_FINAL_NEWLINE 4
+#define MNE_DFA_KINDS 5
+
+typedef struct {
+	unsigned char op;
+	unsigned char assertion;
+	int x;
+	int y;
+	int set;
+} mne_dfa_inst;
+
+/*
+ * A Thompson NFA over byte classes: bytes no instruction tells apart share
+ * a class, so states only need a transition per class, plus one for the
+ * edge of the subject and one for a newline that ends it.
+ */
+typedef struct {
+	mne_dfa_inst *insts;
+	int num_insts;
+	int start;
+	unsigned char (*sets)[32];
+	int num_sets;
+	int reverse;
+	int contextual; /* Has assertions, so states track the neighbouring byte. */
+	unsigned char classes[256];
+	int num_classes;
+	int num_symbols;
+	int symbol_bytes[258];
+	unsigned char symbol_kinds[258];
+	const char *failed; /* Why the program can't run the pattern, if it can't. */
+} mne_dfa_prog;
+
+typedef struct {
+	mne_dfa_prog forward;
+	mne_dfa_prog reverse;
+} mne_dfa;
+
+typedef struct mne_dfa_state {
+	struct mne_dfa_state *chain;
+	unsigned int flags;
+	int num_insts;
+	int *insts;
+	struct mne_dfa_state *next[];
+} mne_dfa_state;
+
+/* One program's states, and scratch space for building more. */
+typedef struct {
+	const mne_dfa_prog *prog;
+	mne_dfa_state **buckets;
+	unsigned int num_buckets;
+	unsigned int num_states;
+	mne_dfa_state *starts[MNE_DFA_KINDS];
+	size_t bytes;
+	size_t budget;
+	int *stack;
+	int *expanded;
+	int *list;
+	unsigned int *marks;
+	unsigned int mark;
+	unsigned long built;
+	unsigned long flushes;
+	unsigned long scanned;       /* Bytes stepped over so far. */
+	unsigned long flush_scanned; /* What scanned was at the last flush. */
+	unsigned int flushed_states; /* How many states the last flush dropped. */
+} mne_dfa_side;
+
+typedef struct {
+	mne_dfa_side forward;
+	mne_dfa_side reverse;
+} mne_dfa_cache;
+
+mne_dfa *mne_dfa_compile(const mne_syntax_node*, const char**);
+void mne_dfa_free(mne_dfa*);
+mne_dfa_cache *mne_dfa_cache_new(const mne_dfa*, size_t);
+void mne_dfa_cache_free(mne_dfa_cache*);
+int mne_dfa_exec(mne_dfa_cache*, const char*, int, int, int*, int*);
+
+#endif
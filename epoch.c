@@ -0,0 +1,148 @@
+#include <limits.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "epoch.h"
+#include "common.h"
+
+static void mne_epoch_pause();
+static int mne_epoch_remaining(const struct timespec*, struct timespec*);
+
+void mne_epoch_init(mne_epoch *epoch, int spins) {
+  epoch->value = 0;
+  epoch->sleepers = 0;
+  epoch->spins = spins;
+  pthread_mutex_init(&epoch->mutex, NULL);
+  pthread_cond_init(&epoch->cond, NULL);
+}
+
+void mne_epoch_destroy(mne_epoch *epoch) {
+  pthread_mutex_destroy(&epoch->mutex);
+  pthread_cond_destroy(&epoch->cond);
+}
+
+/* Waits until the epoch is no longer seen and returns its new value. */
+unsigned int mne_epoch_wait(mne_epoch *epoch, unsigned int seen) {
+  int spins;
+
+  for (spins = 0; spins < epoch->spins; spins++) {
+    if (epoch->value != seen)
+      goto done;
+    mne_epoch_pause();
+  }
+
+  /*
+   * Sleepers is raised before the final check of value, and advance bumps value
+   * before reading sleepers; with both full barriers, either we see the new
+   * value or the advancing thread sees us and wakes us.
+   */
+  __sync_fetch_and_add(&epoch->sleepers, 1);
+
+#ifdef __linux__
+  while (epoch->value == seen)
+    syscall(SYS_futex, &epoch->value, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+#else
+  pthread_mutex_lock(&epoch->mutex);
+  while (epoch->value == seen)
+    pthread_cond_wait(&epoch->cond, &epoch->mutex);
+  pthread_mutex_unlock(&epoch->mutex);
+#endif
+
+  __sync_fetch_and_sub(&epoch->sleepers, 1);
+
+done:
+  /* Acquire whatever was published before the advance. */
+  __sync_synchronize();
+  return epoch->value;
+}
+
+/*
+ * Like mne_epoch_wait, but gives up at deadline (on CLOCK_MONOTONIC). Returns
+ * 1 if the epoch moved past seen, 0 if the deadline passed first.
+ */
+int mne_epoch_wait_until(mne_epoch *epoch, unsigned int seen, const struct timespec *deadline) {
+  struct timespec remaining;
+  int spins;
+
+  for (spins = 0; spins < epoch->spins; spins++) {
+    if (epoch->value != seen)
+      goto done;
+    mne_epoch_pause();
+  }
+
+  __sync_fetch_and_add(&epoch->sleepers, 1);
+
+#ifdef __linux__
+  /* FUTEX_WAIT takes a relative timeout, so recompute it after every wakeup. */
+  while (epoch->value == seen && mne_epoch_remaining(deadline, &remaining))
+    syscall(SYS_futex, &epoch->value, FUTEX_WAIT_PRIVATE, seen, &remaining, NULL, 0);
+#else
+  /* Condition variables time out on the wall clock. */
+  pthread_mutex_lock(&epoch->mutex);
+  while (epoch->value == seen && mne_epoch_remaining(deadline, &remaining)) {
+    struct timeval now;
+    struct timespec until;
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec + remaining.tv_sec;
+    until.tv_nsec = now.tv_usec * 1000 + remaining.tv_nsec;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&epoch->cond, &epoch->mutex, &until);
+  }
+  pthread_mutex_unlock(&epoch->mutex);
+#endif
+
+  __sync_fetch_and_sub(&epoch->sleepers, 1);
+
+  if (epoch->value == seen)
+    return 0;
+
+done:
+  __sync_synchronize();
+  return 1;
+}
+
+void mne_epoch_advance(mne_epoch *epoch) {
+  __sync_fetch_and_add(&epoch->value, 1);
+
+  if (epoch->sleepers == 0)
+    return;
+
+#ifdef __linux__
+  syscall(SYS_futex, &epoch->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+  /* Taking the mutex means no sleeper is between its check and its wait. */
+  pthread_mutex_lock(&epoch->mutex);
+  pthread_cond_broadcast(&epoch->cond);
+  pthread_mutex_unlock(&epoch->mutex);
+#endif
+}
+
+/* Stores the time left until deadline, returning 0 once it has passed. */
+static int mne_epoch_remaining(const struct timespec *deadline, struct timespec *remaining) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  remaining->tv_sec = deadline->tv_sec - now.tv_sec;
+  remaining->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+  if (remaining->tv_nsec < 0) {
+    remaining->tv_sec--;
+    remaining->tv_nsec += 1000000000;
+  }
+
+  return remaining->tv_sec > 0 || (remaining->tv_sec == 0 && remaining->tv_nsec > 0);
+}
+
+static void mne_epoch_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
@@ -0,0 +1,30 @@
+#ifndef MEANIE_EPOCH_H
+#define MEANIE_EPOCH_H
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * A counter threads can wait on to change. Waiters spin briefly, then sleep
+ * (on a futex on Linux, a condition variable elsewhere); advancing only pays
+ * for a wakeup when someone is actually asleep. Spinning only helps when the
+ * thread we wait for has a CPU of its own, so the spin count is per epoch.
+ */
+
+#define MNE_EPOCH_SPINS 2000
+
+typedef struct {
+	volatile unsigned int value;
+	volatile unsigned int sleepers;
+	int spins;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} mne_epoch;
+
+void mne_epoch_init(mne_epoch*, int);
+void mne_epoch_destroy(mne_epoch*);
+unsigned int mne_epoch_wait(mne_epoch*, unsigned int);
+int mne_epoch_wait_until(mne_epoch*, unsigned int, const struct timespec*);
+void mne_epoch_advance(mne_epoch*);
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "fixed.h"
+#include "literal.h"
+#include "syntax.h"
+#include "common.h"
+
+/*
+ * If only some letters of a literal are caseless, the caseless search finds
+ * candidates and the sets confirm them. Once a class admits most bytes,
+ * BNDM would step a byte at a time rereading its window; Shift-Or reads
+ * each byte once.
+ */
+
+/* Classes up to this size leave BNDM enough mismatches to skip on. */
+#define MNE_FIXED_NARROW_SET 32
+
+static int mne_fixed_set_size(const unsigned char*);
+static int mne_fixed_verify(const mne_fixed*, const char*);
+static int mne_fixed_find_literal(const mne_fixed*, const char*, int, int);
+static int mne_fixed_find_bndm(const mne_fixed*, const char*, int, int);
+static int mne_fixed_find_shift_or(const mne_fixed*, const char*, int, int);
+
+/* Picks a matcher for the length byte sets, which must be 1 to MNE_FIXED_MAX_LENGTH. */
+mne_fixed *mne_fixed_compile(const unsigned char (*sets)[32], int length) {
+  int i, c, narrow = 1;
+
+  assert(length > 0 && length <= MNE_FIXED_MAX_LENGTH);
+
+  mne_fixed *fixed = malloc(sizeof(mne_fixed));
+  assert(fixed != NULL);
+  memset(fixed, 0, sizeof(mne_fixed));
+  fixed->length = length;
+  memcpy(fixed->sets, sets, 32 * length);
+  fixed->method = MNE_FIXED_LITERAL;
+  fixed->exact = 1;
+
+  for (i = 0; i < length; i++) {
+    int caseless;
+
+    c = mne_syntax_byte(sets[i], &caseless);
+    if (c < 0)
+      fixed->method = MNE_FIXED_BNDM;
+    else if (caseless)
+      fixed->caseless = 1;
+    else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+      fixed->exact = 0;
+    fixed->literal[i] = c;
+
+    if (mne_fixed_set_size(sets[i]) > MNE_FIXED_NARROW_SET)
+      narrow = 0;
+  }
+
+  /* Single-case letters only need checking when the search folds case. */
+  if (!fixed->caseless)
+    fixed->exact = 1;
+
+  if (fixed->method == MNE_FIXED_LITERAL)
+    return fixed;
+
+  if (!narrow)
+    fixed->method = MNE_FIXED_SHIFT_OR;
+
+  /* BNDM reads the pattern reversed, with position 0 in the top bit; Shift-Or has it in bit 0, inverted. */
+  for (i = 0; i < length; i++) {
+    for (c = 0; c < 256; c++) {
+      if (MNE_SYNTAX_HAS(sets[i], c))
+        fixed->masks[c] |= 1ULL << (fixed->method == MNE_FIXED_BNDM ? length - 1 - i : i);
+    }
+  }
+
+  if (fixed->method == MNE_FIXED_SHIFT_OR) {
+    for (c = 0; c < 256; c++)
+      fixed->masks[c] = ~fixed->masks[c];
+  }
+
+  return fixed;
+}
+
+void mne_fixed_free(mne_fixed *fixed) {
+  free(fixed);
+}
+
+/*
+ * Finds the leftmost match in subject[0, length) from offset, setting start
+ * and end as mne_dfa_exec does. Returns 1 for a match and 0 for none.
+ */
+int mne_fixed_exec(const mne_fixed *fixed, const char *subject, int length, int offset, int *start, int *end) {
+  int found;
+
+  switch (fixed->method) {
+    case MNE_FIXED_LITERAL:
+      found = mne_fixed_find_literal(fixed, subject, length, offset);
+      break;
+    case MNE_FIXED_BNDM:
+      found = mne_fixed_find_bndm(fixed, subject, length, offset);
+      break;
+    default:
+      found = mne_fixed_find_shift_or(fixed, subject, length, offset);
+      break;
+  }
+
+  if (found < 0)
+    return 0;
+
+  *start = found;
+  *end = found + fixed->length;
+  return 1;
+}
+
+const char *mne_fixed_name(const mne_fixed *fixed) {
+  switch (fixed->method) {
+    case MNE_FIXED_LITERAL:
+      return "literal";
+    case MNE_FIXED_BNDM:
+      return "bndm";
+    default:
+      return "shift-or";
+  }
+}
+
+static int mne_fixed_set_size(const unsigned char *set) {
+  int i, size = 0;
+
+  for (i = 0; i < 32; i++)
+    size += __builtin_popcount(set[i]);
+  return size;
+}
+
+static int mne_fixed_verify(const mne_fixed *fixed, const char *p) {
+  int i;
+
+  for (i = 0; i < fixed->length; i++) {
+    if (!MNE_SYNTAX_HAS(fixed->sets[i], (unsigned char)p[i]))
+      return 0;
+  }
+
+  return 1;
+}
+
+static int mne_fixed_find_literal(const mne_fixed *fixed, const char *subject, int length, int offset) {
+  while (offset + fixed->length <= length) {
+    const char *p = mne_literal_find(subject + offset, length - offset, fixed->literal, fixed->length,
+      fixed->caseless);
+
+    if (p == NULL)
+      return -1;
+    if (likely(fixed->exact) || mne_fixed_verify(fixed, p))
+      return p - subject;
+    offset = p - subject + 1;
+  }
+
+  return -1;
+}
+
+/*
+ * Each window is read from its end while the bytes read are a factor of the
+ * pattern. One that is also a prefix, short of the whole window, is where
+ * the next window may start; a whole window that is a prefix is a match.
+ */
+static int mne_fixed_find_bndm(const mne_fixed *fixed, const char *subject, int length, int offset) {
+  int m = fixed->length, pos = offset;
+  unsigned long long all = m == 64 ? ~0ULL : (1ULL << m) - 1, high = 1ULL << (m - 1);
+
+  while (pos <= length - m) {
+    unsigned long long d = all;
+    int j = m, last = m;
+
+    /* Only a factor of length m, which is a prefix, survives reading j down to 0. */
+    while (d != 0) {
+      d &= fixed->masks[(unsigned char)subject[pos + j - 1]];
+      j--;
+      if (d & high) {
+        if (j == 0)
+          return pos;
+        last = j;
+      }
+      d = (d << 1) & all;
+    }
+
+    pos += last;
+  }
+
+  return -1;
+}
+
+/* A zero in bit i of the state means the last i + 1 bytes match the pattern's first i + 1 sets. */
+static int mne_fixed_find_shift_or(const mne_fixed *fixed, const char *subject, int length, int offset) {
+  unsigned long long d = ~0ULL, high = 1ULL << (fixed->length - 1);
+  int i;
+
+  for (i = offset; i < length; i++) {
+    d = (d << 1) | fixed->masks[(unsigned char)subject[i]];
+    if (unlikely(!(d & high)))
+      return i - fixed->length + 1;
+  }
+
+  return -1;
+}
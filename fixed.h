@@ -0,0 +1,33 @@
+#ifndef MEANIE_FIXED_H
+#define MEANIE_FIXED_H
+
+/*
+ * Bit-parallel matchers for patterns that only ever match a fixed number of
+ * bytes, each from a set: short literals and class sequences such as
+ * [A-Z]{2}[0-9]{4}. Every match has the same length, so the leftmost one
+ * is the match PCRE reports and no end needs searching for.
+ */
+
+#define MNE_FIXED_MAX_LENGTH 64
+
+/* Which matcher a pattern gets. */
+#define MNE_FIXED_LITERAL 0   /* Bytes and letters of either case: the SIMD literal search. */
+#define MNE_FIXED_BNDM 1      /* Narrow classes: BNDM, which skips ahead on a mismatch. */
+#define MNE_FIXED_SHIFT_OR 2  /* Wide classes, where BNDM would barely skip: Shift-Or. */
+
+typedef struct {
+	int method;
+	int length;
+	char literal[MNE_FIXED_MAX_LENGTH];
+	int caseless;
+	int exact;     /* The literal search alone decides a match. */
+	unsigned char sets[MNE_FIXED_MAX_LENGTH][32];
+	unsigned long long masks[256];
+} mne_fixed;
+
+mne_fixed *mne_fixed_compile(const unsigned char (*)[32], int);
+void mne_fixed_free(mne_fixed*);
+int mne_fixed_exec(const mne_fixed*, const char*, int, int, int*, int*);
+const char *mne_fixed_name(const mne_fixed*);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include <sys/time.h>
 
 #include "util.h"
@@ -12,24 +13,63 @@ static git_repository *repo;
 
 static struct timeval begin, end;
 static char **ref_names;
+static char git_dir[PATH_MAX];
 
 static void mne_git_initialize();
 static void mne_git_walk_head(mne_git_walk_ctx*);
 static void mne_git_cleanup_iter(gpointer, gpointer, gpointer);
 static void mne_git_walk_tags(mne_git_walk_ctx*, git_strarray*);
+/* Records another path of a blob already loaded, unless we have it. */
+static void mne_git_add_alias(const char *sha1, const char *root, const char *name) {
+  char path[MNE_MAX_PATH_LENGTH];
+  gpointer key, first;
+  int n = 0;
+
+  assert((strlen(root) + strlen(name)) < MNE_MAX_PATH_LENGTH);
+  strcpy(path, root);
+  strcat(path, name);
+
+  g_hash_table_lookup_extended(paths, sha1, &key, &first);
+  if (strcmp(path, (char*)first) == 0)
+    return;
+
+  char **list = g_hash_table_lookup(aliases, sha1);
+  for (; list != NULL && list[n] != NULL; n++) {
+    if (strcmp(path, list[n]) == 0)
+      return;
+  }
+
+  list = realloc(list, sizeof(char*) * (n + 2));
+  assert(list != NULL);
+  list[n] = strdup(path);
+  assert(list[n] != NULL);
+  list[n + 1] = NULL;
+
+  /* The sha1 we were given is freed; the tables share the first one's key. */
+  g_hash_table_insert(aliases, key, list);
+}
+
 static int mne_git_get_tag_commit_oid(const git_oid**, git_tag*);
 static int mne_git_tree_entry_cb(const char*, git_tree_entry*, void*);
 static int mne_git_get_tag_tree(git_tree**, git_reference**, const char*);
 static void mne_git_walk_tree(git_tree*, git_reference*, mne_git_walk_ctx*);
+static void mne_git_add_alias(const char*, const char*, const char*);
+
+const char *mne_git_dir() {
+  return git_dir;
+}
 
 void mne_git_cleanup() {
   mne_git_cleanup_ctx ctx;
   /* The same sha1 strings are used as keys for all hashes. */
   ctx.free_key = 1;
+  ctx.free_list = 0;
   g_hash_table_foreach(blobs, mne_git_cleanup_iter, &ctx);
   ctx.free_key = 0;
   g_hash_table_foreach(paths, mne_git_cleanup_iter, &ctx);
   g_hash_table_foreach(refs, mne_git_cleanup_iter, &ctx);
+  ctx.free_list = 1;
+  g_hash_table_foreach(aliases, mne_git_cleanup_iter, &ctx);
 
   int i;
   for (i = 0; i < total_refs; i++)
@@ -39,6 +79,7 @@ void mne_git_cleanup() {
 
   g_hash_table_destroy(blobs);
   g_hash_table_destroy(paths);
+  g_hash_table_destroy(aliases);
   g_hash_table_destroy(refs);
 }
 
@@ -50,6 +91,7 @@ void mne_git_load_blobs(const char *path) {
 
   git_repository_open(&repo, path);
   git_repository_odb(&odb, repo);
+  strncpy(git_dir, git_repository_path(repo), PATH_MAX - 1);
 
   git_strarray tag_names;
   git_tag_list(&tag_names, repo);
@@ -106,7 +148,7 @@ static int mne_git_tree_entry_cb(const char *root, git_tree_entry *entry, void *
       strcpy(path, root);
       strcat(path, git_tree_entry_name(entry));
 
-      /* TOOD: Check that the blob <-> path mapping is 1-1. */
+      /* Any later paths of the same blob go in aliases. */
       g_hash_table_insert(paths, (gpointer)sha1, (gpointer)path);
       g_hash_table_insert(blobs, (gpointer)sha1, (gpointer)data);
 
@@ -121,6 +163,7 @@ static int mne_git_tree_entry_cb(const char *root, git_tree_entry *entry, void *
 
       g_hash_table_insert(refs, (gpointer)sha1, (gpointer)sha1_refs);
     } else {
+      mne_git_add_alias(sha1, root, git_tree_entry_name(entry));
       sha1_refs = g_hash_table_lookup(refs, (gpointer)sha1);
       free(sha1);
     }
@@ -129,6 +172,9 @@ static int mne_git_tree_entry_cb(const char *root, git_tree_entry *entry, void *
 
     int i;
     for (i = 0; i < total_refs; i++) {
+      /* A blob at several paths in one tree is still only in its ref once. */
+      if (sha1_refs[i] == ctx->ref_name)
+        break;
       if (sha1_refs[i] != NULL)
         continue;
 
@@ -212,6 +258,7 @@ static void mne_git_initialize() {
   total_refs = 0;
   blobs = g_hash_table_new(g_str_hash, g_str_equal);
   paths = g_hash_table_new(g_str_hash, g_str_equal);
+  aliases = g_hash_table_new(g_str_hash, g_str_equal);
   refs = g_hash_table_new(g_str_hash, g_str_equal);  
 }
 
@@ -260,5 +307,12 @@ static void mne_git_cleanup_iter(gpointer key, gpointer value, gpointer args) {
   if (ctx->free_key)
     free(key);
 
+  if (ctx->free_list) {
+    char **list = value;
+    int i;
+    for (i = 0; list[i] != NULL; i++)
+      free(list[i]);
+  }
+
   free(value);
 }
\ No newline at end of file
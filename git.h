@@ -12,6 +12,7 @@ unsigned int total_refs;
 
 GHashTable *blobs;
 GHashTable *paths;
+GHashTable *aliases; /* The blob's other paths, if any, NULL terminated. */
 GHashTable *refs;
 
 typedef struct {
@@ -23,9 +24,11 @@ typedef struct {
 
 typedef struct {
 	int free_key;
+	int free_list;
 } mne_git_cleanup_ctx;
 
 void mne_git_cleanup();
 void mne_git_load_blobs(const char*);
+const char *mne_git_dir();
 
 #endif
\ No newline at end of file
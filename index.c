@@ -0,0 +1,1151 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <glib.h>
+
+#include "util.h"
+#include "posting.h"
+#include "literal.h"
+#include "index.h"
+#include "search.h"
+#include "common.h"
+
+/*
+ * The content index is a set of immutable trigram segments on disk plus a
+ * small text MANIFEST naming the live ones. New blobs go into a fresh segment,
+ * blobs that disappear from the corpus are tombstoned, and a background thread
+ * merges segments of similar size (LSM style), dropping tombstoned blobs.
+ *
+ * Segment layout (host byte order):
+ *   header | docs: num_docs * 40 byte sha1s | trigrams: sorted table | postings
+ * Postings are encoded lists (see posting.h); a trigram's offset is in words
+ * and num_postings counts words. Trigrams are ASCII case folded, so one index
+ * serves both case-sensitive and caseless queries.
+ */
+
+#define MNE_INDEX_MAGIC "MNESEG03"
+#define MNE_INDEX_MANIFEST "MANIFEST"
+#define MNE_INDEX_MANIFEST_VERSION 3
+#define MNE_INDEX_SHA1_LENGTH 40
+#define MNE_INDEX_TRIGRAMS (1 << 24)
+#define MNE_INDEX_BUCKETS (1 << 12)
+
+typedef struct {
+	char magic[8];
+	uint32_t num_docs;
+	uint32_t num_trigrams;
+	uint32_t num_postings;
+	uint32_t reserved;
+} mne_segment_header;
+
+typedef struct {
+	uint32_t trigram;
+	uint32_t offset;
+	uint32_t count;
+} mne_segment_trigram;
+
+typedef struct {
+	char name[32];
+	void *map;
+	size_t map_size;
+	const mne_segment_header *header;
+	const char *docs;
+	const mne_segment_trigram *trigrams;
+	const uint32_t *postings;
+	int *doc_blobs;
+	int refs;
+	int retired;
+} mne_segment;
+
+typedef struct {
+	int all;
+	uint32_t *docs;
+	uint32_t count;
+} mne_docset;
+
+typedef struct {
+	uint64_t *keys;
+	size_t num_keys;
+	size_t buckets[MNE_INDEX_BUCKETS + 1];
+} mne_index_partial;
+
+typedef struct {
+	int *ordinals;
+	char **data;
+	int *sizes;
+	int *doc_first;
+	int *bucket_first;
+	size_t *bucket_start;
+	mne_index_partial *partials;
+	uint32_t *postings;
+	mne_segment_trigram **tables;
+	uint32_t *table_sizes;
+	uint32_t **words;
+	uint32_t *word_sizes;
+} mne_index_build_ctx;
+
+static char *index_path;
+static pthread_t merge_thread;
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t merge_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merge_cond = PTHREAD_COND_INITIALIZER;
+static int merge_exiting = 0;
+static mne_segment **segments = NULL;
+static int num_segments = 0;
+static unsigned int next_segment = 1;
+static GHashTable *tombstones;
+
+static void mne_index_read_manifest();
+static void mne_index_write_manifest();
+static void mne_index_add_segment(mne_segment*);
+static void mne_index_unref_segment(mne_segment*);
+static mne_segment *mne_index_open_segment(const char*);
+static mne_segment *mne_index_write_segment(const char*, uint32_t, const mne_segment_trigram*, uint32_t, const uint32_t*, uint32_t);
+static mne_segment *mne_index_build_segment(int*, int, char**, char**, int*);
+static void mne_index_build_partial(int, void*);
+static void mne_index_build_merge(int, void*);
+static double mne_index_seconds(struct timeval*, struct timeval*);
+static void *mne_index_merge_loop(void*);
+static int mne_index_pick_merge(mne_segment**);
+static mne_segment *mne_index_merge(mne_segment**, unsigned char**, int, int**, uint32_t**);
+static void mne_index_eval(mne_segment*, mne_plan_node*, mne_docset*);
+static const mne_segment_trigram *mne_index_lookup(mne_segment*, uint32_t);
+static void mne_index_tombstone(const char*);
+static void mne_index_untombstone(const char*);
+static void mne_index_forget_dead(mne_segment**, unsigned char**, int);
+
+void mne_index_open(const char *path) {
+  index_path = strdup(path);
+  assert(index_path != NULL);
+
+  if (mkdir(index_path, 0755) != 0 && errno != EEXIST) {
+    printf("ERROR: Failed to create index directory %s.\n", index_path);
+    exit(1);
+  }
+
+  tombstones = g_hash_table_new(g_str_hash, g_str_equal);
+  mne_index_read_manifest();
+
+  int err = pthread_create(&merge_thread, NULL, mne_index_merge_loop, NULL);
+  assert(err == 0);
+}
+
+void mne_index_close() {
+  pthread_mutex_lock(&index_mutex);
+  merge_exiting = 1;
+  pthread_cond_signal(&merge_cond);
+  pthread_mutex_unlock(&index_mutex);
+  pthread_join(merge_thread, NULL);
+
+  int i;
+  for (i = 0; i < num_segments; i++) {
+    munmap(segments[i]->map, segments[i]->map_size);
+    free(segments[i]->doc_blobs);
+    free(segments[i]);
+  }
+
+  free(segments);
+  segments = NULL;
+  num_segments = 0;
+
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, tombstones);
+  while (g_hash_table_iter_next(&iter, &key, NULL))
+    free(key);
+  g_hash_table_destroy(tombstones);
+  free(index_path);
+}
+
+/*
+ * Points every indexed doc at its blob in the current corpus, tombstones docs
+ * that are gone and indexes blobs that no segment covers yet.
+ */
+void mne_index_sync(char **sha1s, char **data, int *sizes, int count) {
+  struct timeval begin, end;
+  gettimeofday(&begin, NULL);
+
+  pthread_mutex_lock(&merge_mutex);
+  pthread_mutex_lock(&index_mutex);
+
+  GHashTable *ordinals = g_hash_table_new(g_str_hash, g_str_equal);
+  unsigned char *indexed = calloc(count, sizeof(unsigned char));
+  assert(indexed != NULL);
+  char sha1[MNE_INDEX_SHA1_LENGTH + 1];
+  int i, n, num_missing = 0;
+  size_t corpus_bytes = 0, index_bytes = 0;
+  uint32_t d;
+
+  for (n = 0; n < count; n++) {
+    g_hash_table_insert(ordinals, sha1s[n], GINT_TO_POINTER(n + 1));
+    corpus_bytes += sizes[n];
+  }
+
+  for (i = 0; i < num_segments; i++) {
+    mne_segment *seg = segments[i];
+    for (d = 0; d < seg->header->num_docs; d++) {
+      memcpy(sha1, seg->docs + d * MNE_INDEX_SHA1_LENGTH, MNE_INDEX_SHA1_LENGTH);
+      sha1[MNE_INDEX_SHA1_LENGTH] = 0;
+      int ordinal = GPOINTER_TO_INT(g_hash_table_lookup(ordinals, sha1)) - 1;
+
+      seg->doc_blobs[d] = ordinal;
+      if (ordinal >= 0) {
+        indexed[ordinal] = 1;
+        mne_index_untombstone(sha1);
+      } else {
+        mne_index_tombstone(sha1);
+      }
+    }
+  }
+
+  g_hash_table_destroy(ordinals);
+  pthread_mutex_unlock(&index_mutex);
+
+  int *missing = malloc(sizeof(int) * (count + 1));
+  assert(missing != NULL);
+  for (n = 0; n < count; n++) {
+    if (!indexed[n])
+      missing[num_missing++] = n;
+  }
+  free(indexed);
+
+  if (num_missing > 0) {
+    mne_segment *seg = mne_index_build_segment(missing, num_missing, sha1s, data, sizes);
+    if (seg != NULL) {
+      for (i = 0; i < num_missing; i++)
+        seg->doc_blobs[i] = missing[i];
+      pthread_mutex_lock(&index_mutex);
+      mne_index_add_segment(seg);
+      pthread_mutex_unlock(&index_mutex);
+    }
+  }
+  free(missing);
+
+  pthread_mutex_lock(&index_mutex);
+  mne_index_write_manifest();
+  pthread_cond_signal(&merge_cond);
+  int live_segments = num_segments, num_tombstones = g_hash_table_size(tombstones);
+  for (i = 0; i < num_segments; i++)
+    index_bytes += segments[i]->map_size;
+  pthread_mutex_unlock(&index_mutex);
+  pthread_mutex_unlock(&merge_mutex);
+
+  gettimeofday(&end, NULL);
+  printf(" * index: %d segments, %.2fmb (%.1f%% of corpus), +%d blobs, %d tombstones ", live_segments,
+    index_bytes / 1048576.0, corpus_bytes > 0 ? 100.0 * index_bytes / corpus_bytes : 0.0, num_missing, num_tombstones);
+  mne_print_duration(&end, &begin);
+  printf("\n");
+}
+
+/*
+ * Marks every blob the plan could match. Returns the number of candidates, or
+ * -1 if the plan has no literals the index can use.
+ */
+int mne_index_candidates(mne_plan_node *plan, unsigned char *mask, int num_blobs) {
+  if (plan->op == MNE_PLAN_ANY)
+    return -1;
+
+  memset(mask, 0, sizeof(unsigned char) * num_blobs);
+
+  pthread_mutex_lock(&index_mutex);
+  int i, count = 0, snapshot_size = num_segments;
+  mne_segment **snapshot = malloc(sizeof(mne_segment*) * (snapshot_size + 1));
+  assert(snapshot != NULL);
+  for (i = 0; i < snapshot_size; i++) {
+    snapshot[i] = segments[i];
+    snapshot[i]->refs++;
+  }
+  pthread_mutex_unlock(&index_mutex);
+
+  for (i = 0; i < snapshot_size; i++) {
+    mne_segment *seg = snapshot[i];
+    mne_docset set;
+    uint32_t d, num_docs;
+
+    mne_index_eval(seg, plan, &set);
+    num_docs = set.all ? seg->header->num_docs : set.count;
+
+    for (d = 0; d < num_docs; d++) {
+      int blob = seg->doc_blobs[set.all ? d : set.docs[d]];
+      if (blob >= 0 && blob < num_blobs && !mask[blob]) {
+        mask[blob] = 1;
+        count++;
+      }
+    }
+
+    free(set.docs);
+  }
+
+  pthread_mutex_lock(&index_mutex);
+  for (i = 0; i < snapshot_size; i++)
+    mne_index_unref_segment(snapshot[i]);
+  pthread_mutex_unlock(&index_mutex);
+  free(snapshot);
+
+  return count;
+}
+
+static void mne_index_eval(mne_segment *seg, mne_plan_node *node, mne_docset *set) {
+  int i;
+  set->all = 0;
+  set->docs = NULL;
+  set->count = 0;
+
+  if (node->op == MNE_PLAN_ANY || (node->op == MNE_PLAN_LITERAL && node->length < 3)) {
+    set->all = 1;
+    return;
+  }
+
+  if (node->op == MNE_PLAN_LITERAL) {
+    unsigned char s[node->length];
+    const mne_segment_trigram *smallest = NULL;
+
+    for (i = 0; i < node->length; i++)
+      s[i] = MNE_LITERAL_FOLD(node->literal[i]);
+
+    for (i = 0; i + 2 < node->length; i++) {
+      const mne_segment_trigram *t = mne_index_lookup(seg, (s[i] << 16) | (s[i + 1] << 8) | s[i + 2]);
+      if (t == NULL)
+        return;
+      if (smallest == NULL || t->count < smallest->count)
+        smallest = t;
+    }
+
+    /* Decode only the shortest list; the rest are probed through their skips. */
+    set->docs = malloc(sizeof(uint32_t) * (smallest->count + MNE_POSTING_BLOCK));
+    assert(set->docs != NULL);
+    set->count = mne_posting_decode(seg->postings + smallest->offset, set->docs);
+
+    for (i = 0; i + 2 < node->length && set->count > 0; i++) {
+      const mne_segment_trigram *t = mne_index_lookup(seg, (s[i] << 16) | (s[i + 1] << 8) | s[i + 2]);
+      if (t != smallest)
+        set->count = mne_posting_intersect_encoded(set->docs, set->count, seg->postings + t->offset, set->docs);
+    }
+    return;
+  }
+
+  for (i = 0; i < node->num_children; i++) {
+    mne_docset child;
+    mne_index_eval(seg, node->children[i], &child);
+
+    if (node->op == MNE_PLAN_AND) {
+      if (child.all)
+        continue;
+      if (set->docs == NULL && !set->all) {
+        *set = child;
+      } else {
+        set->count = mne_posting_intersect(set->docs, set->count, child.docs, child.count, set->docs);
+        free(child.docs);
+      }
+      if (set->count == 0)
+        return;
+    } else {
+      if (child.all) {
+        free(set->docs);
+        set->docs = NULL;
+        set->count = 0;
+        set->all = 1;
+        return;
+      }
+
+      uint32_t count;
+      uint32_t *merged = mne_posting_union(set->docs, set->count, child.docs, child.count, &count);
+      free(set->docs);
+      free(child.docs);
+      set->docs = merged;
+      set->count = count;
+    }
+  }
+
+  /* An AND whose children were all unconstrained. */
+  if (node->op == MNE_PLAN_AND && set->docs == NULL)
+    set->all = 1;
+}
+
+static const mne_segment_trigram *mne_index_lookup(mne_segment *seg, uint32_t trigram) {
+  uint32_t lo = 0, hi = seg->header->num_trigrams;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (seg->trigrams[mid].trigram < trigram)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo < seg->header->num_trigrams && seg->trigrams[lo].trigram == trigram)
+    return &seg->trigrams[lo];
+
+  return NULL;
+}
+
+/*
+ * Builds a segment on the search threads. Each thread extracts the trigrams
+ * of a byte-balanced range of docs into its own radix-sorted partial postings.
+ * The trigram space is then cut into buckets balanced by key count and each
+ * thread merges its buckets across all partials; since partials hold
+ * ascending doc ranges, a stable counting pass per bucket keeps postings
+ * sorted.
+ */
+static mne_segment *mne_index_build_segment(int *ordinals, int count, char **sha1s, char **data, int *sizes) {
+  struct timeval begin, partial_end, merge_end, write_end;
+  int t, d, b, num_threads = mne_search_threads();
+  mne_index_build_ctx ctx;
+  size_t bytes = 0, total = 0, target;
+
+  gettimeofday(&begin, NULL);
+
+  ctx.ordinals = ordinals;
+  ctx.data = data;
+  ctx.sizes = sizes;
+  ctx.doc_first = malloc(sizeof(int) * (num_threads + 1));
+  ctx.bucket_first = malloc(sizeof(int) * (num_threads + 1));
+  ctx.bucket_start = malloc(sizeof(size_t) * (MNE_INDEX_BUCKETS + 1));
+  ctx.partials = malloc(sizeof(mne_index_partial) * num_threads);
+  ctx.tables = malloc(sizeof(mne_segment_trigram*) * num_threads);
+  ctx.table_sizes = malloc(sizeof(uint32_t) * num_threads);
+  ctx.words = malloc(sizeof(uint32_t*) * num_threads);
+  ctx.word_sizes = malloc(sizeof(uint32_t) * num_threads);
+  assert(ctx.doc_first != NULL && ctx.bucket_first != NULL && ctx.bucket_start != NULL && ctx.partials != NULL &&
+    ctx.tables != NULL && ctx.table_sizes != NULL && ctx.words != NULL && ctx.word_sizes != NULL);
+
+  for (d = 0; d < count; d++)
+    bytes += sizes[ordinals[d]];
+
+  /* Byte-balanced doc ranges. */
+  ctx.doc_first[0] = 0;
+  for (t = 1, d = 0, total = 0; t < num_threads; t++) {
+    target = bytes / num_threads * t;
+    while (d < count && total < target)
+      total += sizes[ordinals[d++]];
+    ctx.doc_first[t] = d;
+  }
+  ctx.doc_first[num_threads] = count;
+
+  mne_search_parallel(mne_index_build_partial, &ctx);
+  gettimeofday(&partial_end, NULL);
+
+  /* Global bucket offsets, then buckets split evenly by key count. */
+  size_t num_keys = 0;
+  for (b = 0; b < MNE_INDEX_BUCKETS; b++) {
+    ctx.bucket_start[b] = num_keys;
+    for (t = 0; t < num_threads; t++)
+      num_keys += ctx.partials[t].buckets[b + 1] - ctx.partials[t].buckets[b];
+  }
+  ctx.bucket_start[MNE_INDEX_BUCKETS] = num_keys;
+
+  ctx.bucket_first[0] = 0;
+  for (t = 1, b = 0; t < num_threads; t++) {
+    while (b < MNE_INDEX_BUCKETS && ctx.bucket_start[b] < num_keys / num_threads * t)
+      b++;
+    ctx.bucket_first[t] = b;
+  }
+  ctx.bucket_first[num_threads] = MNE_INDEX_BUCKETS;
+
+  ctx.postings = malloc(sizeof(uint32_t) * (num_keys + 1));
+  assert(ctx.postings != NULL);
+
+  mne_search_parallel(mne_index_build_merge, &ctx);
+
+  uint32_t num_trigrams = 0, num_words = 0, i;
+  for (t = 0; t < num_threads; t++) {
+    num_trigrams += ctx.table_sizes[t];
+    num_words += ctx.word_sizes[t];
+    free(ctx.partials[t].keys);
+  }
+  free(ctx.postings);
+
+  /* Concatenate the per-thread tables and encoded lists, rebasing offsets. */
+  mne_segment_trigram *trigrams = malloc(sizeof(mne_segment_trigram) * (num_trigrams + 1));
+  uint32_t *words = malloc(sizeof(uint32_t) * (num_words + 1));
+  assert(trigrams != NULL && words != NULL);
+  for (t = 0, num_trigrams = 0, num_words = 0; t < num_threads; t++) {
+    for (i = 0; i < ctx.table_sizes[t]; i++) {
+      trigrams[num_trigrams + i] = ctx.tables[t][i];
+      trigrams[num_trigrams + i].offset += num_words;
+    }
+    memcpy(words + num_words, ctx.words[t], sizeof(uint32_t) * ctx.word_sizes[t]);
+    num_trigrams += ctx.table_sizes[t];
+    num_words += ctx.word_sizes[t];
+    free(ctx.tables[t]);
+    free(ctx.words[t]);
+  }
+  gettimeofday(&merge_end, NULL);
+
+  char name[32];
+  pthread_mutex_lock(&index_mutex);
+  snprintf(name, sizeof(name), "seg-%06u.mne", next_segment++);
+  pthread_mutex_unlock(&index_mutex);
+
+  mne_segment *seg = mne_index_write_segment(name, count, trigrams, num_trigrams, words, num_words);
+  for (d = 0; d < count; d++)
+    memcpy((char*)seg->docs + d * MNE_INDEX_SHA1_LENGTH, sha1s[ordinals[d]], MNE_INDEX_SHA1_LENGTH);
+  msync(seg->map, seg->map_size, MS_SYNC);
+  gettimeofday(&write_end, NULL);
+
+  double mb = bytes / 1048576.0;
+  printf(" * index build: %d threads, %.2fmb, partial %.1fmb/s, merge %.1fmb/s, write %.1fmb/s\n", num_threads, mb,
+    mb / mne_index_seconds(&partial_end, &begin), mb / mne_index_seconds(&merge_end, &partial_end),
+    mb / mne_index_seconds(&write_end, &merge_end));
+
+  free(trigrams);
+  free(words);
+  free(ctx.doc_first);
+  free(ctx.bucket_first);
+  free(ctx.bucket_start);
+  free(ctx.partials);
+  free(ctx.tables);
+  free(ctx.table_sizes);
+  free(ctx.words);
+  free(ctx.word_sizes);
+  return seg;
+}
+
+static void mne_index_build_partial(int thread, void *arg) {
+  mne_index_build_ctx *ctx = (mne_index_build_ctx*)arg;
+  mne_index_partial *partial = &ctx->partials[thread];
+  int d, i, b;
+
+  unsigned char *seen = calloc(MNE_INDEX_TRIGRAMS / 8, sizeof(unsigned char));
+  assert(seen != NULL);
+
+  size_t num_keys = 0, keys_size = 1 << 16, k;
+  uint64_t *keys = malloc(sizeof(uint64_t) * keys_size);
+  assert(keys != NULL);
+
+  for (d = ctx->doc_first[thread]; d < ctx->doc_first[thread + 1]; d++) {
+    int n = ctx->ordinals[d];
+    const unsigned char *s = (const unsigned char*)ctx->data[n];
+    size_t doc_start = num_keys;
+    uint32_t trigram = 0;
+
+    for (i = 0; i < ctx->sizes[n]; i++) {
+      trigram = ((trigram << 8) | MNE_LITERAL_FOLD(s[i])) & (MNE_INDEX_TRIGRAMS - 1);
+      if (i < 2 || (seen[trigram >> 3] & (1 << (trigram & 7))))
+        continue;
+
+      seen[trigram >> 3] |= 1 << (trigram & 7);
+      if (unlikely(num_keys == keys_size)) {
+        keys_size *= 2;
+        keys = realloc(keys, sizeof(uint64_t) * keys_size);
+        assert(keys != NULL);
+      }
+      keys[num_keys++] = ((uint64_t)trigram << 32) | (uint32_t)d;
+    }
+
+    for (; doc_start < num_keys; doc_start++) {
+      trigram = keys[doc_start] >> 32;
+      seen[trigram >> 3] &= ~(1 << (trigram & 7));
+    }
+  }
+
+  free(seen);
+
+  /*
+   * Keys are generated in doc order, so a stable two pass LSD radix sort on
+   * the 24 trigram bits leaves them sorted by (trigram, doc). The second pass's
+   * histogram is the bucket table the merge needs.
+   */
+  uint64_t *tmp = malloc(sizeof(uint64_t) * (num_keys + 1));
+  assert(tmp != NULL);
+  size_t *counts = partial->buckets;
+  int pass;
+
+  for (pass = 0; pass < 2; pass++) {
+    int shift = 32 + pass * 12;
+    uint64_t *from = pass == 0 ? keys : tmp, *to = pass == 0 ? tmp : keys;
+
+    memset(counts, 0, sizeof(size_t) * (MNE_INDEX_BUCKETS + 1));
+    for (k = 0; k < num_keys; k++)
+      counts[((from[k] >> shift) & (MNE_INDEX_BUCKETS - 1)) + 1]++;
+    for (b = 0; b < MNE_INDEX_BUCKETS; b++)
+      counts[b + 1] += counts[b];
+    for (k = 0; k < num_keys; k++)
+      to[counts[(from[k] >> shift) & (MNE_INDEX_BUCKETS - 1)]++] = from[k];
+  }
+
+  /* The scatter advanced each count to its bucket's end; shift back to starts. */
+  memmove(counts + 1, counts, sizeof(size_t) * MNE_INDEX_BUCKETS);
+  counts[0] = 0;
+
+  free(tmp);
+  partial->keys = keys;
+  partial->num_keys = num_keys;
+}
+
+static void mne_index_build_merge(int thread, void *arg) {
+  mne_index_build_ctx *ctx = (mne_index_build_ctx*)arg;
+  int b, p, low, num_threads = mne_search_threads();
+  uint32_t counts[MNE_INDEX_BUCKETS];
+  size_t next[MNE_INDEX_BUCKETS], k;
+  uint32_t table_size = 0, table_capacity = 1024, table_first, num_words = 0, words_capacity = 1 << 16;
+  mne_segment_trigram *table = malloc(sizeof(mne_segment_trigram) * table_capacity);
+  uint32_t *words = malloc(sizeof(uint32_t) * words_capacity);
+  assert(table != NULL && words != NULL);
+
+  for (b = ctx->bucket_first[thread]; b < ctx->bucket_first[thread + 1]; b++) {
+    size_t pos = ctx->bucket_start[b];
+    if (ctx->bucket_start[b + 1] == pos)
+      continue;
+
+    table_first = table_size;
+    memset(counts, 0, sizeof(counts));
+    for (p = 0; p < num_threads; p++) {
+      mne_index_partial *partial = &ctx->partials[p];
+      for (k = partial->buckets[b]; k < partial->buckets[b + 1]; k++)
+        counts[(partial->keys[k] >> 32) & (MNE_INDEX_BUCKETS - 1)]++;
+    }
+
+    for (low = 0; low < MNE_INDEX_BUCKETS; low++) {
+      if (counts[low] == 0)
+        continue;
+
+      if (table_size == table_capacity) {
+        table_capacity *= 2;
+        table = realloc(table, sizeof(mne_segment_trigram) * table_capacity);
+        assert(table != NULL);
+      }
+
+      table[table_size].trigram = (b << 12) | low;
+      table[table_size].offset = pos;
+      table[table_size].count = counts[low];
+      table_size++;
+      next[low] = pos;
+      pos += counts[low];
+    }
+
+    /* Partials in thread order hold ascending docs, so this keeps postings sorted. */
+    for (p = 0; p < num_threads; p++) {
+      mne_index_partial *partial = &ctx->partials[p];
+      for (k = partial->buckets[b]; k < partial->buckets[b + 1]; k++)
+        ctx->postings[next[(partial->keys[k] >> 32) & (MNE_INDEX_BUCKETS - 1)]++] = (uint32_t)partial->keys[k];
+    }
+
+    /* Encode this bucket's lists; offsets become word offsets local to the thread. */
+    for (; table_first < table_size; table_first++) {
+      mne_segment_trigram *entry = &table[table_first];
+      uint32_t max_words = mne_posting_max_words(entry->count);
+
+      while (num_words + max_words > words_capacity) {
+        words_capacity *= 2;
+        words = realloc(words, sizeof(uint32_t) * words_capacity);
+        assert(words != NULL);
+      }
+
+      uint32_t offset = num_words;
+      num_words += mne_posting_encode(ctx->postings + entry->offset, entry->count, words + num_words);
+      entry->offset = offset;
+    }
+  }
+
+  ctx->tables[thread] = table;
+  ctx->table_sizes[thread] = table_size;
+  ctx->words[thread] = words;
+  ctx->word_sizes[thread] = num_words;
+}
+
+static double mne_index_seconds(struct timeval *end, struct timeval *begin) {
+  double seconds = (end->tv_sec - begin->tv_sec) + (end->tv_usec - begin->tv_usec) / 1000000.0;
+  return seconds > 0 ? seconds : 0.000001;
+}
+
+/*
+ * Writes a segment whose docs are filled in by the caller through the
+ * returned (still writable) mapping, then made durable on msync.
+ */
+static mne_segment *mne_index_write_segment(const char *name, uint32_t num_docs, const mne_segment_trigram *trigrams,
+    uint32_t num_trigrams, const uint32_t *postings, uint32_t num_postings) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", index_path, name);
+
+  size_t docs_size = (MNE_INDEX_SHA1_LENGTH * (size_t)num_docs + 3) & ~(size_t)3;
+  size_t size = sizeof(mne_segment_header) + docs_size + sizeof(mne_segment_trigram) * num_trigrams +
+    sizeof(uint32_t) * num_postings;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    printf("ERROR: Failed to create index segment %s.\n", path);
+    exit(1);
+  }
+
+  char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(map != MAP_FAILED);
+  close(fd);
+
+  mne_segment_header *header = (mne_segment_header*)map;
+  memcpy(header->magic, MNE_INDEX_MAGIC, 8);
+  header->num_docs = num_docs;
+  header->num_trigrams = num_trigrams;
+  header->num_postings = num_postings;
+  header->reserved = 0;
+
+  char *p = map + sizeof(mne_segment_header) + docs_size;
+  memcpy(p, trigrams, sizeof(mne_segment_trigram) * num_trigrams);
+  p += sizeof(mne_segment_trigram) * num_trigrams;
+  memcpy(p, postings, sizeof(uint32_t) * num_postings);
+
+  mne_segment *seg = malloc(sizeof(mne_segment));
+  assert(seg != NULL);
+  strncpy(seg->name, name, sizeof(seg->name) - 1);
+  seg->name[sizeof(seg->name) - 1] = 0;
+  seg->map = map;
+  seg->map_size = size;
+  seg->header = header;
+  seg->docs = map + sizeof(mne_segment_header);
+  seg->trigrams = (const mne_segment_trigram*)(map + sizeof(mne_segment_header) + docs_size);
+  seg->postings = (const uint32_t*)p;
+  seg->doc_blobs = malloc(sizeof(int) * (num_docs + 1));
+  assert(seg->doc_blobs != NULL);
+  seg->refs = 0;
+  seg->retired = 0;
+  return seg;
+}
+
+static mne_segment *mne_index_open_segment(const char *name) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", index_path, name);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  fstat(fd, &st);
+
+  if (st.st_size < sizeof(mne_segment_header)) {
+    close(fd);
+    return NULL;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  const mne_segment_header *header = (const mne_segment_header*)map;
+  size_t docs_size = (MNE_INDEX_SHA1_LENGTH * (size_t)header->num_docs + 3) & ~(size_t)3;
+  size_t size = sizeof(mne_segment_header) + docs_size + sizeof(mne_segment_trigram) * header->num_trigrams +
+    sizeof(uint32_t) * header->num_postings;
+
+  if (memcmp(header->magic, MNE_INDEX_MAGIC, 8) != 0 || size != st.st_size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  mne_segment *seg = malloc(sizeof(mne_segment));
+  assert(seg != NULL);
+  strncpy(seg->name, name, sizeof(seg->name) - 1);
+  seg->name[sizeof(seg->name) - 1] = 0;
+  seg->map = map;
+  seg->map_size = size;
+  seg->header = header;
+  seg->docs = map + sizeof(mne_segment_header);
+  seg->trigrams = (const mne_segment_trigram*)(map + sizeof(mne_segment_header) + docs_size);
+  seg->postings = (const uint32_t*)(map + sizeof(mne_segment_header) + docs_size +
+    sizeof(mne_segment_trigram) * header->num_trigrams);
+  seg->doc_blobs = malloc(sizeof(int) * (header->num_docs + 1));
+  assert(seg->doc_blobs != NULL);
+
+  uint32_t d;
+  for (d = 0; d < header->num_docs; d++)
+    seg->doc_blobs[d] = -1;
+
+  seg->refs = 0;
+  seg->retired = 0;
+  return seg;
+}
+
+/* Called with index_mutex held. */
+static void mne_index_add_segment(mne_segment *seg) {
+  msync(seg->map, seg->map_size, MS_SYNC);
+  mprotect(seg->map, seg->map_size, PROT_READ);
+
+  segments = realloc(segments, sizeof(mne_segment*) * (num_segments + 1));
+  assert(segments != NULL);
+  segments[num_segments++] = seg;
+  seg->refs++;
+}
+
+/* Called with index_mutex held. Retired segments are deleted once unused. */
+static void mne_index_unref_segment(mne_segment *seg) {
+  if (--seg->refs > 0 || !seg->retired)
+    return;
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", index_path, seg->name);
+  munmap(seg->map, seg->map_size);
+  unlink(path);
+  free(seg->doc_blobs);
+  free(seg);
+}
+
+static void mne_index_read_manifest() {
+  char path[PATH_MAX], line[256], value[128];
+  unsigned int version = 0;
+  snprintf(path, sizeof(path), "%s/%s", index_path, MNE_INDEX_MANIFEST);
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return;
+
+  if (fgets(line, sizeof(line), fp) == NULL || sscanf(line, "meanie-index %u", &version) != 1 ||
+      version != MNE_INDEX_MANIFEST_VERSION) {
+    printf(" ! index at %s has an unknown format, rebuilding.\n", index_path);
+
+    /* Old segments would never be merged away, so remove them now. */
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (sscanf(line, "segment %127s", value) == 1 && strchr(value, '/') == NULL) {
+        snprintf(path, sizeof(path), "%s/%s", index_path, value);
+        unlink(path);
+      }
+    }
+    fclose(fp);
+    return;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "next %u", &next_segment) == 1)
+      continue;
+
+    if (sscanf(line, "segment %127s", value) == 1) {
+      mne_segment *seg = mne_index_open_segment(value);
+      if (seg == NULL) {
+        printf(" ! index segment %s is missing or corrupt, its blobs will be reindexed.\n", value);
+        continue;
+      }
+      mne_index_add_segment(seg);
+    } else if (sscanf(line, "tombstone %127s", value) == 1) {
+      mne_index_tombstone(value);
+    }
+  }
+
+  fclose(fp);
+}
+
+/* Called with index_mutex held. Replaces the manifest atomically. */
+static void mne_index_write_manifest() {
+  char path[PATH_MAX], tmp_path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", index_path, MNE_INDEX_MANIFEST);
+  snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", index_path, MNE_INDEX_MANIFEST);
+
+  FILE *fp = fopen(tmp_path, "w");
+  if (fp == NULL) {
+    printf("ERROR: Failed to write %s.\n", tmp_path);
+    exit(1);
+  }
+
+  fprintf(fp, "meanie-index %d\n", MNE_INDEX_MANIFEST_VERSION);
+  fprintf(fp, "next %u\n", next_segment);
+
+  int i;
+  for (i = 0; i < num_segments; i++)
+    fprintf(fp, "segment %s\n", segments[i]->name);
+
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, tombstones);
+  while (g_hash_table_iter_next(&iter, &key, NULL))
+    fprintf(fp, "tombstone %s\n", (char*)key);
+
+  fflush(fp);
+  fsync(fileno(fp));
+  fclose(fp);
+  rename(tmp_path, path);
+}
+
+static void mne_index_tombstone(const char *sha1) {
+  if (g_hash_table_lookup(tombstones, sha1) != NULL)
+    return;
+
+  char *key = strdup(sha1);
+  assert(key != NULL);
+  g_hash_table_insert(tombstones, key, GINT_TO_POINTER(1));
+}
+
+static void mne_index_untombstone(const char *sha1) {
+  gpointer key;
+
+  if (g_hash_table_lookup_extended(tombstones, sha1, &key, NULL)) {
+    g_hash_table_remove(tombstones, sha1);
+    free(key);
+  }
+}
+
+/*
+ * Called with index_mutex held, once the victims have left the live list.
+ * Drops the tombstones of their dead docs, unless a live segment still holds
+ * the same sha1.
+ */
+static void mne_index_forget_dead(mne_segment **victims, unsigned char **dead, int n) {
+  GHashTable *gone = g_hash_table_new(g_str_hash, g_str_equal);
+  char sha1[MNE_INDEX_SHA1_LENGTH + 1], *keys;
+  size_t num_dead = 0;
+  int i;
+  uint32_t d;
+
+  for (i = 0; i < n; i++) {
+    for (d = 0; d < victims[i]->header->num_docs; d++)
+      num_dead += dead[i][d];
+  }
+
+  keys = malloc((MNE_INDEX_SHA1_LENGTH + 1) * (num_dead + 1));
+  assert(keys != NULL);
+  num_dead = 0;
+
+  for (i = 0; i < n; i++) {
+    for (d = 0; d < victims[i]->header->num_docs; d++) {
+      if (!dead[i][d])
+        continue;
+      char *key = keys + (MNE_INDEX_SHA1_LENGTH + 1) * num_dead++;
+      memcpy(key, victims[i]->docs + d * MNE_INDEX_SHA1_LENGTH, MNE_INDEX_SHA1_LENGTH);
+      key[MNE_INDEX_SHA1_LENGTH] = 0;
+      g_hash_table_insert(gone, key, GINT_TO_POINTER(1));
+    }
+  }
+
+  for (i = 0; i < num_segments && g_hash_table_size(gone) > 0; i++) {
+    for (d = 0; d < segments[i]->header->num_docs; d++) {
+      memcpy(sha1, segments[i]->docs + d * MNE_INDEX_SHA1_LENGTH, MNE_INDEX_SHA1_LENGTH);
+      sha1[MNE_INDEX_SHA1_LENGTH] = 0;
+      g_hash_table_remove(gone, sha1);
+    }
+  }
+
+  GHashTableIter iter;
+  gpointer key;
+  g_hash_table_iter_init(&iter, gone);
+  while (g_hash_table_iter_next(&iter, &key, NULL))
+    mne_index_untombstone((char*)key);
+
+  g_hash_table_destroy(gone);
+  free(keys);
+}
+
+static void *mne_index_merge_loop(void *arg) {
+  mne_segment *victims[MNE_INDEX_MERGE_FANIN];
+  unsigned char *dead[MNE_INDEX_MERGE_FANIN];
+  char sha1[MNE_INDEX_SHA1_LENGTH + 1];
+  int i, n;
+  uint32_t d;
+
+  while (1) {
+    pthread_mutex_lock(&index_mutex);
+    while (!merge_exiting && mne_index_pick_merge(victims) == 0)
+      pthread_cond_wait(&merge_cond, &index_mutex);
+
+    if (merge_exiting) {
+      pthread_mutex_unlock(&index_mutex);
+      break;
+    }
+    pthread_mutex_unlock(&index_mutex);
+
+    /* Lock order is merge_mutex before index_mutex, so pick again. */
+    pthread_mutex_lock(&merge_mutex);
+    pthread_mutex_lock(&index_mutex);
+
+    if ((n = mne_index_pick_merge(victims)) == 0) {
+      pthread_mutex_unlock(&index_mutex);
+      pthread_mutex_unlock(&merge_mutex);
+      continue;
+    }
+
+    for (i = 0; i < n; i++) {
+      victims[i]->refs++;
+      dead[i] = malloc(sizeof(unsigned char) * (victims[i]->header->num_docs + 1));
+      assert(dead[i] != NULL);
+      for (d = 0; d < victims[i]->header->num_docs; d++) {
+        memcpy(sha1, victims[i]->docs + d * MNE_INDEX_SHA1_LENGTH, MNE_INDEX_SHA1_LENGTH);
+        sha1[MNE_INDEX_SHA1_LENGTH] = 0;
+        dead[i][d] = g_hash_table_lookup(tombstones, sha1) != NULL;
+      }
+    }
+
+    pthread_mutex_unlock(&index_mutex);
+
+    int *origin_segment;
+    uint32_t *origin_doc;
+    mne_segment *merged = mne_index_merge(victims, dead, n, &origin_segment, &origin_doc);
+
+    pthread_mutex_lock(&index_mutex);
+
+    if (merged != NULL) {
+      for (d = 0; d < merged->header->num_docs; d++)
+        merged->doc_blobs[d] = victims[origin_segment[d]]->doc_blobs[origin_doc[d]];
+      mne_index_add_segment(merged);
+    }
+
+    for (i = 0; i < n; i++) {
+      int s, live = 0;
+      for (s = 0; s < num_segments; s++) {
+        if (segments[s] != victims[i])
+          segments[live++] = segments[s];
+      }
+      num_segments = live;
+    }
+
+    mne_index_forget_dead(victims, dead, n);
+
+    /* The manifest must stop naming the victims before their files go. */
+    mne_index_write_manifest();
+
+    for (i = 0; i < n; i++) {
+      victims[i]->retired = 1;
+      mne_index_unref_segment(victims[i]); /* Our merge reference. */
+      mne_index_unref_segment(victims[i]); /* The live list's reference. */
+      free(dead[i]);
+    }
+
+    pthread_mutex_unlock(&index_mutex);
+    pthread_mutex_unlock(&merge_mutex);
+
+    free(origin_segment);
+    free(origin_doc);
+  }
+
+  pthread_exit(NULL);
+}
+
+/*
+ * Called with index_mutex held. Segments are tiered by powers of the fan-in
+ * in doc count; any tier holding a full fan-in of segments gets merged.
+ */
+static int mne_index_pick_merge(mne_segment **victims) {
+  int i, j, n, tier;
+
+  for (tier = 0; tier < 16; tier++) {
+    n = 0;
+    for (i = 0; i < num_segments && n < MNE_INDEX_MERGE_FANIN; i++) {
+      uint32_t docs = segments[i]->header->num_docs;
+      for (j = 0; docs >= MNE_INDEX_MERGE_FANIN; j++)
+        docs /= MNE_INDEX_MERGE_FANIN;
+      if (j == tier)
+        victims[n++] = segments[i];
+    }
+    if (n == MNE_INDEX_MERGE_FANIN)
+      return n;
+  }
+
+  return 0;
+}
+
+/* Concatenates the victims' live docs and merges their trigram tables. */
+static mne_segment *mne_index_merge(mne_segment **victims, unsigned char **dead, int n,
+    int **origin_segment, uint32_t **origin_doc) {
+  uint32_t *remap[MNE_INDEX_MERGE_FANIN], cursor[MNE_INDEX_MERGE_FANIN];
+  uint32_t num_docs = 0, total_docs = 0, total_postings = 0, total_trigrams = 0, d;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    total_docs += victims[i]->header->num_docs;
+    total_postings += victims[i]->header->num_postings;
+    total_trigrams += victims[i]->header->num_trigrams;
+  }
+
+  *origin_segment = malloc(sizeof(int) * (total_docs + 1));
+  *origin_doc = malloc(sizeof(uint32_t) * (total_docs + 1));
+  assert(*origin_segment != NULL && *origin_doc != NULL);
+
+  for (i = 0; i < n; i++) {
+    remap[i] = malloc(sizeof(uint32_t) * (victims[i]->header->num_docs + 1));
+    assert(remap[i] != NULL);
+    cursor[i] = 0;
+    for (d = 0; d < victims[i]->header->num_docs; d++) {
+      if (dead[i][d])
+        continue;
+      remap[i][d] = num_docs;
+      (*origin_segment)[num_docs] = i;
+      (*origin_doc)[num_docs] = d;
+      num_docs++;
+    }
+  }
+
+  mne_segment *merged = NULL;
+
+  if (num_docs > 0) {
+    uint32_t max_docs = 0, num_trigrams = 0, num_postings = 0, postings_capacity = total_postings + 1024;
+    for (i = 0; i < n; i++) {
+      if (victims[i]->header->num_docs > max_docs)
+        max_docs = victims[i]->header->num_docs;
+    }
+
+    mne_segment_trigram *trigrams = malloc(sizeof(mne_segment_trigram) * (total_trigrams + 1));
+    uint32_t *postings = malloc(sizeof(uint32_t) * postings_capacity);
+    uint32_t *docs = malloc(sizeof(uint32_t) * (num_docs + 1));
+    uint32_t *decoded = malloc(sizeof(uint32_t) * (max_docs + MNE_POSTING_BLOCK));
+    assert(trigrams != NULL && postings != NULL && docs != NULL && decoded != NULL);
+
+    while (1) {
+      uint32_t trigram = UINT32_MAX, count = 0, c;
+      int found = 0;
+
+      for (i = 0; i < n; i++) {
+        if (cursor[i] < victims[i]->header->num_trigrams && victims[i]->trigrams[cursor[i]].trigram <= trigram) {
+          trigram = victims[i]->trigrams[cursor[i]].trigram;
+          found = 1;
+        }
+      }
+
+      if (!found)
+        break;
+
+      /* Victims hold ascending remapped doc ranges, so appending keeps order. */
+      for (i = 0; i < n; i++) {
+        const mne_segment_trigram *t = &victims[i]->trigrams[cursor[i]];
+        if (cursor[i] >= victims[i]->header->num_trigrams || t->trigram != trigram)
+          continue;
+        c = mne_posting_decode(victims[i]->postings + t->offset, decoded);
+        for (d = 0; d < c; d++) {
+          if (!dead[i][decoded[d]])
+            docs[count++] = remap[i][decoded[d]];
+        }
+        cursor[i]++;
+      }
+
+      if (count == 0)
+        continue;
+
+      while (num_postings + mne_posting_max_words(count) > postings_capacity) {
+        postings_capacity *= 2;
+        postings = realloc(postings, sizeof(uint32_t) * postings_capacity);
+        assert(postings != NULL);
+      }
+
+      trigrams[num_trigrams].trigram = trigram;
+      trigrams[num_trigrams].offset = num_postings;
+      trigrams[num_trigrams].count = count;
+      num_trigrams++;
+      num_postings += mne_posting_encode(docs, count, postings + num_postings);
+    }
+
+    free(docs);
+    free(decoded);
+
+    char name[32];
+    pthread_mutex_lock(&index_mutex);
+    snprintf(name, sizeof(name), "seg-%06u.mne", next_segment++);
+    pthread_mutex_unlock(&index_mutex);
+
+    merged = mne_index_write_segment(name, num_docs, trigrams, num_trigrams, postings, num_postings);
+    for (d = 0; d < num_docs; d++)
+      memcpy((char*)merged->docs + d * MNE_INDEX_SHA1_LENGTH,
+        victims[(*origin_segment)[d]]->docs + (*origin_doc)[d] * MNE_INDEX_SHA1_LENGTH, MNE_INDEX_SHA1_LENGTH);
+
+    free(trigrams);
+    free(postings);
+  }
+
+  for (i = 0; i < n; i++)
+    free(remap[i]);
+
+  return merged;
+}
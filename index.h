@@ -0,0 +1,13 @@
+#ifndef MEANIE_INDEX_H
+#define MEANIE_INDEX_H
+
+#include "plan.h"
+
+#define MNE_INDEX_MERGE_FANIN 4
+
+void mne_index_open(const char*);
+void mne_index_sync(char**, char**, int*, int);
+int mne_index_candidates(mne_plan_node*, unsigned char*, int);
+void mne_index_close();
+
+#endif
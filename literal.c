@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "literal.h"
+#include "common.h"
+
+/*
+ * Substring search for the prefilter. The SSE2 path tests 16 positions at a
+ * time for the needle's first and last byte and only verifies where both
+ * hit. Caseless search ORs 0x20 into haystack bytes compared against a
+ * letter, which maps exactly the upper and lower case of that letter together.
+ */
+
+static int mne_literal_equal(const char*, const char*, size_t, int);
+
+/* Returns the first occurrence of needle in haystack, or NULL. */
+const char *mne_literal_find(const char *haystack, size_t size, const char *needle, size_t length, int caseless) {
+  size_t i = 0;
+
+  if (length == 0)
+    return haystack;
+  if (length > size)
+    return NULL;
+
+  unsigned char first = needle[0], last = needle[length - 1];
+  unsigned char first_or = 0, last_or = 0;
+
+  if (caseless) {
+    first = MNE_LITERAL_FOLD(first);
+    last = MNE_LITERAL_FOLD(last);
+    first_or = (first >= 'a' && first <= 'z') ? 0x20 : 0;
+    last_or = (last >= 'a' && last <= 'z') ? 0x20 : 0;
+  }
+
+#ifdef __SSE2__
+  __m128i first_v = _mm_set1_epi8((char)first), last_v = _mm_set1_epi8((char)last);
+  __m128i first_or_v = _mm_set1_epi8((char)first_or), last_or_v = _mm_set1_epi8((char)last_or);
+
+  for (; i + length - 1 + 16 <= size; i += 16) {
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(haystack + i)), first_or_v);
+    __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(haystack + i + length - 1)), last_or_v);
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first_v), _mm_cmpeq_epi8(b, last_v)));
+
+    while (unlikely(mask != 0)) {
+      unsigned int bit = __builtin_ctz(mask);
+      if (length <= 2 || mne_literal_equal(haystack + i + bit + 1, needle + 1, length - 2, caseless))
+        return haystack + i + bit;
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i + length <= size; i++) {
+    if (((unsigned char)haystack[i] | first_or) == first &&
+        ((unsigned char)haystack[i + length - 1] | last_or) == last &&
+        (length <= 2 || mne_literal_equal(haystack + i + 1, needle + 1, length - 2, caseless)))
+      return haystack + i;
+  }
+
+  return NULL;
+}
+
+static int mne_literal_equal(const char *a, const char *b, size_t length, int caseless) {
+  if (!caseless)
+    return memcmp(a, b, length) == 0;
+
+  size_t i;
+  for (i = 0; i < length; i++) {
+    if (MNE_LITERAL_FOLD(a[i]) != MNE_LITERAL_FOLD(b[i]))
+      return 0;
+  }
+
+  return 1;
+}
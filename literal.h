@@ -0,0 +1,11 @@
+#ifndef MEANIE_LITERAL_H
+#define MEANIE_LITERAL_H
+
+#include <stddef.h>
+
+/* ASCII-only case folding, shared by the index and the prefilter. */
+#define MNE_LITERAL_FOLD(c) ((unsigned char)(c) + (((unsigned char)(c) - 'A' < 26u) << 5))
+
+const char *mne_literal_find(const char*, size_t, const char*, size_t, int);
+
+#endif
@@ -2,7 +2,9 @@
 #include <stdio.h>
 
 #include "search.h"
+#include "config.h"
 #include "git.h"
+#include "output.h"
 
 int main(int argc, char **argv) {
   int rc;
@@ -12,7 +14,9 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
-  mne_git_load_blobs(argv[1]);
+  mne_config_parse(argc, argv);
+  mne_output_setup(config.format);
+  mne_git_load_blobs(config.repo_path);
   mne_search_loop();
   mne_search_cleanup();
   mne_git_cleanup();
@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define MNE_MULTI_SSSE3
+#include <tmmintrin.h>
+#endif
+
+#include "multi.h"
+#include "literal.h"
+#include "common.h"
+
+/*
+ * Only candidates come out of here, so literals are free to match more than
+ * the pattern does. When any literal is caseless all of them are folded,
+ * and a literal extending another is dropped, since the shorter one already
+ * finds every place the longer one would.
+ *
+ * Teddy needs a byte shuffle, which x86 only has from SSSE3 on. That is
+ * checked for at runtime; without it, Aho-Corasick takes over.
+ */
+
+static int mne_multi_compare(const void*, const void*);
+static void mne_multi_teddy_init(mne_multi*);
+static void mne_multi_aho_corasick_init(mne_multi*);
+#ifdef MNE_MULTI_SSSE3
+static int mne_multi_equal(const mne_multi*, const mne_syntax_literal*, const char*);
+static int mne_multi_verify(const mne_multi*, const char*, int, int, unsigned int);
+static int mne_multi_find_teddy_tail(const mne_multi*, const char*, int, int);
+static int mne_multi_find_teddy(const mne_multi*, const char*, int, int) __attribute__((target("ssse3")));
+#endif
+static int mne_multi_find_aho_corasick(const mne_multi*, const char*, int, int);
+
+/* Builds a matcher for num_literals literals, none of them empty. */
+mne_multi *mne_multi_compile(const mne_syntax_literal *literals, int num_literals) {
+  int i, j, kept = 0;
+
+  assert(num_literals > 0);
+
+  mne_multi *multi = malloc(sizeof(mne_multi));
+  assert(multi != NULL);
+  memset(multi, 0, sizeof(mne_multi));
+  multi->literals = malloc(sizeof(mne_syntax_literal) * num_literals);
+  assert(multi->literals != NULL);
+  memcpy(multi->literals, literals, sizeof(mne_syntax_literal) * num_literals);
+
+  for (i = 0; i < num_literals; i++)
+    multi->caseless |= literals[i].caseless;
+
+  if (multi->caseless) {
+    for (i = 0; i < num_literals; i++) {
+      multi->literals[i].caseless = 1;
+      for (j = 0; j < multi->literals[i].length; j++)
+        multi->literals[i].bytes[j] = MNE_LITERAL_FOLD(multi->literals[i].bytes[j]);
+    }
+  }
+
+  /* Sorted, a literal's prefixes come before it, the nearest last. */
+  qsort(multi->literals, num_literals, sizeof(mne_syntax_literal), mne_multi_compare);
+  for (i = 0; i < num_literals; i++) {
+    const mne_syntax_literal *literal = &multi->literals[i];
+    if (kept > 0 && multi->literals[kept - 1].length <= literal->length &&
+        memcmp(multi->literals[kept - 1].bytes, literal->bytes, multi->literals[kept - 1].length) == 0)
+      continue;
+    multi->literals[kept++] = *literal;
+  }
+  multi->num_literals = kept;
+
+  multi->min_length = multi->max_length = multi->literals[0].length;
+  for (i = 1; i < kept; i++) {
+    if (multi->literals[i].length < multi->min_length)
+      multi->min_length = multi->literals[i].length;
+    if (multi->literals[i].length > multi->max_length)
+      multi->max_length = multi->literals[i].length;
+  }
+
+  if (kept == 1)
+    multi->method = MNE_MULTI_LITERAL;
+#ifdef MNE_MULTI_SSSE3
+  else if (kept <= MNE_MULTI_TEDDY_MAX && __builtin_cpu_supports("ssse3"))
+    multi->method = MNE_MULTI_TEDDY;
+#endif
+  else
+    multi->method = MNE_MULTI_AHO_CORASICK;
+
+  if (multi->method == MNE_MULTI_TEDDY)
+    mne_multi_teddy_init(multi);
+  else if (multi->method == MNE_MULTI_AHO_CORASICK)
+    mne_multi_aho_corasick_init(multi);
+
+  return multi;
+}
+
+void mne_multi_free(mne_multi *multi) {
+  if (multi == NULL)
+    return;
+
+  free(multi->literals);
+  free(multi->next);
+  free(multi->output);
+  free(multi);
+}
+
+/* Returns where the first literal in subject[0, length) at or after offset starts, or -1. */
+int mne_multi_find(const mne_multi *multi, const char *subject, int length, int offset) {
+  const char *p;
+
+  switch (multi->method) {
+    case MNE_MULTI_LITERAL:
+      if (offset >= length)
+        return -1;
+      p = mne_literal_find(subject + offset, length - offset, (const char*)multi->literals[0].bytes,
+        multi->literals[0].length, multi->caseless);
+      return p == NULL ? -1 : p - subject;
+#ifdef MNE_MULTI_SSSE3
+    case MNE_MULTI_TEDDY:
+      return mne_multi_find_teddy(multi, subject, length, offset);
+#endif
+    default:
+      return mne_multi_find_aho_corasick(multi, subject, length, offset);
+  }
+}
+
+const char *mne_multi_name(const mne_multi *multi) {
+  switch (multi->method) {
+    case MNE_MULTI_LITERAL:
+      return "literal";
+    case MNE_MULTI_TEDDY:
+      return "teddy";
+    default:
+      return "aho-corasick";
+  }
+}
+
+static int mne_multi_compare(const void *a, const void *b) {
+  const mne_syntax_literal *x = a, *y = b;
+  int rc = memcmp(x->bytes, y->bytes, x->length < y->length ? x->length : y->length);
+  return rc != 0 ? rc : x->length - y->length;
+}
+
+/*
+ * Splits the sorted literals into buckets of neighbours and marks, for each
+ * of the first fingerprint bytes of every literal, its bucket under both
+ * nibbles of the byte (and of its other case).
+ */
+static void mne_multi_teddy_init(mne_multi *multi) {
+  int i, k, b;
+
+  multi->fingerprint = multi->min_length < MNE_MULTI_TEDDY_FINGERPRINT ? multi->min_length :
+    MNE_MULTI_TEDDY_FINGERPRINT;
+
+  for (b = 0; b <= MNE_MULTI_TEDDY_BUCKETS; b++)
+    multi->buckets[b] = b * multi->num_literals / MNE_MULTI_TEDDY_BUCKETS;
+
+  for (b = 0; b < MNE_MULTI_TEDDY_BUCKETS; b++) {
+    for (i = multi->buckets[b]; i < multi->buckets[b + 1]; i++) {
+      for (k = 0; k < multi->fingerprint; k++) {
+        unsigned char c = multi->literals[i].bytes[k];
+        multi->masks[k][0][c & 15] |= 1 << b;
+        multi->masks[k][1][c >> 4] |= 1 << b;
+        if (multi->caseless && c >= 'a' && c <= 'z') {
+          c -= 32;
+          multi->masks[k][0][c & 15] |= 1 << b;
+          multi->masks[k][1][c >> 4] |= 1 << b;
+        }
+      }
+    }
+  }
+}
+
+/*
+ * A trie of the literals over classes of the bytes in them, with the
+ * failure links folded into a full transition table.
+ */
+static void mne_multi_aho_corasick_init(mne_multi *multi) {
+  int i, j, c, total = 1, nc, head = 0, tail = 0;
+  int ids[256];
+
+  memset(ids, 0, sizeof(ids));
+  multi->num_classes = 1;
+  for (i = 0; i < multi->num_literals; i++) {
+    total += multi->literals[i].length;
+    for (j = 0; j < multi->literals[i].length; j++) {
+      if (ids[multi->literals[i].bytes[j]] == 0)
+        ids[multi->literals[i].bytes[j]] = multi->num_classes++;
+    }
+  }
+  for (c = 0; c < 256; c++)
+    multi->classes[c] = ids[multi->caseless ? MNE_LITERAL_FOLD(c) : c];
+
+  nc = multi->num_classes;
+  multi->next = malloc(sizeof(int) * total * nc);
+  multi->output = calloc(total, sizeof(int));
+  int *fail = calloc(total, sizeof(int)), *queue = malloc(sizeof(int) * total);
+  assert(multi->next != NULL && multi->output != NULL && fail != NULL && queue != NULL);
+  memset(multi->next, -1, sizeof(int) * total * nc);
+  multi->num_states = 1;
+
+  for (i = 0; i < multi->num_literals; i++) {
+    int state = 0;
+    for (j = 0; j < multi->literals[i].length; j++) {
+      int *next = &multi->next[state * nc + ids[multi->literals[i].bytes[j]]];
+      if (*next < 0)
+        *next = multi->num_states++;
+      state = *next;
+    }
+    multi->output[state] = multi->literals[i].length;
+  }
+
+  for (c = 0; c < nc; c++) {
+    int *next = &multi->next[c];
+    if (*next < 0) {
+      *next = 0;
+    } else {
+      fail[*next] = 0;
+      queue[tail++] = *next;
+    }
+  }
+
+  while (head < tail) {
+    int state = queue[head++];
+    for (c = 0; c < nc; c++) {
+      int *next = &multi->next[state * nc + c], fallback = multi->next[fail[state] * nc + c];
+      if (*next < 0) {
+        *next = fallback;
+      } else {
+        fail[*next] = fallback;
+        if (multi->output[fallback] > multi->output[*next])
+          multi->output[*next] = multi->output[fallback];
+        queue[tail++] = *next;
+      }
+    }
+  }
+
+  free(fail);
+  free(queue);
+}
+
+#ifdef MNE_MULTI_SSSE3
+static int mne_multi_equal(const mne_multi *multi, const mne_syntax_literal *literal, const char *p) {
+  int i;
+
+  if (!multi->caseless)
+    return memcmp(p, literal->bytes, literal->length) == 0;
+
+  for (i = 0; i < literal->length; i++) {
+    if (MNE_LITERAL_FOLD(p[i]) != literal->bytes[i])
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Whether a literal from one of the buckets in bits starts at pos. */
+static int mne_multi_verify(const mne_multi *multi, const char *subject, int length, int pos, unsigned int bits) {
+  while (bits != 0) {
+    int b = __builtin_ctz(bits), i;
+    for (i = multi->buckets[b]; i < multi->buckets[b + 1]; i++) {
+      const mne_syntax_literal *literal = &multi->literals[i];
+      if (pos + literal->length <= length && mne_multi_equal(multi, literal, subject + pos))
+        return 1;
+    }
+    bits &= bits - 1;
+  }
+
+  return 0;
+}
+
+/* Teddy one position at a time, for what's left after the last full block. */
+static int mne_multi_find_teddy_tail(const mne_multi *multi, const char *subject, int length, int offset) {
+  int i, k;
+
+  for (i = offset; i + multi->min_length <= length; i++) {
+    unsigned int bits = 0xff;
+    for (k = 0; k < multi->fingerprint && bits != 0; k++) {
+      unsigned char c = subject[i + k];
+      bits &= multi->masks[k][0][c & 15] & multi->masks[k][1][c >> 4];
+    }
+    if (bits != 0 && mne_multi_verify(multi, subject, length, i, bits))
+      return i;
+  }
+
+  return -1;
+}
+
+/*
+ * Looks each nibble of 16 bytes up in the masks with a shuffle. A byte of
+ * the result has a bucket's bit set when the fingerprint of one of the
+ * bucket's literals matches there.
+ */
+static int mne_multi_find_teddy(const mne_multi *multi, const char *subject, int length, int offset) {
+  __m128i low = _mm_set1_epi8(0x0f), lo[MNE_MULTI_TEDDY_FINGERPRINT], hi[MNE_MULTI_TEDDY_FINGERPRINT];
+  int i = offset, k, f = multi->fingerprint;
+  unsigned char buckets[16];
+
+  for (k = 0; k < f; k++) {
+    lo[k] = _mm_loadu_si128((const __m128i*)multi->masks[k][0]);
+    hi[k] = _mm_loadu_si128((const __m128i*)multi->masks[k][1]);
+  }
+
+  for (; i + 16 + f - 1 <= length; i += 16) {
+    __m128i hits = _mm_set1_epi8((char)0xff);
+
+    for (k = 0; k < f; k++) {
+      __m128i chunk = _mm_loadu_si128((const __m128i*)(subject + i + k));
+      __m128i l = _mm_shuffle_epi8(lo[k], _mm_and_si128(chunk, low));
+      __m128i h = _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(chunk, 4), low));
+      hits = _mm_and_si128(hits, _mm_and_si128(l, h));
+    }
+
+    unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128())) & 0xffff;
+    if (likely(mask == 0))
+      continue;
+
+    _mm_storeu_si128((__m128i*)buckets, hits);
+    while (mask != 0) {
+      unsigned int bit = __builtin_ctz(mask);
+      if (mne_multi_verify(multi, subject, length, i + bit, buckets[bit]))
+        return i + bit;
+      mask &= mask - 1;
+    }
+  }
+
+  return mne_multi_find_teddy_tail(multi, subject, length, i);
+}
+#endif
+
+/*
+ * A literal found ending at p may not be the first to start: a longer one
+ * starting earlier ends later. None can end past the earliest start plus
+ * the longest literal, so the scan stops there.
+ */
+static int mne_multi_find_aho_corasick(const mne_multi *multi, const char *subject, int length, int offset) {
+  int p, state = 0, best = -1, nc = multi->num_classes;
+
+  for (p = offset; p < length; p++) {
+    state = multi->next[state * nc + multi->classes[(unsigned char)subject[p]]];
+
+    if (unlikely(multi->output[state] != 0)) {
+      int start = p - multi->output[state] + 1;
+      if (best < 0 || start < best)
+        best = start;
+    }
+
+    if (best >= 0 && p >= best + multi->max_length - 2)
+      return best;
+  }
+
+  return best;
+}
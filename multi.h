@@ -0,0 +1,47 @@
+#ifndef MEANIE_MULTI_H
+#define MEANIE_MULTI_H
+
+#include "syntax.h"
+
+/*
+ * Finds where any of a set of literals occurs, to jump between the places a
+ * match can start. One literal uses the SIMD substring scan; a few dozen use
+ * Teddy, which tests 16 positions at once against a fingerprint of each
+ * literal's first bytes; more than that use Aho-Corasick.
+ */
+
+#define MNE_MULTI_LITERAL 0
+#define MNE_MULTI_TEDDY 1
+#define MNE_MULTI_AHO_CORASICK 2
+
+#define MNE_MULTI_TEDDY_MAX 32
+#define MNE_MULTI_TEDDY_BUCKETS 8
+#define MNE_MULTI_TEDDY_FINGERPRINT 3
+
+typedef struct {
+	int method;
+	mne_syntax_literal *literals;  /* Sorted, so a Teddy bucket holds similar ones. */
+	int num_literals;
+	int caseless;                  /* Any literal is: every one is then compared folded. */
+	int min_length;
+	int max_length;
+
+	/* Teddy: per fingerprint byte, the buckets each low and high nibble allows. */
+	int fingerprint;
+	unsigned char masks[MNE_MULTI_TEDDY_FINGERPRINT][2][16];
+	int buckets[MNE_MULTI_TEDDY_BUCKETS + 1];
+
+	/* Aho-Corasick, as a full transition table over byte classes. */
+	unsigned short classes[256];  /* 0 for bytes in no literal, so up to 256. */
+	int num_classes;
+	int num_states;
+	int *next;
+	int *output;  /* The longest literal ending in each state, 0 for none. */
+} mne_multi;
+
+mne_multi *mne_multi_compile(const mne_syntax_literal*, int);
+void mne_multi_free(mne_multi*);
+int mne_multi_find(const mne_multi*, const char*, int, int);
+const char *mne_multi_name(const mne_multi*);
+
+#endif
@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "output.h"
+
+#define MNE_OUTPUT_MAX_IOVECS 64
+
+static int output_format = MNE_FORMAT_TEXT;
+static int output_fd = STDOUT_FILENO;
+static int output_colors = 1;
+
+static void mne_output_separate(mne_output*);
+static void mne_output_begin(mne_output*, char, char);
+static void mne_output_msgpack_header(mne_output*, unsigned char, unsigned char, unsigned char, unsigned char, size_t);
+static void mne_output_json_string(mne_output*, const char*, size_t);
+static inline size_t mne_output_utf8_length(const unsigned char*, size_t);
+
+/*
+ * Picks the format results are written in. Records get stdout to themselves:
+ * whatever stdout was is kept for them, and stdout itself, with everything
+ * else that's printed, goes to stderr until text output is back. Colours
+ * only make sense on a terminal.
+ */
+void mne_output_setup(int format) {
+  int records = format != MNE_FORMAT_TEXT;
+
+  fflush(stdout);
+  if (records && output_fd == STDOUT_FILENO) {
+    output_fd = dup(STDOUT_FILENO);
+    assert(output_fd >= 0);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  } else if (!records && output_fd != STDOUT_FILENO) {
+    dup2(output_fd, STDOUT_FILENO);
+    close(output_fd);
+    output_fd = STDOUT_FILENO;
+  }
+
+  output_format = format;
+  output_colors = !records && isatty(output_fd);
+}
+
+int mne_output_colors() {
+  return output_colors;
+}
+
+void mne_output_init(mne_output *out) {
+  out->data = NULL;
+  out->used = 0;
+  out->size = 0;
+  out->depth = 0;
+  out->keyed = 0;
+}
+
+void mne_output_free(mne_output *out) {
+  free(out->data);
+  mne_output_init(out);
+}
+
+/* Makes room for length more bytes. */
+void mne_output_reserve(mne_output *out, size_t length) {
+  size_t size = out->size > 0 ? out->size : MNE_OUTPUT_INITIAL_BYTES;
+
+  while (size < out->used + length)
+    size *= 2;
+  out->data = realloc(out->data, size);
+  assert(out->data != NULL);
+  out->size = size;
+}
+
+/* Appends n in decimal. */
+void mne_output_number(mne_output *out, unsigned long n) {
+  char digits[24];
+  int i = sizeof(digits);
+
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  mne_output_bytes(out, digits + i, sizeof(digits) - i);
+}
+
+/* Appends the ANSI escape for an SGR code like "1;32", unless colours are off. */
+void mne_output_color(mne_output *out, const char *code) {
+  if (!output_colors)
+    return;
+  mne_output_bytes(out, "\033[", 2);
+  mne_output_string(out, code);
+  mne_output_bytes(out, "m", 1);
+}
+
+/*
+ * Writes the first num_outputs buffers out in order, with as few system
+ * calls as the kernel allows, and empties them. Whatever stdio still holds
+ * goes first so the two never interleave.
+ */
+void mne_output_write(mne_output *outputs, unsigned int num_outputs) {
+  struct iovec iov[MNE_OUTPUT_MAX_IOVECS];
+  unsigned int i = 0, n;
+
+  fflush(stdout);
+
+  while (i < num_outputs) {
+    int count = 0, first = 0;
+
+    for (; i < num_outputs && count < MNE_OUTPUT_MAX_IOVECS; i++) {
+      if (outputs[i].used == 0)
+        continue;
+      iov[count].iov_base = outputs[i].data;
+      iov[count].iov_len = outputs[i].used;
+      count++;
+    }
+
+    /* Short writes, say to a full pipe, pick up where they stopped. */
+    while (first < count) {
+      ssize_t written = writev(output_fd, iov + first, count - first);
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      while (first < count && (size_t)written >= iov[first].iov_len)
+        written -= iov[first++].iov_len;
+      if (first < count) {
+        iov[first].iov_base = (char*)iov[first].iov_base + written;
+        iov[first].iov_len -= written;
+      }
+    }
+  }
+
+  for (n = 0; n < num_outputs; n++)
+    outputs[n].used = 0;
+}
+
+void mne_output_begin_map(mne_output *out, unsigned int count) {
+  if (output_format == MNE_FORMAT_MSGPACK)
+    mne_output_msgpack_header(out, 0x80, 16, 0, 0xde, count);
+  else
+    mne_output_begin(out, '{', '}');
+}
+
+void mne_output_begin_array(mne_output *out, unsigned int count) {
+  if (output_format == MNE_FORMAT_MSGPACK)
+    mne_output_msgpack_header(out, 0x90, 16, 0, 0xdc, count);
+  else
+    mne_output_begin(out, '[', ']');
+}
+
+/* Closes the innermost map or array. */
+void mne_output_end(mne_output *out) {
+  if (output_format == MNE_FORMAT_MSGPACK)
+    return;
+  assert(out->depth > 0);
+  out->depth--;
+  mne_output_bytes(out, &out->closers[out->depth], 1);
+}
+
+/* JSON Lines ends each record with a newline; MessagePack needs nothing. */
+void mne_output_end_record(mne_output *out) {
+  if (output_format != MNE_FORMAT_MSGPACK)
+    mne_output_bytes(out, "\n", 1);
+}
+
+void mne_output_key(mne_output *out, const char *key) {
+  mne_output_value_string(out, key, strlen(key));
+  if (output_format != MNE_FORMAT_MSGPACK) {
+    mne_output_bytes(out, ":", 1);
+    out->keyed = 1;
+  }
+}
+
+/* A name such as a path or ref: a MessagePack str. */
+void mne_output_value_string(mne_output *out, const char *string, size_t length) {
+  if (output_format == MNE_FORMAT_MSGPACK) {
+    mne_output_msgpack_header(out, 0xa0, 32, 0xd9, 0xda, length);
+    mne_output_bytes(out, string, length);
+    return;
+  }
+  mne_output_separate(out);
+  mne_output_json_string(out, string, length);
+}
+
+/* Bytes from a blob: a MessagePack bin, so they come back exactly. */
+void mne_output_value_bytes(mne_output *out, const char *bytes, size_t length) {
+  if (output_format == MNE_FORMAT_MSGPACK) {
+    mne_output_msgpack_header(out, 0, 0, 0xc4, 0xc5, length);
+    mne_output_bytes(out, bytes, length);
+    return;
+  }
+  mne_output_separate(out);
+  mne_output_json_string(out, bytes, length);
+}
+
+void mne_output_value_number(mne_output *out, unsigned long n) {
+  unsigned char bytes[9];
+  int i, width;
+
+  if (output_format != MNE_FORMAT_MSGPACK) {
+    mne_output_separate(out);
+    mne_output_number(out, n);
+    return;
+  }
+
+  if (n < 128) {
+    bytes[0] = n;
+    mne_output_bytes(out, (char*)bytes, 1);
+    return;
+  }
+
+  if (n < 256) {
+    bytes[0] = 0xcc;
+    width = 1;
+  } else if (n < 65536) {
+    bytes[0] = 0xcd;
+    width = 2;
+  } else if (n <= 0xffffffffUL) {
+    bytes[0] = 0xce;
+    width = 4;
+  } else {
+    bytes[0] = 0xcf;
+    width = 8;
+  }
+
+  /* Big-endian. */
+  for (i = width; i > 0; i--) {
+    bytes[i] = n & 0xff;
+    n >>= 8;
+  }
+  mne_output_bytes(out, (char*)bytes, width + 1);
+}
+
+void mne_output_value_bool(mne_output *out, int value) {
+  if (output_format == MNE_FORMAT_MSGPACK) {
+    mne_output_bytes(out, value ? "\xc3" : "\xc2", 1);
+    return;
+  }
+  mne_output_separate(out);
+  mne_output_string(out, value ? "true" : "false");
+}
+
+void mne_output_value_null(mne_output *out) {
+  if (output_format == MNE_FORMAT_MSGPACK) {
+    mne_output_bytes(out, "\xc0", 1);
+    return;
+  }
+  mne_output_separate(out);
+  mne_output_bytes(out, "null", 4);
+}
+
+/* JSON: a comma before every value of a map or array but the first, and none after a key. */
+static void mne_output_separate(mne_output *out) {
+  if (out->keyed) {
+    out->keyed = 0;
+    return;
+  }
+  if (out->depth > 0 && out->values[out->depth - 1]++ > 0)
+    mne_output_bytes(out, ",", 1);
+}
+
+static void mne_output_begin(mne_output *out, char opener, char closer) {
+  mne_output_separate(out);
+  assert(out->depth < MNE_OUTPUT_MAX_DEPTH);
+  out->closers[out->depth] = closer;
+  out->values[out->depth] = 0;
+  out->depth++;
+  mne_output_bytes(out, &opener, 1);
+}
+
+/*
+ * A MessagePack type and length: the fix form when length is under
+ * fix_limit, else the 8-bit form if the type has one (code8 isn't 0), else
+ * the 16-bit form or the 32-bit one, whose code always comes next.
+ */
+static void mne_output_msgpack_header(mne_output *out, unsigned char fix, unsigned char fix_limit,
+    unsigned char code8, unsigned char code16, size_t length) {
+  unsigned char bytes[5];
+  int i, width;
+
+  if (length < fix_limit) {
+    bytes[0] = fix | length;
+    mne_output_bytes(out, (char*)bytes, 1);
+    return;
+  }
+
+  if (length < 256 && code8 != 0) {
+    bytes[0] = code8;
+    width = 1;
+  } else if (length < 65536) {
+    bytes[0] = code16;
+    width = 2;
+  } else {
+    bytes[0] = code16 + 1;
+    width = 4;
+  }
+
+  for (i = width; i > 0; i--) {
+    bytes[i] = length & 0xff;
+    length >>= 8;
+  }
+  mne_output_bytes(out, (char*)bytes, width + 1);
+}
+
+/*
+ * A JSON string. Valid UTF-8 is copied as is, a run of plain ASCII at a
+ * time; quotes, backslashes and control characters are escaped, and each
+ * byte that isn't part of a valid sequence becomes U+FFFD.
+ */
+static void mne_output_json_string(mne_output *out, const char *string, size_t length) {
+  const unsigned char *bytes = (const unsigned char*)string;
+  static const char hex[] = "0123456789abcdef";
+  size_t i = 0, run;
+
+  mne_output_bytes(out, "\"", 1);
+
+  while (i < length) {
+    for (run = i; run < length && bytes[run] >= 0x20 && bytes[run] < 0x80 && bytes[run] != '"' && bytes[run] != '\\'; run++)
+      ;
+    mne_output_bytes(out, string + i, run - i);
+    if (run == length)
+      break;
+    i = run;
+
+    unsigned char c = bytes[i];
+    if (c >= 0x80) {
+      size_t sequence = mne_output_utf8_length(bytes + i, length - i);
+      if (sequence > 0) {
+        mne_output_bytes(out, string + i, sequence);
+        i += sequence;
+      } else {
+        mne_output_bytes(out, "\\ufffd", 6);
+        i++;
+      }
+      continue;
+    }
+
+    switch (c) {
+      case '"': mne_output_bytes(out, "\\\"", 2); break;
+      case '\\': mne_output_bytes(out, "\\\\", 2); break;
+      case '\n': mne_output_bytes(out, "\\n", 2); break;
+      case '\r': mne_output_bytes(out, "\\r", 2); break;
+      case '\t': mne_output_bytes(out, "\\t", 2); break;
+      default: {
+        char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+        mne_output_bytes(out, escape, 6);
+      }
+    }
+    i++;
+  }
+
+  mne_output_bytes(out, "\"", 1);
+}
+
+/* How long the valid UTF-8 sequence at bytes is, or 0 if it isn't one. */
+static inline size_t mne_output_utf8_length(const unsigned char *bytes, size_t available) {
+  unsigned char c = bytes[0], low = 0x80, high = 0xbf;
+  size_t length, i;
+
+  if (c >= 0xc2 && c <= 0xdf)
+    length = 2;
+  else if (c >= 0xe0 && c <= 0xef)
+    length = 3;
+  else if (c >= 0xf0 && c <= 0xf4)
+    length = 4;
+  else
+    return 0;
+
+  /* No overlong forms, surrogates or code points past U+10FFFF. */
+  if (c == 0xe0)
+    low = 0xa0;
+  else if (c == 0xed)
+    high = 0x9f;
+  else if (c == 0xf0)
+    low = 0x90;
+  else if (c == 0xf4)
+    high = 0x8f;
+
+  if (length > available || bytes[1] < low || bytes[1] > high)
+    return 0;
+  for (i = 2; i < length; i++) {
+    if (bytes[i] < 0x80 || bytes[i] > 0xbf)
+      return 0;
+  }
+  return length;
+}
@@ -0,0 +1,67 @@
+#ifndef MEANIE_OUTPUT_H
+#define MEANIE_OUTPUT_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "common.h"
+
+/*
+ * Results are rendered into plain byte buffers instead of through stdio:
+ * each search thread fills its own, so several can be rendered at once, and
+ * a batch of them goes out in order with a single writev. ANSI colours are
+ * only written when stdout is a terminal, so piped output is plain text.
+ *
+ * For programs, results can instead be written as records, one JSON object
+ * per line or a stream of MessagePack maps, through the same calls: maps and
+ * arrays (whose sizes MessagePack wants up front), keys and values. Blob
+ * contents are MessagePack bin, exact bytes; in JSON, bytes that aren't
+ * valid UTF-8 become U+FFFD, and offsets give the exact positions.
+ */
+
+#define MNE_OUTPUT_INITIAL_BYTES (64 * 1024)
+#define MNE_OUTPUT_FLUSH_BYTES (256 * 1024)
+#define MNE_OUTPUT_MAX_DEPTH 8
+
+typedef struct {
+	char *data;
+	size_t used;
+	size_t size;
+	unsigned int depth; /* Records: how many maps and arrays are open. */
+	char closers[MNE_OUTPUT_MAX_DEPTH]; /* JSON: the bracket that closes each. */
+	unsigned int values[MNE_OUTPUT_MAX_DEPTH]; /* JSON: values so far in each, to know where commas go. */
+	int keyed; /* JSON: a key was just written, so its value needs no comma. */
+} mne_output;
+
+void mne_output_setup(int);
+int mne_output_colors();
+void mne_output_init(mne_output*);
+void mne_output_free(mne_output*);
+void mne_output_reserve(mne_output*, size_t);
+void mne_output_number(mne_output*, unsigned long);
+void mne_output_color(mne_output*, const char*);
+void mne_output_write(mne_output*, unsigned int);
+void mne_output_begin_map(mne_output*, unsigned int);
+void mne_output_begin_array(mne_output*, unsigned int);
+void mne_output_end(mne_output*);
+void mne_output_end_record(mne_output*);
+void mne_output_key(mne_output*, const char*);
+void mne_output_value_string(mne_output*, const char*, size_t);
+void mne_output_value_bytes(mne_output*, const char*, size_t);
+void mne_output_value_number(mne_output*, unsigned long);
+void mne_output_value_bool(mne_output*, int);
+void mne_output_value_null(mne_output*);
+
+/* Appends length bytes to out. */
+static inline void mne_output_bytes(mne_output *out, const char *bytes, size_t length) {
+  if (unlikely(out->used + length > out->size))
+    mne_output_reserve(out, length);
+  memcpy(out->data + out->used, bytes, length);
+  out->used += length;
+}
+
+static inline void mne_output_string(mne_output *out, const char *string) {
+  mne_output_bytes(out, string, strlen(string));
+}
+
+#endif
@@ -0,0 +1,536 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <glib.h>
+
+#include "util.h"
+#include "git.h"
+#include "plan.h"
+#include "literal.h"
+#include "posting.h"
+#include "paths.h"
+
+/*
+ * Blob paths are interned into one pool in sorted order, so every directory
+ * (and every path prefix) is a contiguous range of path ids. A directory trie
+ * maps prefixes to those ranges and trigram postings over the paths narrow
+ * file: regexes down before we run PCRE on the survivors. As in the content
+ * index, trigrams are ASCII case folded so caseless regexes can use them.
+ */
+
+typedef struct mne_path_node {
+	const char *name;
+	int length;
+	int first;
+	int last;
+	struct mne_path_node *children;
+	int num_children;
+} mne_path_node;
+
+typedef struct {
+	uint32_t trigram;
+	uint32_t offset;
+	uint32_t count;
+} mne_path_trigram;
+
+typedef struct {
+	const char *path;
+	int blob;
+} mne_path_entry;
+
+static char *pool;
+static int num_paths;
+static char **sorted;
+static int *path_blobs;
+static const char **blob_paths;
+static int *blob_ranks;
+static mne_path_node root;
+static mne_path_trigram *trigrams;
+static uint32_t num_trigrams;
+static uint32_t *postings;
+static unsigned char *selected;
+
+static int mne_paths_compare(const void*, const void*);
+static int mne_paths_compare_keys(const void*, const void*);
+static void mne_paths_build_trie();
+static void mne_paths_build_trigrams();
+static void mne_paths_free_node(mne_path_node*);
+static mne_path_node *mne_paths_find_child(mne_path_node*, const char*, int);
+static void mne_paths_prefix_range(const char*, int*, int*);
+static void mne_paths_eval(mne_plan_node*, int*, uint32_t**, uint32_t*);
+static const mne_path_trigram *mne_paths_lookup(uint32_t);
+
+void mne_paths_build(char **sha1s, int count) {
+  struct timeval begin, end;
+  gettimeofday(&begin, NULL);
+
+  size_t pool_size = 0, offset = 0;
+  int n;
+
+  for (n = 0; n < count; n++)
+    pool_size += strlen((char*)g_hash_table_lookup(paths, sha1s[n])) + 1;
+
+  num_paths = count;
+  pool = malloc(sizeof(char) * (pool_size + 1));
+  sorted = malloc(sizeof(char*) * (count + 1));
+  path_blobs = malloc(sizeof(int) * (count + 1));
+  blob_paths = malloc(sizeof(char*) * (count + 1));
+  blob_ranks = malloc(sizeof(int) * (count + 1));
+  selected = malloc(sizeof(unsigned char) * (count + 1));
+  assert(pool != NULL && sorted != NULL && path_blobs != NULL && blob_paths != NULL && blob_ranks != NULL &&
+    selected != NULL);
+
+  mne_path_entry *entries = malloc(sizeof(mne_path_entry) * (count + 1));
+  assert(entries != NULL);
+  for (n = 0; n < count; n++) {
+    entries[n].path = (const char*)g_hash_table_lookup(paths, sha1s[n]);
+    entries[n].blob = n;
+  }
+
+  qsort(entries, count, sizeof(mne_path_entry), mne_paths_compare);
+
+  for (n = 0; n < count; n++) {
+    size_t length = strlen(entries[n].path);
+    memcpy(pool + offset, entries[n].path, length + 1);
+    sorted[n] = pool + offset;
+    path_blobs[n] = entries[n].blob;
+    blob_paths[entries[n].blob] = pool + offset;
+    blob_ranks[entries[n].blob] = n;
+    offset += length + 1;
+  }
+
+  free(entries);
+
+  mne_paths_build_trie();
+  mne_paths_build_trigrams();
+
+  gettimeofday(&end, NULL);
+  printf(" * paths: %d paths, %u trigrams ", num_paths, num_trigrams);
+  mne_print_duration(&end, &begin);
+  printf("\n");
+}
+
+void mne_paths_free() {
+  mne_paths_free_node(&root);
+  free(pool);
+  free(sorted);
+  free(path_blobs);
+  free(blob_paths);
+  free(blob_ranks);
+  free(selected);
+  free(trigrams);
+  free(postings);
+}
+
+const char *mne_paths_get(int blob) {
+  return blob_paths[blob];
+}
+
+/* Where blob's path falls in path order, so results can be sorted by path. */
+int mne_paths_rank(int blob) {
+  return blob_ranks[blob];
+}
+
+/* The blob whose path has rank in path order. */
+int mne_paths_blob(int rank) {
+  return path_blobs[rank];
+}
+
+/*
+ * Consumes leading path:<prefix> and file:<regex> terms. Returns the rest of
+ * the query, or NULL if a filter is invalid.
+ */
+const char *mne_paths_parse(const char *term, mne_path_filter *filter) {
+  const char *error;
+  int erroffset;
+
+  filter->num_prefixes = 0;
+  filter->num_regexes = 0;
+
+  while (1) {
+    while (*term == ' ')
+      term++;
+
+    int is_path = strncmp(term, "path:", 5) == 0, is_file = strncmp(term, "file:", 5) == 0;
+    if (!is_path && !is_file)
+      break;
+
+    term += 5;
+    size_t length = strcspn(term, " ");
+
+    if ((is_path ? filter->num_prefixes : filter->num_regexes) == MNE_PATHS_MAX_FILTERS) {
+      printf("Too many path filters (> %d).\n", MNE_PATHS_MAX_FILTERS);
+      return NULL;
+    }
+
+    char *value = strndup(term, length);
+    assert(value != NULL);
+    term += length;
+
+    if (is_path) {
+      filter->prefixes[filter->num_prefixes++] = value;
+      continue;
+    }
+
+    pcre *re = pcre_compile(value, 0, &error, &erroffset, NULL);
+    if (re == NULL) {
+      printf("Path regex compilation failed at offset %d: %s\n", erroffset, error);
+      free(value);
+      return NULL;
+    }
+
+    filter->regexes[filter->num_regexes] = value;
+    filter->compiled[filter->num_regexes++] = re;
+  }
+
+  return term;
+}
+
+void mne_paths_filter_free(mne_path_filter *filter) {
+  int i;
+  for (i = 0; i < filter->num_prefixes; i++)
+    free(filter->prefixes[i]);
+  for (i = 0; i < filter->num_regexes; i++) {
+    free(filter->regexes[i]);
+    pcre_free(filter->compiled[i]);
+  }
+  filter->num_prefixes = 0;
+  filter->num_regexes = 0;
+}
+
+/*
+ * Restricts mask to blobs whose path passes every filter. If intersect is 0
+ * the mask is overwritten instead. Returns the number of blobs left.
+ */
+int mne_paths_filter(mne_path_filter *filter, unsigned char *mask, int num_blobs, int intersect) {
+  int i, n, lo = 0, hi = num_paths, count = 0;
+
+  for (i = 0; i < filter->num_prefixes; i++) {
+    int first, last;
+    mne_paths_prefix_range(filter->prefixes[i], &first, &last);
+    /* Prefix ranges are either nested or disjoint. */
+    lo = first > lo ? first : lo;
+    hi = last < hi ? last : hi;
+  }
+
+  if (hi < lo)
+    hi = lo;
+
+  memset(selected + lo, 1, hi - lo);
+
+  for (i = 0; i < filter->num_regexes; i++) {
+    mne_plan_node *plan = mne_plan_compile(filter->regexes[i]);
+    int all;
+    uint32_t *ids, num_ids, k;
+
+    mne_paths_eval(plan, &all, &ids, &num_ids);
+    mne_plan_free(plan);
+
+    if (!all) {
+      /* Paths the postings rule out can't match. */
+      unsigned char *keep = calloc(hi - lo + 1, sizeof(unsigned char));
+      assert(keep != NULL);
+      for (k = 0; k < num_ids; k++) {
+        if (ids[k] >= lo && ids[k] < hi)
+          keep[ids[k] - lo] = 1;
+      }
+      for (n = lo; n < hi; n++)
+        selected[n] &= keep[n - lo];
+      free(keep);
+    }
+
+    free(ids);
+
+    for (n = lo; n < hi; n++) {
+      if (selected[n] && pcre_exec(filter->compiled[i], NULL, sorted[n], strlen(sorted[n]), 0, 0, NULL, 0) < 0)
+        selected[n] = 0;
+    }
+  }
+
+  if (intersect) {
+    /* Everything outside the selected range is out. */
+    for (n = 0; n < lo; n++)
+      mask[path_blobs[n]] = 0;
+    for (n = hi; n < num_paths; n++)
+      mask[path_blobs[n]] = 0;
+  } else {
+    memset(mask, 0, sizeof(unsigned char) * num_blobs);
+  }
+
+  for (n = lo; n < hi; n++) {
+    int blob = path_blobs[n];
+    if (intersect)
+      mask[blob] &= selected[n];
+    else
+      mask[blob] = selected[n];
+    count += mask[blob];
+  }
+
+  return count;
+}
+
+/* Blobs sharing a path are kept in blob order, so the order is the same every time. */
+static int mne_paths_compare(const void *a, const void *b) {
+  const mne_path_entry *x = (const mne_path_entry*)a, *y = (const mne_path_entry*)b;
+  int order = strcmp(x->path, y->path);
+  return order != 0 ? order : (x->blob > y->blob) - (x->blob < y->blob);
+}
+
+static int mne_paths_compare_keys(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static void mne_paths_build_trie() {
+  int n;
+  root.name = "";
+  root.length = 0;
+  root.first = 0;
+  root.last = num_paths;
+  root.children = NULL;
+  root.num_children = 0;
+
+  for (n = 0; n < num_paths; n++) {
+    mne_path_node *node = &root;
+    const char *component = sorted[n], *slash;
+
+    /* Paths are sorted, so a directory we've seen is always the last child. */
+    while ((slash = strchr(component, '/')) != NULL) {
+      int length = slash - component;
+      mne_path_node *last = node->num_children > 0 ? &node->children[node->num_children - 1] : NULL;
+
+      if (last == NULL || last->length != length || strncmp(last->name, component, length) != 0) {
+        node->children = realloc(node->children, sizeof(mne_path_node) * (node->num_children + 1));
+        assert(node->children != NULL);
+        last = &node->children[node->num_children++];
+        last->name = component;
+        last->length = length;
+        last->first = n;
+        last->children = NULL;
+        last->num_children = 0;
+      }
+
+      last->last = n + 1;
+      node = last;
+      component = slash + 1;
+    }
+  }
+}
+
+static void mne_paths_free_node(mne_path_node *node) {
+  int i;
+  for (i = 0; i < node->num_children; i++)
+    mne_paths_free_node(&node->children[i]);
+  free(node->children);
+}
+
+/* Children are ordered as "name/" strings, so compare them that way. */
+static mne_path_node *mne_paths_find_child(mne_path_node *node, const char *name, int length) {
+  int lo = 0, hi = node->num_children;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    mne_path_node *child = &node->children[mid];
+    int common = child->length < length ? child->length : length;
+    int cmp = memcmp(child->name, name, common);
+
+    if (cmp == 0 && child->length != length)
+      cmp = child->length < length ? (unsigned char)'/' - (unsigned char)name[common] :
+        (unsigned char)child->name[common] - (unsigned char)'/';
+
+    if (cmp == 0)
+      return child;
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return NULL;
+}
+
+/* The range of path ids starting with prefix: trie walk, then binary search. */
+static void mne_paths_prefix_range(const char *prefix, int *first, int *last) {
+  mne_path_node *node = &root;
+  const char *slash;
+  size_t length = strlen(prefix);
+
+  const char *component = prefix;
+  while ((slash = strchr(component, '/')) != NULL) {
+    node = mne_paths_find_child(node, component, slash - component);
+    if (node == NULL) {
+      *first = *last = 0;
+      return;
+    }
+    component = slash + 1;
+  }
+
+  int lo = node->first, hi = node->last;
+
+  if (*component != 0) {
+    int l = lo, h = hi;
+    while (l < h) {
+      int mid = l + (h - l) / 2;
+      if (strncmp(sorted[mid], prefix, length) < 0)
+        l = mid + 1;
+      else
+        h = mid;
+    }
+    lo = l;
+
+    h = hi;
+    while (l < h) {
+      int mid = l + (h - l) / 2;
+      if (strncmp(sorted[mid], prefix, length) <= 0)
+        l = mid + 1;
+      else
+        h = mid;
+    }
+    hi = l;
+  }
+
+  *first = lo;
+  *last = hi;
+}
+
+static void mne_paths_build_trigrams() {
+  size_t num_keys = 0, keys_size = 1024, k;
+  uint64_t *keys = malloc(sizeof(uint64_t) * keys_size);
+  assert(keys != NULL);
+  int n, i;
+
+  for (n = 0; n < num_paths; n++) {
+    const char *s = sorted[n];
+    for (i = 0; s[i] != 0 && s[i + 1] != 0 && s[i + 2] != 0; i++) {
+      if (num_keys == keys_size) {
+        keys_size *= 2;
+        keys = realloc(keys, sizeof(uint64_t) * keys_size);
+        assert(keys != NULL);
+      }
+      uint32_t trigram = (MNE_LITERAL_FOLD(s[i]) << 16) | (MNE_LITERAL_FOLD(s[i + 1]) << 8) | MNE_LITERAL_FOLD(s[i + 2]);
+      keys[num_keys++] = ((uint64_t)trigram << 32) | (uint32_t)n;
+    }
+  }
+
+  qsort(keys, num_keys, sizeof(uint64_t), mne_paths_compare_keys);
+
+  trigrams = malloc(sizeof(mne_path_trigram) * (num_keys + 1));
+  postings = malloc(sizeof(uint32_t) * (num_keys + 1));
+  assert(trigrams != NULL && postings != NULL);
+  num_trigrams = 0;
+  uint32_t num_postings = 0;
+
+  for (k = 0; k < num_keys; k++) {
+    if (k > 0 && keys[k] == keys[k - 1])
+      continue;
+
+    uint32_t trigram = keys[k] >> 32;
+    if (num_trigrams == 0 || trigrams[num_trigrams - 1].trigram != trigram) {
+      trigrams[num_trigrams].trigram = trigram;
+      trigrams[num_trigrams].offset = num_postings;
+      trigrams[num_trigrams].count = 0;
+      num_trigrams++;
+    }
+    trigrams[num_trigrams - 1].count++;
+    postings[num_postings++] = (uint32_t)keys[k];
+  }
+
+  free(keys);
+}
+
+static const mne_path_trigram *mne_paths_lookup(uint32_t trigram) {
+  uint32_t lo = 0, hi = num_trigrams;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (trigrams[mid].trigram < trigram)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo < num_trigrams && trigrams[lo].trigram == trigram)
+    return &trigrams[lo];
+
+  return NULL;
+}
+
+/* Same semantics as the content index: *all means the node doesn't constrain. */
+static void mne_paths_eval(mne_plan_node *node, int *all, uint32_t **ids, uint32_t *count) {
+  int i;
+  *all = 0;
+  *ids = NULL;
+  *count = 0;
+
+  if (node->op == MNE_PLAN_ANY || (node->op == MNE_PLAN_LITERAL && node->length < 3)) {
+    *all = 1;
+    return;
+  }
+
+  if (node->op == MNE_PLAN_LITERAL) {
+    unsigned char s[node->length];
+
+    for (i = 0; i < node->length; i++)
+      s[i] = MNE_LITERAL_FOLD(node->literal[i]);
+
+    for (i = 0; i + 2 < node->length; i++) {
+      const mne_path_trigram *t = mne_paths_lookup((s[i] << 16) | (s[i + 1] << 8) | s[i + 2]);
+
+      if (t == NULL) {
+        free(*ids);
+        *ids = NULL;
+        *count = 0;
+        return;
+      }
+
+      if (*ids == NULL) {
+        *ids = malloc(sizeof(uint32_t) * (t->count + 1));
+        assert(*ids != NULL);
+        memcpy(*ids, postings + t->offset, sizeof(uint32_t) * t->count);
+        *count = t->count;
+      } else {
+        *count = mne_posting_intersect(*ids, *count, postings + t->offset, t->count, *ids);
+      }
+    }
+    return;
+  }
+
+  int constrained = 0;
+
+  for (i = 0; i < node->num_children; i++) {
+    int child_all;
+    uint32_t *child_ids, child_count;
+    mne_paths_eval(node->children[i], &child_all, &child_ids, &child_count);
+
+    if (node->op == MNE_PLAN_AND) {
+      if (child_all)
+        continue;
+      if (!constrained) {
+        *ids = child_ids;
+        *count = child_count;
+        constrained = 1;
+      } else {
+        *count = mne_posting_intersect(*ids, *count, child_ids, child_count, *ids);
+        free(child_ids);
+      }
+    } else {
+      if (child_all) {
+        free(*ids);
+        *ids = NULL;
+        *count = 0;
+        *all = 1;
+        return;
+      }
+      uint32_t *merged = mne_posting_union(*ids, *count, child_ids, child_count, count);
+      free(*ids);
+      free(child_ids);
+      *ids = merged;
+    }
+  }
+
+  if (node->op == MNE_PLAN_AND && !constrained)
+    *all = 1;
+}
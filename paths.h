@@ -0,0 +1,25 @@
+#ifndef MEANIE_PATHS_H
+#define MEANIE_PATHS_H
+
+#include <pcre.h>
+
+#define MNE_PATHS_MAX_FILTERS 8
+
+typedef struct {
+	int num_prefixes;
+	char *prefixes[MNE_PATHS_MAX_FILTERS];
+	int num_regexes;
+	char *regexes[MNE_PATHS_MAX_FILTERS];
+	pcre *compiled[MNE_PATHS_MAX_FILTERS];
+} mne_path_filter;
+
+void mne_paths_build(char**, int);
+void mne_paths_free();
+const char *mne_paths_get(int);
+int mne_paths_rank(int);
+int mne_paths_blob(int);
+const char *mne_paths_parse(const char*, mne_path_filter*);
+int mne_paths_filter(mne_path_filter*, unsigned char*, int, int);
+void mne_paths_filter_free(mne_path_filter*);
+
+#endif
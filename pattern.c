@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "pattern.h"
+
+/*
+ * Lookups take the mutex; compiling doesn't, since the JIT can take a while.
+ * Two queries compiling the same pattern at once both compile it, and the
+ * second to finish uses the first one's copy.
+ */
+
+static mne_pattern *patterns[MNE_PATTERN_CACHE_ENTRIES];
+static unsigned int num_patterns = 0;
+static pthread_mutex_t pattern_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long pattern_clock = 0, hits = 0, misses = 0;
+static pcre_jit_callback jit_callback = NULL;
+static unsigned long match_limit = 0, recursion_limit = 0;
+
+static mne_pattern *mne_pattern_find(const char*, int);
+static mne_pattern *mne_pattern_compile(const char*, int, const char**, int*);
+static void mne_pattern_compile_engines(mne_pattern*, const mne_syntax_node*);
+static void mne_pattern_evict();
+static void mne_pattern_release(mne_pattern*);
+
+/* Every pattern gets these limits and JIT stack callback. */
+void mne_pattern_init(pcre_jit_callback callback, unsigned long matches, unsigned long recursion) {
+  jit_callback = callback;
+  match_limit = matches;
+  recursion_limit = recursion;
+}
+
+void mne_pattern_free() {
+  pthread_mutex_lock(&pattern_mutex);
+  while (num_patterns > 0)
+    mne_pattern_put(patterns[--num_patterns]);
+  pthread_mutex_unlock(&pattern_mutex);
+}
+
+/*
+ * Returns source compiled with flags, holding a reference for the caller,
+ * and sets cached when no compile was needed. On failure returns NULL with
+ * error (and erroffset, for a compile error) set.
+ */
+mne_pattern *mne_pattern_get(const char *source, int flags, int *cached, const char **error, int *erroffset) {
+  mne_pattern *pattern;
+
+  pthread_mutex_lock(&pattern_mutex);
+  pattern = mne_pattern_find(source, flags);
+  if (pattern != NULL)
+    hits++;
+  else
+    misses++;
+  pthread_mutex_unlock(&pattern_mutex);
+
+  *cached = pattern != NULL;
+  if (pattern != NULL)
+    return pattern;
+
+  pattern = mne_pattern_compile(source, flags, error, erroffset);
+  if (pattern == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&pattern_mutex);
+  mne_pattern *other = mne_pattern_find(source, flags);
+
+  if (other != NULL) {
+    mne_pattern_release(pattern);
+    pattern = other;
+  } else {
+    if (num_patterns == MNE_PATTERN_CACHE_ENTRIES)
+      mne_pattern_evict();
+    __sync_fetch_and_add(&pattern->refs, 1);
+    pattern->used = ++pattern_clock;
+    patterns[num_patterns++] = pattern;
+  }
+  pthread_mutex_unlock(&pattern_mutex);
+
+  return pattern;
+}
+
+/* Drops a reference; the last one frees the pattern. */
+void mne_pattern_put(mne_pattern *pattern) {
+  if (__sync_sub_and_fetch(&pattern->refs, 1) == 0)
+    mne_pattern_release(pattern);
+}
+
+void mne_pattern_print_stats() {
+  pthread_mutex_lock(&pattern_mutex);
+  printf("Patterns: %u of %d compiled patterns cached, %lu hits, %lu misses (%.1f%% hit rate).\n", num_patterns,
+    MNE_PATTERN_CACHE_ENTRIES, hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+  pthread_mutex_unlock(&pattern_mutex);
+}
+
+/* Finds a cached pattern and takes a reference. Called with the mutex held. */
+static mne_pattern *mne_pattern_find(const char *source, int flags) {
+  unsigned int i;
+
+  for (i = 0; i < num_patterns; i++) {
+    mne_pattern *pattern = patterns[i];
+    if (pattern->flags == flags && strcmp(pattern->source, source) == 0) {
+      __sync_fetch_and_add(&pattern->refs, 1);
+      pattern->used = ++pattern_clock;
+      return pattern;
+    }
+  }
+
+  return NULL;
+}
+
+static mne_pattern *mne_pattern_compile(const char *source, int flags, const char **error, int *erroffset) {
+  pcre *re = pcre_compile(source, flags, error, erroffset, NULL);
+
+  if (re == NULL)
+    return NULL;
+
+  pcre_extra *extra = pcre_study(re, PCRE_STUDY_JIT_COMPILE, error);
+
+  if (*error != NULL) {
+    *erroffset = -1;
+    pcre_free_study(extra);
+    pcre_free(re);
+    return NULL;
+  }
+
+  /* Study can return NULL when it learns nothing; limits still need an extra. */
+  if (extra == NULL) {
+    extra = pcre_malloc(sizeof(pcre_extra));
+    assert(extra != NULL);
+    memset(extra, 0, sizeof(pcre_extra));
+  }
+
+  extra->flags |= PCRE_EXTRA_MATCH_LIMIT | PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+  extra->match_limit = match_limit;
+  extra->match_limit_recursion = recursion_limit;
+  pcre_assign_jit_stack(extra, jit_callback, NULL);
+
+  mne_pattern *pattern = malloc(sizeof(mne_pattern));
+  assert(pattern != NULL);
+  pattern->source = strdup(source);
+  assert(pattern->source != NULL);
+  pattern->flags = flags;
+  pattern->re = re;
+  pattern->extra = extra;
+  pattern->refs = 1;
+  pattern->used = 0;
+  pcre_fullinfo(re, extra, PCRE_INFO_CAPTURECOUNT, &pattern->captures);
+  pattern->fixed = NULL;
+  pattern->dfa = NULL;
+  pattern->prefixes = NULL;
+  pattern->looks_ahead = 1;
+
+  mne_syntax_node *root = mne_syntax_parse(source, flags, &pattern->dfa_unsupported);
+  if (root != NULL) {
+    pattern->looks_ahead = mne_syntax_looks_ahead(root);
+    mne_pattern_compile_engines(pattern, root);
+    mne_syntax_free(root);
+  }
+
+  return pattern;
+}
+
+/* The fixed-length matcher if the pattern has one, otherwise the DFA and any prefixes. */
+static void mne_pattern_compile_engines(mne_pattern *pattern, const mne_syntax_node *root) {
+  unsigned char sets[MNE_FIXED_MAX_LENGTH][32];
+  int i, length = mne_syntax_fixed(root, sets, MNE_FIXED_MAX_LENGTH);
+
+  if (length > 0) {
+    pattern->fixed = mne_fixed_compile((const unsigned char (*)[32])sets, length);
+    return;
+  }
+
+  pattern->dfa = mne_dfa_compile(root, &pattern->dfa_unsupported);
+
+  mne_syntax_literal *literals = malloc(sizeof(mne_syntax_literal) * MNE_SYNTAX_MAX_PREFIXES);
+  assert(literals != NULL);
+  int num_literals = mne_syntax_prefixes(root, literals);
+
+  for (i = 0; i < num_literals && literals[i].length >= MNE_PATTERN_MIN_PREFIX; i++);
+  if (num_literals > 0 && i == num_literals)
+    pattern->prefixes = mne_multi_compile(literals, num_literals);
+  free(literals);
+}
+
+/* Drops the cache's reference to the least recently used pattern. Called with the mutex held. */
+static void mne_pattern_evict() {
+  unsigned int i, oldest = 0;
+
+  for (i = 1; i < num_patterns; i++) {
+    if (patterns[i]->used < patterns[oldest]->used)
+      oldest = i;
+  }
+
+  mne_pattern *pattern = patterns[oldest];
+  patterns[oldest] = patterns[--num_patterns];
+  mne_pattern_put(pattern);
+}
+
+static void mne_pattern_release(mne_pattern *pattern) {
+  mne_fixed_free(pattern->fixed);
+  mne_dfa_free(pattern->dfa);
+  mne_multi_free(pattern->prefixes);
+  pcre_free_study(pattern->extra);
+  pcre_free(pattern->re);
+  free(pattern->source);
+  free(pattern);
+}
@@ -0,0 +1,48 @@
+#ifndef MEANIE_PATTERN_H
+#define MEANIE_PATTERN_H
+
+#include <pcre.h>
+
+#include "dfa.h"
+#include "fixed.h"
+#include "multi.h"
+
+/*
+ * Compiled, JIT-studied regexes, cached by source and compile flags so a
+ * repeated query skips pcre_compile and the JIT. Patterns are reference
+ * counted: the cache holds one reference and every query using a pattern
+ * another, so an evicted pattern lives until its last query puts it back.
+ *
+ * Each pattern also gets a bit-parallel matcher when it only matches a fixed
+ * number of bytes, else a DFA when it doesn't need backtracking, or the
+ * reason it does. When every match starts with one of a few literals, those
+ * are kept as prefixes to skip ahead to.
+ */
+
+#define MNE_PATTERN_CACHE_ENTRIES 64
+
+/* Shorter prefixes occur so often that skipping to them gains nothing. */
+#define MNE_PATTERN_MIN_PREFIX 3
+
+typedef struct {
+	char *source;
+	int flags;
+	pcre *re;
+	pcre_extra *extra;
+	int captures;
+	mne_fixed *fixed;
+	mne_dfa *dfa;
+	mne_multi *prefixes;
+	const char *dfa_unsupported;
+	int looks_ahead; /* Has assertions about what follows; assumed when the syntax parser gave up. */
+	volatile unsigned int refs;
+	unsigned long used;
+} mne_pattern;
+
+void mne_pattern_init(pcre_jit_callback, unsigned long, unsigned long);
+void mne_pattern_free();
+mne_pattern *mne_pattern_get(const char*, int, int*, const char**, int*);
+void mne_pattern_put(mne_pattern*);
+void mne_pattern_print_stats();
+
+#endif
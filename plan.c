@@ -0,0 +1,660 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "plan.h"
+#include "literal.h"
+
+#define MNE_PLAN_MAX_LITERAL 256
+#define MNE_PLAN_FOLD(c) ((unsigned char)tolower((unsigned char)(c)))
+
+/*
+ * A deliberately conservative reading of PCRE syntax. Anything we don't
+ * understand becomes MNE_PLAN_ANY, which can only make the plan weaker, never
+ * wrong. Constructs that change what "required" means (extended mode,
+ * backtracking verbs) fail the whole plan.
+ *
+ * In UTF mode an atom is a whole code point, so a quantifier repeats or
+ * removes all of its bytes.
+ */
+
+typedef struct {
+	const char *p;
+	int utf;
+	int caseless;
+	int quoting;
+	int failed;
+} mne_plan_parser;
+
+typedef struct {
+	char bytes[4];
+	int length;
+	mne_plan_node *node;
+} mne_plan_atom;
+
+static mne_plan_node *mne_plan_node_new(mne_plan_op);
+static mne_plan_node *mne_plan_literal_new(const char*, int, int);
+static void mne_plan_add_child(mne_plan_node*, mne_plan_node*);
+static mne_plan_node *mne_plan_simplify(mne_plan_node*);
+static mne_plan_node *mne_plan_parse_alt(mne_plan_parser*);
+static mne_plan_node *mne_plan_parse_seq(mne_plan_parser*);
+static mne_plan_node *mne_plan_parse_group(mne_plan_parser*);
+static void mne_plan_parse_atom(mne_plan_parser*, mne_plan_atom*);
+static int mne_plan_parse_escape(mne_plan_parser*, char*);
+static void mne_plan_parse_utf8(mne_plan_parser*, mne_plan_atom*);
+static int mne_plan_encode_utf8(unsigned long, char*);
+static int mne_plan_parse_quantifier(mne_plan_parser*, int*, int*);
+static void mne_plan_skip_class(mne_plan_parser*);
+static void mne_plan_skip_until(mne_plan_parser*, char);
+static void mne_plan_skip_group(mne_plan_parser*);
+
+mne_plan_node *mne_plan_compile(const char *pattern) {
+  mne_plan_parser parser;
+  parser.p = pattern;
+  parser.utf = 0;
+  parser.caseless = 0;
+  parser.quoting = 0;
+  parser.failed = 0;
+
+  /* Leading (*UTF8), (*CR) etc. only set options. */
+  while (strncmp(parser.p, "(*", 2) == 0 && isupper((unsigned char)parser.p[2])) {
+    if (strncmp(parser.p + 2, "UTF", 3) == 0)
+      parser.utf = 1;
+    mne_plan_skip_until(&parser, ')');
+  }
+
+  mne_plan_node *root = mne_plan_parse_alt(&parser);
+
+  if (parser.failed || *parser.p != 0) {
+    mne_plan_free(root);
+    return mne_plan_node_new(MNE_PLAN_ANY);
+  }
+
+  return root;
+}
+
+void mne_plan_free(mne_plan_node *node) {
+  if (node == NULL)
+    return;
+
+  int i;
+  for (i = 0; i < node->num_children; i++)
+    mne_plan_free(node->children[i]);
+
+  free(node->children);
+  free(node->literal);
+  free(node);
+}
+
+/*
+ * Returns the longest literal every match must contain, or NULL. Only the
+ * root and its AND children qualify; an OR needs a multi-literal matcher.
+ */
+const mne_plan_node *mne_plan_required(const mne_plan_node *node) {
+  const mne_plan_node *best = NULL;
+  int i;
+
+  if (node->op == MNE_PLAN_LITERAL)
+    return node;
+
+  if (node->op != MNE_PLAN_AND)
+    return NULL;
+
+  for (i = 0; i < node->num_children; i++) {
+    const mne_plan_node *child = node->children[i];
+    if (child->op == MNE_PLAN_LITERAL && (best == NULL || child->length > best->length))
+      best = child;
+  }
+
+  return best;
+}
+
+/*
+ * Whether pattern matches exactly where its plan's literal occurs: plain
+ * characters and escaped punctuation only, after an optional (?i).
+ */
+int mne_plan_exact(const char *pattern) {
+  const char *p = pattern;
+
+  if (strncmp(p, "(?i)", 4) == 0)
+    p += 4;
+  if (*p == 0)
+    return 0;
+
+  for (; *p != 0; p++) {
+    if (*p == '\\') {
+      if (!ispunct((unsigned char)*++p))
+        return 0;
+    } else if (strchr(".^$|?*+()[]{}", *p) != NULL) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Whether every match of node's plan contains literal: one of the literals
+ * it requires contains it, under case folding if literal is caseless.
+ */
+int mne_plan_implies(const mne_plan_node *node, const char *literal, int length, int caseless) {
+  int i;
+
+  if (node->op == MNE_PLAN_LITERAL) {
+    /* A caseless requirement can't promise a case-sensitive literal. */
+    if (node->caseless && !caseless)
+      return 0;
+    return mne_literal_find(node->literal, node->length, literal, length, caseless) != NULL;
+  }
+
+  if (node->op != MNE_PLAN_AND)
+    return 0;
+
+  for (i = 0; i < node->num_children; i++) {
+    if (mne_plan_implies(node->children[i], literal, length, caseless))
+      return 1;
+  }
+
+  return 0;
+}
+
+static mne_plan_node *mne_plan_node_new(mne_plan_op op) {
+  mne_plan_node *node = malloc(sizeof(mne_plan_node));
+  assert(node != NULL);
+  node->op = op;
+  node->literal = NULL;
+  node->length = 0;
+  node->caseless = 0;
+  node->children = NULL;
+  node->num_children = 0;
+  return node;
+}
+
+static mne_plan_node *mne_plan_literal_new(const char *bytes, int length, int caseless) {
+  mne_plan_node *node = mne_plan_node_new(MNE_PLAN_LITERAL);
+  node->literal = malloc(sizeof(char) * (length + 1));
+  assert(node->literal != NULL);
+  memcpy(node->literal, bytes, length);
+  node->literal[length] = 0;
+  node->length = length;
+  node->caseless = caseless;
+  return node;
+}
+
+static void mne_plan_add_child(mne_plan_node *parent, mne_plan_node *child) {
+  parent->children = realloc(parent->children, sizeof(mne_plan_node*) * (parent->num_children + 1));
+  assert(parent->children != NULL);
+  parent->children[parent->num_children++] = child;
+}
+
+/* Flattens nested ANDs/ORs, drops ANY from ANDs and lets ANY absorb ORs. */
+static mne_plan_node *mne_plan_simplify(mne_plan_node *node) {
+  if (node->op != MNE_PLAN_AND && node->op != MNE_PLAN_OR)
+    return node;
+
+  mne_plan_node **children = node->children;
+  int i, j, num_children = node->num_children, any = 0;
+  node->children = NULL;
+  node->num_children = 0;
+
+  for (i = 0; i < num_children; i++) {
+    mne_plan_node *child = children[i];
+
+    if (child->op == MNE_PLAN_ANY) {
+      any = 1;
+      mne_plan_free(child);
+    } else if (child->op == node->op) {
+      for (j = 0; j < child->num_children; j++)
+        mne_plan_add_child(node, child->children[j]);
+      child->num_children = 0;
+      mne_plan_free(child);
+    } else {
+      mne_plan_add_child(node, child);
+    }
+  }
+
+  free(children);
+
+  if ((node->op == MNE_PLAN_OR && any) || node->num_children == 0) {
+    mne_plan_free(node);
+    return mne_plan_node_new(MNE_PLAN_ANY);
+  }
+
+  if (node->num_children == 1) {
+    mne_plan_node *child = node->children[0];
+    node->num_children = 0;
+    mne_plan_free(node);
+    return child;
+  }
+
+  return node;
+}
+
+static mne_plan_node *mne_plan_parse_alt(mne_plan_parser *parser) {
+  mne_plan_node *node = mne_plan_node_new(MNE_PLAN_OR);
+  mne_plan_add_child(node, mne_plan_parse_seq(parser));
+
+  while (*parser->p == '|') {
+    parser->p++;
+    mne_plan_add_child(node, mne_plan_parse_seq(parser));
+  }
+
+  return mne_plan_simplify(node);
+}
+
+static mne_plan_node *mne_plan_parse_seq(mne_plan_parser *parser) {
+  mne_plan_node *node = mne_plan_node_new(MNE_PLAN_AND);
+  char literal[MNE_PLAN_MAX_LITERAL];
+  int length = 0, caseless = 0, min, max;
+  mne_plan_atom atom;
+
+  while (*parser->p != 0 && !parser->failed) {
+    if (!parser->quoting && (*parser->p == '|' || *parser->p == ')'))
+      break;
+
+    mne_plan_parse_atom(parser, &atom);
+
+    if (!parser->quoting && mne_plan_parse_quantifier(parser, &min, &max)) {
+      if (min == 0) {
+        /* Optional, so it requires nothing and breaks adjacency. */
+        mne_plan_free(atom.node);
+        atom.node = mne_plan_node_new(MNE_PLAN_ANY);
+        atom.length = 0;
+      }
+    } else {
+      min = max = 1;
+    }
+
+    if (atom.length > 0 && length + atom.length > MNE_PLAN_MAX_LITERAL) {
+      mne_plan_add_child(node, mne_plan_literal_new(literal, length, caseless));
+      length = caseless = 0;
+    }
+
+    if (atom.length > 0) {
+      memcpy(literal + length, atom.bytes, atom.length);
+      length += atom.length;
+      /* One caseless atom makes the whole literal caseless. */
+      caseless |= parser->caseless;
+
+      if (max != 1) {
+        /* x+ requires "...x" and "x..." but nothing across the repetition. */
+        mne_plan_add_child(node, mne_plan_literal_new(literal, length, caseless));
+        memcpy(literal, atom.bytes, atom.length);
+        length = atom.length;
+        caseless = parser->caseless;
+      }
+    } else {
+      if (length > 0)
+        mne_plan_add_child(node, mne_plan_literal_new(literal, length, caseless));
+      length = caseless = 0;
+      mne_plan_add_child(node, atom.node);
+    }
+  }
+
+  if (length > 0)
+    mne_plan_add_child(node, mne_plan_literal_new(literal, length, caseless));
+
+  return mne_plan_simplify(node);
+}
+
+static void mne_plan_parse_atom(mne_plan_parser *parser, mne_plan_atom *atom) {
+  char c = *parser->p;
+  atom->length = 0;
+  atom->node = NULL;
+
+  if (parser->quoting) {
+    if (strncmp(parser->p, "\\E", 2) == 0) {
+      parser->p += 2;
+      parser->quoting = 0;
+      /* A quantifier after \E applies to the last quoted byte. */
+      if (strchr("*+?{", *parser->p) != NULL && *parser->p != 0)
+        parser->failed = 1;
+      atom->node = mne_plan_node_new(MNE_PLAN_ANY);
+      return;
+    }
+    parser->p++;
+    atom->bytes[0] = c;
+    atom->length = 1;
+    mne_plan_parse_utf8(parser, atom);
+  } else if (c == '(') {
+    atom->node = mne_plan_parse_group(parser);
+    return;
+  } else if (c == '[') {
+    mne_plan_skip_class(parser);
+  } else if (c == '\\') {
+    atom->length = mne_plan_parse_escape(parser, atom->bytes);
+  } else {
+    parser->p++;
+    if (c != '.' && c != '^' && c != '$') {
+      atom->bytes[0] = c;
+      atom->length = 1;
+      mne_plan_parse_utf8(parser, atom);
+    }
+  }
+
+  /*
+   * Caseless literals are matched with ASCII folding. In UTF mode PCRE also
+   * folds other code points, a few of which match ASCII letters (the Kelvin
+   * sign for k, long s for s), so those atoms can't be required.
+   */
+  if (atom->length > 0 && parser->caseless && parser->utf) {
+    unsigned char b = MNE_PLAN_FOLD(atom->bytes[0]);
+    if (b >= 0x80 || b == 'k' || b == 's')
+      atom->length = 0;
+  }
+
+  if (atom->length == 0)
+    atom->node = mne_plan_node_new(MNE_PLAN_ANY);
+}
+
+static mne_plan_node *mne_plan_parse_group(mne_plan_parser *parser) {
+  int caseless = parser->caseless, zero_width = 0;
+  const char *p = parser->p + 1;
+
+  if (p[0] == '*') {
+    /* Backtracking verbs such as (*ACCEPT) can end a match early. */
+    parser->failed = 1;
+    return mne_plan_node_new(MNE_PLAN_ANY);
+  }
+
+  if (p[0] == '?') {
+    p++;
+
+    if (*p == '#') {
+      mne_plan_skip_until(parser, ')');
+      return mne_plan_node_new(MNE_PLAN_ANY);
+    }
+
+    if (*p == '=' || *p == '!' || (p[0] == '<' && (p[1] == '=' || p[1] == '!'))) {
+      zero_width = 1;
+      p += (*p == '<') ? 2 : 1;
+    } else if (*p == '(' || *p == 'R' || *p == '&' || isdigit((unsigned char)*p) ||
+        *p == '+' || (*p == '-' && isdigit((unsigned char)p[1])) || (p[0] == 'P' && p[1] == '>')) {
+      /* Conditionals and recursion: skip them. */
+      parser->p = p;
+      mne_plan_skip_group(parser);
+      return mne_plan_node_new(MNE_PLAN_ANY);
+    } else if (*p == ':' || *p == '>' || *p == '|') {
+      p++;
+    } else if (p[0] == 'P' && p[1] == '=') {
+      parser->p = p;
+      mne_plan_skip_until(parser, ')');
+      return mne_plan_node_new(MNE_PLAN_ANY);
+    } else if (*p == '<' || *p == '\'' || (p[0] == 'P' && p[1] == '<')) {
+      char close = (*p == '\'') ? '\'' : '>';
+      while (*p != 0 && *p != close)
+        p++;
+      if (*p != 0)
+        p++;
+    } else {
+      /* Option setting: (?i), (?-i), (?i:...). */
+      int on = 1;
+      while (*p != 0 && *p != ')' && *p != ':') {
+        if (*p == '-')
+          on = 0;
+        else if (*p == 'i')
+          parser->caseless = on;
+        else if (*p == 'x' && on)
+          parser->failed = 1;
+        p++;
+      }
+
+      if (*p == ')') {
+        /* Applies to the rest of the enclosing group. */
+        parser->p = p + 1;
+        return mne_plan_node_new(MNE_PLAN_ANY);
+      }
+
+      if (*p == ':')
+        p++;
+    }
+  }
+
+  parser->p = p;
+  mne_plan_node *node = mne_plan_parse_alt(parser);
+
+  if (*parser->p == ')')
+    parser->p++;
+  else
+    parser->failed = 1;
+
+  parser->caseless = caseless;
+
+  if (zero_width) {
+    mne_plan_free(node);
+    return mne_plan_node_new(MNE_PLAN_ANY);
+  }
+
+  return node;
+}
+
+/* Returns the number of literal bytes the escape stands for, stored in bytes. */
+static int mne_plan_parse_escape(mne_plan_parser *parser, char *bytes) {
+  char *byte = bytes;
+  char c = parser->p[1];
+
+  if (c == 0) {
+    parser->failed = 1;
+    parser->p++;
+    return 0;
+  }
+
+  parser->p += 2;
+
+  if (!isalnum((unsigned char)c)) {
+    *byte = c;
+    return 1;
+  }
+
+  switch (c) {
+    case 'n': *byte = '\n'; return 1;
+    case 't': *byte = '\t'; return 1;
+    case 'r': *byte = '\r'; return 1;
+    case 'f': *byte = '\f'; return 1;
+    case 'e': *byte = 27; return 1;
+    case 'a': *byte = 7; return 1;
+    case 'Q':
+      parser->quoting = 1;
+      return 0;
+    case 'x':
+      if (*parser->p == '{') {
+        char *end;
+        unsigned long value = strtoul(parser->p + 1, &end, 16);
+        int hex = end > parser->p + 1 && *end == '}';
+        mne_plan_skip_until(parser, '}');
+        if (!hex || value == 0)
+          return 0;
+        if (parser->utf)
+          return mne_plan_encode_utf8(value, bytes);
+        if (value > 0xff)
+          return 0;
+        *byte = (char)value;
+        return 1;
+      }
+      /* Up to two hex digits, as PCRE reads them; a bare \x is NUL. */
+      char hex[3] = { 0, 0, 0 };
+      int digits = 0;
+      while (digits < 2 && isxdigit((unsigned char)parser->p[digits])) {
+        hex[digits] = parser->p[digits];
+        digits++;
+      }
+      parser->p += digits;
+      *byte = (char)strtol(hex, NULL, 16);
+      return *byte != 0;
+    case 'p':
+    case 'P':
+    case 'g':
+    case 'k':
+      if (*parser->p == '{')
+        mne_plan_skip_until(parser, '}');
+      else if (*parser->p == '<')
+        mne_plan_skip_until(parser, '>');
+      else if (*parser->p == '\'') {
+        parser->p++;
+        mne_plan_skip_until(parser, '\'');
+      } else if (*parser->p != 0) {
+        if (*parser->p == '-' || *parser->p == '+')
+          parser->p++;
+        while (isdigit((unsigned char)*parser->p))
+          parser->p++;
+        if (c == 'p' || c == 'P')
+          parser->p++;
+      }
+      return 0;
+    case 'c':
+      if (*parser->p != 0)
+        parser->p++;
+      return 0;
+    default:
+      /* Classes, assertions, back references and octal escapes. */
+      while (isdigit((unsigned char)c) && isdigit((unsigned char)*parser->p))
+        parser->p++;
+      return 0;
+  }
+}
+
+/* In UTF mode, pulls the continuation bytes of a multibyte character into the atom. */
+static void mne_plan_parse_utf8(mne_plan_parser *parser, mne_plan_atom *atom) {
+  unsigned char lead = atom->bytes[0];
+  int i, length = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+
+  if (!parser->utf)
+    return;
+
+  for (i = 1; i < length; i++) {
+    if (((unsigned char)*parser->p & 0xc0) != 0x80) {
+      /* Invalid UTF-8; PCRE will reject the pattern anyway. */
+      parser->failed = 1;
+      return;
+    }
+    atom->bytes[atom->length++] = *parser->p++;
+  }
+}
+
+static int mne_plan_encode_utf8(unsigned long value, char *bytes) {
+  if (value < 0x80) {
+    bytes[0] = (char)value;
+    return 1;
+  } else if (value < 0x800) {
+    bytes[0] = (char)(0xc0 | (value >> 6));
+    bytes[1] = (char)(0x80 | (value & 0x3f));
+    return 2;
+  } else if (value < 0x10000) {
+    bytes[0] = (char)(0xe0 | (value >> 12));
+    bytes[1] = (char)(0x80 | ((value >> 6) & 0x3f));
+    bytes[2] = (char)(0x80 | (value & 0x3f));
+    return 3;
+  } else if (value < 0x110000) {
+    bytes[0] = (char)(0xf0 | (value >> 18));
+    bytes[1] = (char)(0x80 | ((value >> 12) & 0x3f));
+    bytes[2] = (char)(0x80 | ((value >> 6) & 0x3f));
+    bytes[3] = (char)(0x80 | (value & 0x3f));
+    return 4;
+  }
+
+  return 0;
+}
+
+/* Returns 1 if a quantifier was consumed, with its bounds (max -1 = unbounded). */
+static int mne_plan_parse_quantifier(mne_plan_parser *parser, int *min, int *max) {
+  const char *p = parser->p;
+
+  switch (*p) {
+    case '*': *min = 0; *max = -1; p++; break;
+    case '+': *min = 1; *max = -1; p++; break;
+    case '?': *min = 0; *max = 1; p++; break;
+    case '{':
+      if (!isdigit((unsigned char)p[1]))
+        return 0;
+      p++;
+      *min = atoi(p);
+      while (isdigit((unsigned char)*p))
+        p++;
+      *max = *min;
+      if (*p == ',') {
+        p++;
+        *max = isdigit((unsigned char)*p) ? atoi(p) : -1;
+        while (isdigit((unsigned char)*p))
+          p++;
+      }
+      if (*p != '}')
+        return 0;
+      p++;
+      break;
+    default:
+      return 0;
+  }
+
+  /* Lazy and possessive suffixes don't change what is required. */
+  if (*p == '?' || *p == '+')
+    p++;
+
+  parser->p = p;
+  return 1;
+}
+
+static void mne_plan_skip_class(mne_plan_parser *parser) {
+  const char *p = parser->p + 1;
+
+  if (*p == '^')
+    p++;
+  if (*p == ']')
+    p++;
+
+  while (*p != 0 && *p != ']') {
+    if (*p == '\\' && p[1] != 0) {
+      p += 2;
+    } else if (p[0] == '[' && p[1] == ':' && strstr(p + 2, ":]") != NULL) {
+      p = strstr(p + 2, ":]") + 2;
+    } else {
+      p++;
+    }
+  }
+
+  if (*p == ']')
+    p++;
+  else
+    parser->failed = 1;
+
+  parser->p = p;
+}
+
+static void mne_plan_skip_until(mne_plan_parser *parser, char c) {
+  while (*parser->p != 0 && *parser->p != c)
+    parser->p++;
+
+  if (*parser->p == c)
+    parser->p++;
+  else
+    parser->failed = 1;
+}
+
+/* Skips to just past the parenthesis closing the group we are inside. */
+static void mne_plan_skip_group(mne_plan_parser *parser) {
+  int depth = 1;
+
+  while (*parser->p != 0) {
+    if (*parser->p == '\\' && parser->p[1] != 0) {
+      parser->p += 2;
+      continue;
+    }
+
+    if (*parser->p == '[') {
+      mne_plan_skip_class(parser);
+      continue;
+    }
+
+    if (*parser->p == '(')
+      depth++;
+    else if (*parser->p == ')' && --depth == 0)
+      break;
+
+    parser->p++;
+  }
+
+  if (*parser->p == ')')
+    parser->p++;
+  else
+    parser->failed = 1;
+}
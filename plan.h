@@ -0,0 +1,33 @@
+#ifndef MEANIE_PLAN_H
+#define MEANIE_PLAN_H
+
+/*
+ * A query plan is the set of literals a regex requires, as an AND/OR tree.
+ * MNE_PLAN_ANY means "no constraint": the node can match anything, so it is
+ * dropped from ANDs and absorbs ORs. Caseless literals only promise a match
+ * under ASCII case folding.
+ */
+
+typedef enum {
+	MNE_PLAN_ANY,
+	MNE_PLAN_LITERAL,
+	MNE_PLAN_AND,
+	MNE_PLAN_OR
+} mne_plan_op;
+
+typedef struct mne_plan_node {
+	mne_plan_op op;
+	char *literal;
+	int length;
+	int caseless;
+	struct mne_plan_node **children;
+	int num_children;
+} mne_plan_node;
+
+mne_plan_node *mne_plan_compile(const char*);
+void mne_plan_free(mne_plan_node*);
+const mne_plan_node *mne_plan_required(const mne_plan_node*);
+int mne_plan_exact(const char*);
+int mne_plan_implies(const mne_plan_node*, const char*, int, int);
+
+#endif
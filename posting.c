@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "posting.h"
+
+#define MNE_POSTING_HEADER 2
+#define MNE_POSTING_SKIP 3
+
+static uint32_t mne_posting_bits(uint32_t);
+static void mne_posting_decode_block(const uint32_t*, uint32_t, uint32_t, uint32_t*, uint32_t);
+
+uint32_t mne_posting_max_words(uint32_t count) {
+  if (count < MNE_POSTING_BLOCK)
+    return 1 + count;
+
+  uint32_t num_blocks = (count + MNE_POSTING_BLOCK - 1) / MNE_POSTING_BLOCK;
+  return MNE_POSTING_HEADER + num_blocks * (MNE_POSTING_SKIP + MNE_POSTING_BLOCK);
+}
+
+/* Encodes sorted docs into out, returning the number of words written. */
+uint32_t mne_posting_encode(const uint32_t *docs, uint32_t count, uint32_t *out) {
+  uint32_t num_blocks = (count + MNE_POSTING_BLOCK - 1) / MNE_POSTING_BLOCK;
+  uint32_t *skips = out + MNE_POSTING_HEADER;
+  uint32_t words = MNE_POSTING_HEADER + num_blocks * MNE_POSTING_SKIP, base = 0, b, i;
+  uint32_t deltas[MNE_POSTING_BLOCK];
+
+  out[0] = count;
+  if (count < MNE_POSTING_BLOCK) {
+    memcpy(out + 1, docs, sizeof(uint32_t) * count);
+    return 1 + count;
+  }
+  out[1] = num_blocks;
+
+  for (b = 0; b < num_blocks; b++) {
+    const uint32_t *block = docs + b * MNE_POSTING_BLOCK;
+    uint32_t n = count - b * MNE_POSTING_BLOCK, max = 0;
+    if (n > MNE_POSTING_BLOCK)
+      n = MNE_POSTING_BLOCK;
+
+    skips[b * MNE_POSTING_SKIP] = block[n - 1];
+    skips[b * MNE_POSTING_SKIP + 1] = words;
+
+    /* A partial tail block isn't worth packing. */
+    if (n < MNE_POSTING_BLOCK) {
+      skips[b * MNE_POSTING_SKIP + 2] = 0;
+      memcpy(out + words, block, sizeof(uint32_t) * n);
+      words += n;
+      break;
+    }
+
+    for (i = 0; i < MNE_POSTING_BLOCK; i++) {
+      deltas[i] = block[i] - (i > 0 ? block[i - 1] : base);
+      max |= deltas[i];
+    }
+
+    uint32_t bits = mne_posting_bits(max);
+    uint32_t *packed = out + words;
+    memset(packed, 0, sizeof(uint32_t) * 4 * bits);
+
+    /* Delta i goes to lane i % 4 at position i / 4 of that lane. */
+    for (i = 0; i < MNE_POSTING_BLOCK; i++) {
+      uint32_t lane = i & 3, bit = (i >> 2) * bits, word = bit >> 5, shift = bit & 31;
+      packed[word * 4 + lane] |= deltas[i] << shift;
+      if (shift + bits > 32)
+        packed[(word + 1) * 4 + lane] |= deltas[i] >> (32 - shift);
+    }
+
+    skips[b * MNE_POSTING_SKIP + 2] = bits;
+    words += 4 * bits;
+    base = block[n - 1];
+  }
+
+  return words;
+}
+
+uint32_t mne_posting_count(const uint32_t *list) {
+  return list[0];
+}
+
+/* Decodes the whole list; out needs room for the count rounded up to a block. */
+uint32_t mne_posting_decode(const uint32_t *list, uint32_t *out) {
+  const uint32_t *skips = list + MNE_POSTING_HEADER;
+  uint32_t b, base = 0;
+
+  if (list[0] < MNE_POSTING_BLOCK) {
+    memcpy(out, list + 1, sizeof(uint32_t) * list[0]);
+    return list[0];
+  }
+
+  for (b = 0; b < list[1]; b++) {
+    mne_posting_decode_block(list + skips[b * MNE_POSTING_SKIP + 1], skips[b * MNE_POSTING_SKIP + 2], base,
+      out + b * MNE_POSTING_BLOCK, list[0] - b * MNE_POSTING_BLOCK);
+    base = skips[b * MNE_POSTING_SKIP];
+  }
+
+  return list[0];
+}
+
+/*
+ * Intersects sorted a with an encoded list into out (which may be a). Skip pointers let us
+ * jump over blocks that end before the next candidate, so only blocks that
+ * can hold a match get decoded.
+ */
+uint32_t mne_posting_intersect_encoded(const uint32_t *a, uint32_t a_count, const uint32_t *list, uint32_t *out) {
+  const uint32_t *skips = list + MNE_POSTING_HEADER;
+  uint32_t count = list[0], num_blocks = list[1], b = 0, i = 0, n = 0;
+  uint32_t block[MNE_POSTING_BLOCK];
+
+  if (count < MNE_POSTING_BLOCK)
+    return mne_posting_intersect(a, a_count, list + 1, count, out);
+
+  while (i < a_count) {
+    while (b < num_blocks && skips[b * MNE_POSTING_SKIP] < a[i])
+      b++;
+
+    if (b == num_blocks)
+      break;
+
+    uint32_t last = skips[b * MNE_POSTING_SKIP], end = i;
+    while (end < a_count && a[end] <= last)
+      end++;
+
+    uint32_t size = b == num_blocks - 1 ? count - b * MNE_POSTING_BLOCK : MNE_POSTING_BLOCK;
+    const uint32_t *docs = list + skips[b * MNE_POSTING_SKIP + 1];
+    if (skips[b * MNE_POSTING_SKIP + 2] > 0) {
+      mne_posting_decode_block(docs, skips[b * MNE_POSTING_SKIP + 2], b > 0 ? skips[(b - 1) * MNE_POSTING_SKIP] : 0,
+        block, size);
+      docs = block;
+    }
+
+    n += mne_posting_intersect(a + i, end - i, docs, size, out + n);
+    i = end;
+    b++;
+  }
+
+  return n;
+}
+
+/*
+ * Intersects two sorted lists into out, which may be a itself since writes
+ * never pass the read cursor. The SSE2 path compares 4x4 blocks against all
+ * rotations at once and advances whichever block has the smaller maximum.
+ */
+uint32_t mne_posting_intersect(const uint32_t *a, uint32_t a_count, const uint32_t *b, uint32_t b_count, uint32_t *out) {
+  uint32_t i = 0, j = 0, n = 0;
+
+#ifdef __SSE2__
+  while (i + 4 <= a_count && j + 4 <= b_count) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + j));
+    __m128i eq = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi32(va, vb), _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+      _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+        _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(eq)), k;
+    uint32_t a_max = a[i + 3], b_max = b[j + 3];
+
+    for (k = 0; k < 4; k++) {
+      if (mask & (1 << k))
+        out[n++] = a[i + k];
+    }
+
+    i += a_max <= b_max ? 4 : 0;
+    j += b_max <= a_max ? 4 : 0;
+  }
+#endif
+
+  while (i < a_count && j < b_count) {
+    if (a[i] < b[j])
+      i++;
+    else if (a[i] > b[j])
+      j++;
+    else
+      out[n++] = a[i++], j++;
+  }
+
+  return n;
+}
+
+/* Returns a new sorted list holding the union of a and b. */
+uint32_t *mne_posting_union(const uint32_t *a, uint32_t a_count, const uint32_t *b, uint32_t b_count, uint32_t *count) {
+  uint32_t *merged = malloc(sizeof(uint32_t) * (a_count + b_count + 1));
+  assert(merged != NULL);
+  uint32_t i = 0, j = 0, n = 0;
+
+  /* Branchless merge: both cursors advance on a tie. */
+  while (i < a_count && j < b_count) {
+    uint32_t x = a[i], y = b[j];
+    merged[n++] = x < y ? x : y;
+    i += x <= y;
+    j += y <= x;
+  }
+
+  while (i < a_count)
+    merged[n++] = a[i++];
+  while (j < b_count)
+    merged[n++] = b[j++];
+
+  *count = n;
+  return merged;
+}
+
+static uint32_t mne_posting_bits(uint32_t max) {
+  uint32_t bits = 1;
+  while (bits < 32 && (max >> bits) != 0)
+    bits++;
+  return bits;
+}
+
+/* Bits of 0 mark a raw tail block of size docs. */
+static void mne_posting_decode_block(const uint32_t *packed, uint32_t bits, uint32_t base, uint32_t *out,
+    uint32_t size) {
+  uint32_t j;
+
+  if (bits == 0) {
+    memcpy(out, packed, sizeof(uint32_t) * size);
+    return;
+  }
+
+#ifdef __SSE2__
+  __m128i mask = _mm_set1_epi32(bits == 32 ? 0xffffffff : (1u << bits) - 1);
+  __m128i carry = _mm_set1_epi32(base);
+
+  for (j = 0; j < MNE_POSTING_BLOCK / 4; j++) {
+    uint32_t bit = j * bits, word = bit >> 5, shift = bit & 31;
+    __m128i v = _mm_srl_epi32(_mm_loadu_si128((const __m128i*)(packed + word * 4)), _mm_cvtsi32_si128(shift));
+
+    if (shift + bits > 32)
+      v = _mm_or_si128(v, _mm_sll_epi32(_mm_loadu_si128((const __m128i*)(packed + (word + 1) * 4)),
+        _mm_cvtsi32_si128(32 - shift)));
+
+    /* Four consecutive deltas: prefix sum them and add the running total. */
+    v = _mm_and_si128(v, mask);
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+    v = _mm_add_epi32(v, carry);
+    _mm_storeu_si128((__m128i*)(out + j * 4), v);
+    carry = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+#else
+  uint32_t mask = bits == 32 ? 0xffffffff : (1u << bits) - 1, i;
+
+  for (i = 0; i < MNE_POSTING_BLOCK; i++) {
+    uint32_t lane = i & 3, bit = (i >> 2) * bits, word = bit >> 5, shift = bit & 31;
+    uint32_t delta = packed[word * 4 + lane] >> shift;
+    if (shift + bits > 32)
+      delta |= packed[(word + 1) * 4 + lane] << (32 - shift);
+    base += delta & mask;
+    out[i] = base;
+  }
+  (void)j;
+#endif
+}
@@ -0,0 +1,25 @@
+#ifndef MEANIE_POSTING_H
+#define MEANIE_POSTING_H
+
+#include <stdint.h>
+
+/*
+ * Encoded posting list (all uint32 words):
+ *   count | num_blocks | skips: num_blocks * (last_doc, word offset, bits) | blocks
+ * Each full block holds MNE_POSTING_BLOCK deltas, bit-packed into 4
+ * interleaved lanes so one SIMD register decodes four deltas at a time. A
+ * partial tail block is stored raw (bits 0), and lists shorter than a block
+ * are just count | docs.
+ */
+
+#define MNE_POSTING_BLOCK 128
+
+uint32_t mne_posting_max_words(uint32_t);
+uint32_t mne_posting_encode(const uint32_t*, uint32_t, uint32_t*);
+uint32_t mne_posting_count(const uint32_t*);
+uint32_t mne_posting_decode(const uint32_t*, uint32_t*);
+uint32_t mne_posting_intersect_encoded(const uint32_t*, uint32_t, const uint32_t*, uint32_t*);
+uint32_t mne_posting_intersect(const uint32_t*, uint32_t, const uint32_t*, uint32_t, uint32_t*);
+uint32_t *mne_posting_union(const uint32_t*, uint32_t, const uint32_t*, uint32_t, uint32_t*);
+
+#endif
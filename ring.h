@@ -0,0 +1,60 @@
+#ifndef MEANIE_RING_H
+#define MEANIE_RING_H
+
+/*
+ * A lock-free queue between exactly one producer and one consumer. Each side
+ * only writes its own index, so a barrier between writing a slot and moving
+ * the index is all the synchronization it needs. The producer never waits: a
+ * push to a full ring fails and the caller tries again later.
+ */
+
+#define MNE_RING_SLOTS 1024
+
+/* A run of count items starting at first, in the producer's stream. */
+typedef struct {
+	unsigned int stream;
+	unsigned int first;
+	unsigned int count;
+} mne_ring_batch;
+
+typedef struct {
+	volatile unsigned int head; /* Next slot to read; only the consumer moves it. */
+	char head_pad[60];
+	volatile unsigned int tail; /* Next slot to write; only the producer moves it. */
+	char tail_pad[60];
+	mne_ring_batch slots[MNE_RING_SLOTS];
+} mne_ring;
+
+static inline void mne_ring_init(mne_ring *ring) {
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+/* Producer: queues batch, or returns 0 if the ring is full. */
+static inline int mne_ring_push(mne_ring *ring, const mne_ring_batch *batch) {
+  unsigned int tail = ring->tail;
+
+  if (tail - ring->head == MNE_RING_SLOTS)
+    return 0;
+
+  ring->slots[tail % MNE_RING_SLOTS] = *batch;
+  __sync_synchronize();
+  ring->tail = tail + 1;
+  return 1;
+}
+
+/* Consumer: takes the oldest batch, or returns 0 if the ring is empty. */
+static inline int mne_ring_pop(mne_ring *ring, mne_ring_batch *batch) {
+  unsigned int head = ring->head;
+
+  if (head == ring->tail)
+    return 0;
+
+  __sync_synchronize();
+  *batch = ring->slots[head % MNE_RING_SLOTS];
+  __sync_synchronize();
+  ring->head = head + 1;
+  return 1;
+}
+
+#endif
@@ -3,55 +3,198 @@
 #include <pthread.h>
 #include <pcre.h>
 #include <assert.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
 
 #include "util.h"
+#include "config.h"
 #include "git.h"
+#include "plan.h"
+#include "literal.h"
+#include "epoch.h"
+#include "index.h"
+#include "paths.h"
+#include "cache.h"
+#include "topology.h"
+#include "output.h"
 #include "search.h"
 #include "common.h"
 
 static pthread_t *threads;
-static pthread_cond_t search_cond = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t search_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t done_incr_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t all_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mne_epoch search_start, search_done, search_output;
+static volatile unsigned int search_remaining = 0;
 
 static int num_cores;
+static mne_topology topology;
 static struct timeval begin, end;
 static mne_search_ctx *search_contexts;
-static mne_search_result **search_results;
-static volatile int exiting = 0, threads_complete = 0;
-static pcre *re = NULL; /* TODO: volatile? */
-static pcre_extra *re_extra = NULL; /* TODO: volatile? */
+static mne_arena **search_results, **search_spans; /* Per thread, an arena per query of the batch. */
+static mne_search_result ***search_runs = NULL, **search_ordered = NULL;
+static unsigned int *search_run_lengths = NULL, *search_runs_size = NULL, *search_bounds = NULL;
+static unsigned int *search_ordered_threads = NULL; /* Whose arenas each of search_ordered is in. */
+static unsigned int search_ordered_size = 0;
+static int search_order_deferred;
+static int search_streaming = 0;
+static unsigned long search_printed = 0;
+static mne_output *search_outputs; /* Per thread: rendered results waiting to be written. */
+static unsigned int search_render_first, search_render_last;
+static struct timeval search_first;
+static volatile int exiting = 0;
+static __thread pcre_jit_stack *search_jit_stack = NULL;
+static void (*search_task)(int, void*) = NULL;
+static void *search_task_arg;
 static int *blob_sizes;
 static char **sha1_index, **blob_index;
+static unsigned char *search_mask;
+static int search_candidates;
+static unsigned int *search_order, search_work_size = 0;
+static mne_search_work *search_work = NULL;
+static mne_search_chunk *search_chunks = NULL;
+static int search_split;
+static size_t search_segment_bytes = 0;
+static volatile unsigned int search_cursor = 0, search_num_chunks = 0;
+static mne_search_query *search_queries = NULL;
+static unsigned int search_num_queries = 0, search_results_queries = 1;
+static volatile unsigned int search_cancel = 0, search_cancel_seen = 0, search_abandoned = 0;
+static volatile sig_atomic_t search_running = 0, search_cancel_reason = 0;
+static unsigned int search_limit = 0;
+static int search_mode = MNE_MODE_MATCHES;
+static int search_format = MNE_FORMAT_TEXT;
+static mne_search_tally *search_tallies = NULL;
+static unsigned int search_num_work = 0, search_tallies_size = 0;
 
 static void *mne_search(void*);
-static void mne_search_ready();
+static void mne_search_scan(mne_search_ctx*);
+static inline mne_arena *mne_search_results(int, unsigned int);
+static inline mne_arena *mne_search_spans(int, unsigned int);
+static inline int mne_search_recording();
+static inline int mne_search_range(const mne_search_query*, const mne_search_work*, int*);
+static int mne_search_exec(mne_search_ctx*, mne_search_query*, int, int, int, int*, int);
+static inline int mne_search_cut(const mne_search_query*, int, int, int);
+static mne_dfa_cache *mne_search_dfa_cache(mne_search_ctx*, const mne_search_query*);
+static void mne_search_blob(mne_search_ctx*, mne_search_query*, const mne_search_work*, mne_arena*, mne_arena*);
+static void mne_search_lines(mne_search_ctx*, mne_search_query*, const mne_search_work*, mne_arena*, mne_arena*);
+static void mne_search_count(mne_search_ctx*, mne_search_query*, const mne_search_work*, mne_search_tally*);
+static void mne_search_first(mne_search_ctx*, mne_search_query*, const mne_search_work*);
+static void mne_search_total_counts(mne_search_query*);
+static void mne_search_recount_task(int, void*);
+static unsigned long mne_search_print_counts(const mne_search_query*);
+static inline int mne_search_limit_reached(const mne_search_query*);
+static void mne_search_error_add(mne_search_ctx*, unsigned int, unsigned int, int);
+static void mne_search_print_errors(unsigned int);
+static int mne_search_compare_error(const void*, const void*);
+static pcre_jit_stack *mne_search_jit_stack(void*);
+static void mne_search_dedupe(unsigned int);
+static void mne_search_dedupe_task(int, void*);
+static inline unsigned int mne_search_tail(const mne_search_result*);
+static int mne_search_compare_result(const void*, const void*);
+static unsigned int mne_search_order(unsigned int, int);
+static void mne_search_sort_task(int, void*);
+static void mne_search_merge_task(int, void*);
+static unsigned int mne_search_lower_bound(mne_search_result**, unsigned int, const mne_search_result*);
+static inline int mne_search_before(const mne_search_result*, const mne_search_result*);
+static int mne_search_compare_order(const void*, const void*);
+static void mne_search_dispatch(const struct timespec*);
+static void mne_search_stream(unsigned int, const struct timespec*);
+static void mne_search_publish(mne_search_ctx*, const mne_arena*);
+static int mne_search_drain(const struct timespec*);
+static unsigned long mne_search_print_rest(unsigned int);
+static inline int mne_search_deferred(const mne_search_result*);
+static void mne_search_cancel(int);
+static void mne_search_interrupt(int);
+static void mne_search_print_cancelled();
+static void mne_search_print_engine(const mne_search_query*);
+static void mne_search_bench(int);
+static void mne_search_bench_task(int, void*);
+static int mne_search_compare_double(const void*, const void*);
+static int mne_search_prepare(mne_search_query*, const char*);
+static void mne_search_run(mne_search_query*, unsigned int);
+static void mne_search_release(mne_search_query*);
+static void mne_search_batch();
+static void mne_search_narrow(mne_search_query*);
+static int mne_search_complete(const mne_search_query*);
+static void mne_search_remember(const mne_search_query*);
 static void mne_search_initialize();
 static void mne_search_build_index();
-static int mne_search_print_results();
+static void mne_search_reload();
+static void mne_search_schedule(unsigned int);
+static int mne_search_compare_size(const void*, const void*);
+static unsigned long mne_search_print_results(unsigned int);
+static void mne_search_print_ordered(unsigned int, unsigned int);
+static void mne_search_render_task(int, void*);
+static void mne_search_render(mne_output*, const mne_search_result*, int, unsigned int, mne_search_position*);
+static void mne_search_render_line(mne_output*, const mne_search_result*, const mne_arena*);
+static void mne_search_encode(mne_output*, const mne_search_result*, int, unsigned int, mne_search_position*);
+static void mne_search_encode_blob(mne_output*, unsigned int);
+static void mne_search_encode_span(mne_output*, const char*, unsigned int, unsigned int);
+static void mne_search_encode_summary(const mne_search_query*, unsigned long);
+static void mne_search_locate(mne_search_position*, unsigned int, unsigned int);
+static void mne_search_flush(unsigned int, unsigned long);
 static void mne_search_index_iter(gpointer, gpointer, gpointer);
 
 void mne_search_cleanup() {
+  unsigned int q;
   int i;
   for (i = 0; i < num_cores; ++i) {
     pthread_join(threads[i], NULL);
+    for (q = 0; q < search_results_queries; q++) {
+      mne_arena_free(&search_results[i][q]);
+      mne_arena_free(&search_spans[i][q]);
+    }
     free(search_results[i]);
+    free(search_spans[i]);
+    free(search_runs[i]);
+    free(search_contexts[i].errors);
+    free(search_contexts[i].ring);
+    mne_output_free(&search_outputs[i]);
   }
     
   free(search_results);
+  free(search_spans);
+  free(search_runs);
+  free(search_run_lengths);
+  free(search_runs_size);
+  free(search_bounds);
+  free(search_ordered);
+  free(search_ordered_threads);
+  free(search_outputs);
   free(threads);
   free(search_contexts);
+  mne_epoch_destroy(&search_start);
+  mne_epoch_destroy(&search_done);
+  mne_epoch_destroy(&search_output);
   free(sha1_index);
   free(blob_index);
   free(blob_sizes);
+  free(search_mask);
+  free(search_order);
+  free(search_work);
+  free(search_chunks);
+  free(search_tallies);
+  mne_paths_free();
+  mne_cache_free();
+  mne_pattern_free();
+  mne_topology_free(&topology);
+  mne_index_close();
+}
+
+/* Runs task(thread, arg) on every search thread and waits for all of them. */
+void mne_search_parallel(void (*task)(int, void*), void *arg) {
+  search_task = task;
+  search_task_arg = arg;
+  mne_search_dispatch(NULL);
+  search_task = NULL;
+}
+
+int mne_search_threads() {
+  return num_cores;
 }
 
 void mne_search_loop() {
   char *term = NULL;
-  const char *error;
-  int erroffset;
 
   mne_search_initialize();
   printf("\nType 'exit' to... you know what.\n");
@@ -70,71 +213,543 @@ void mne_search_loop() {
 
     if (strncmp(term, "exit", 4) == 0) {
       exiting = 1;
-      mne_search_ready();
+      mne_epoch_advance(&search_start);
       free(term);
       term = NULL;
       break;
     }
 
-    re = pcre_compile(term, 0, &error, &erroffset, NULL);
+    if (strncmp(term, "bench", 5) == 0 && (term[5] == 0 || term[5] == ' ')) {
+      mne_search_bench(term[5] == ' ' ? atoi(term + 6) : 0);
+      free(term);
+      term = NULL;
+      continue;
+    }
+
+    if (strncmp(term, "limit", 5) == 0 && (term[5] == 0 || term[5] == ' ')) {
+      if (term[5] == ' ')
+        config.max_results = strtoul(term + 6, NULL, 10);
+      if (config.max_results > 0)
+        printf("Queries stop after %lu matches.\n", config.max_results);
+      else
+        printf("Queries have no result limit.\n");
+      free(term);
+      term = NULL;
+      continue;
+    }
 
-    if (re == NULL) {
-       printf("Regex compilation failed at offset %d: %s\n", erroffset, error);
-       free(term);
-       term = NULL;
-       continue;
-     }
+    if (strncmp(term, "mode", 4) == 0 && (term[4] == 0 || term[4] == ' ')) {
+      if (strcmp(term + 4, " matches") == 0)
+        config.mode = MNE_MODE_MATCHES;
+      else if (strcmp(term + 4, " count") == 0)
+        config.mode = MNE_MODE_COUNT;
+      else if (strcmp(term + 4, " files") == 0)
+        config.mode = MNE_MODE_FILES;
+      else if (strcmp(term + 4, " lines") == 0)
+        config.mode = MNE_MODE_LINES;
+      else if (term[4] != 0)
+        printf("Modes are matches, count, files and lines.\n");
+      printf("Queries report %s.\n", config.mode == MNE_MODE_COUNT ? "match counts per file" :
+        (config.mode == MNE_MODE_FILES ? "files with matches" :
+        (config.mode == MNE_MODE_LINES ? "every matching line" : "every match")));
+      free(term);
+      term = NULL;
+      continue;
+    }
 
-    re_extra = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &error);
+    if (strncmp(term, "captures", 8) == 0 && (term[8] == 0 || term[8] == ' ')) {
+      if (strcmp(term + 8, " on") == 0)
+        config.captures = 1;
+      else if (strcmp(term + 8, " off") == 0)
+        config.captures = 0;
+      else if (term[8] != 0)
+        printf("Captures are on or off.\n");
+      printf("Groups %s.\n", config.captures ? "capture" : "don't capture");
+      free(term);
+      term = NULL;
+      continue;
+    }
 
-    if (error != NULL) {
-      printf("pcre_study() failed: %s\n", error);
-      pcre_free_study(re_extra);
-      re_extra = NULL;
-      pcre_free(re);
+    if (strncmp(term, "format", 6) == 0 && (term[6] == 0 || term[6] == ' ')) {
+      if (strcmp(term + 6, " text") == 0)
+        config.format = MNE_FORMAT_TEXT;
+      else if (strcmp(term + 6, " json") == 0)
+        config.format = MNE_FORMAT_JSON;
+      else if (strcmp(term + 6, " msgpack") == 0)
+        config.format = MNE_FORMAT_MSGPACK;
+      else if (term[6] != 0)
+        printf("Formats are text, json and msgpack.\n");
+      mne_output_setup(config.format);
+      printf("Results are written as %s.\n", config.format == MNE_FORMAT_JSON ? "JSON Lines records" :
+        (config.format == MNE_FORMAT_MSGPACK ? "MessagePack records" : "text"));
+      free(term);
+      term = NULL;
+      continue;
+    }
+
+    if (strncmp(term, "stream", 6) == 0 && (term[6] == 0 || term[6] == ' ')) {
+      if (strcmp(term + 6, " on") == 0)
+        config.stream = 1;
+      else if (strcmp(term + 6, " off") == 0)
+        config.stream = 0;
+      else if (term[6] != 0)
+        printf("Streaming is on or off.\n");
+      printf("Results print %s.\n", config.stream ? "as they're found" : "in path order");
+      free(term);
+      term = NULL;
+      continue;
+    }
+
+    if (strcmp(term, "cache") == 0) {
+      mne_cache_print_stats();
+      mne_pattern_print_stats();
+      free(term);
+      term = NULL;
+      continue;
+    }
+
+    if (strcmp(term, "reload") == 0) {
+      mne_search_reload();
+      free(term);
+      term = NULL;
+      continue;
+    }
+
+    if (strcmp(term, "batch") == 0) {
+      mne_search_batch();
       free(term);
       term = NULL;
       continue;
     }
-   
-    printf("\n");
-    gettimeofday(&begin, NULL);
-    threads_complete = 0;
-    pthread_mutex_unlock(&all_done_mutex);
-    pthread_mutex_lock(&all_done_mutex);
-    mne_search_ready();
-    pthread_mutex_lock(&all_done_mutex);
-    gettimeofday(&end, NULL);
-    int total = mne_search_print_results();
-
-    if (total == MAX_SEARCH_RESULTS_PER_THREAD * num_cores)
-      printf("Hit match limit!\n");
-    
-    printf("%d matches. ", total);
-    mne_print_duration(&end, &begin);
-    printf(".\n");
+
+    mne_search_query query;
+    if (mne_search_prepare(&query, term)) {
+      printf("\n");
+      mne_search_run(&query, 1);
+      mne_search_release(&query);
+    }
 
     free(term);
     term = NULL;
-    pcre_free(re);
-    if (re_extra != NULL)
-      pcre_free_study(re_extra);
   }
 }
 
+/*
+ * Reads one query per line until an empty line, then searches for all of
+ * them in a single pass over the corpus.
+ */
+static void mne_search_batch() {
+  mne_search_query queries[SEARCH_MAX_BATCH];
+  char *terms[SEARCH_MAX_BATCH];
+  unsigned int i, num_queries = 0;
+
+  printf("One regex per line, up to %d; an empty line runs them.\n", SEARCH_MAX_BATCH);
+
+  while (num_queries < SEARCH_MAX_BATCH) {
+    char *term = NULL;
+    size_t term_bytes = 0;
+
+    printf("  #%u: ", num_queries + 1);
+    if (getline(&term, &term_bytes, stdin) <= 0 || term[0] == '\n') {
+      free(term);
+      break;
+    }
+    term[strcspn(term, "\n")] = 0;
+
+    if (mne_search_prepare(&queries[num_queries], term))
+      terms[num_queries++] = term;
+    else
+      free(term);
+  }
+
+  if (num_queries > 0) {
+    printf("\n");
+    mne_search_run(queries, num_queries);
+  }
+
+  for (i = 0; i < num_queries; i++) {
+    mne_search_release(&queries[i]);
+    free(terms[i]);
+  }
+}
+
+/*
+ * Parses term's path filters and compiles its regex into query, which keeps
+ * pointers into term. Says what is wrong and returns 0 when it can't.
+ */
+static int mne_search_prepare(mne_search_query *query, const char *term) {
+  const char *error;
+  int erroffset;
+
+  memset(query, 0, sizeof(mne_search_query));
+  query->term = term;
+
+  if ((query->pattern = mne_paths_parse(term, &query->filter)) == NULL || *query->pattern == 0) {
+    if (query->pattern != NULL)
+      printf("Nothing to search for.\n");
+    mne_paths_filter_free(&query->filter);
+    return 0;
+  }
+
+  /* Lines mode anchors ^ and $ at every line, as grep does. */
+  query->flags = config.mode == MNE_MODE_LINES ? PCRE_MULTILINE : 0;
+  if (!config.captures)
+    query->flags |= PCRE_NO_AUTO_CAPTURE;
+
+  gettimeofday(&query->compile_begin, NULL);
+  query->compiled = mne_pattern_get(query->pattern, query->flags, &query->compile_cached, &error, &erroffset);
+  gettimeofday(&query->compile_end, NULL);
+
+  if (query->compiled == NULL) {
+    if (erroffset >= 0)
+      printf("Regex compilation failed at offset %d: %s\n", erroffset, error);
+    else
+      printf("pcre_study() failed: %s\n", error);
+    mne_paths_filter_free(&query->filter);
+    return 0;
+  }
+
+  query->re = query->compiled->re;
+  query->re_extra = query->compiled->extra;
+  return 1;
+}
+
+/*
+ * Limits query to the blobs a cached query matched, when every match of
+ * query is known to be among them (see mne_cache_lookup).
+ */
+static void mne_search_narrow(mne_search_query *query) {
+  unsigned int n, num_blobs = g_hash_table_size(blobs);
+  const mne_cache_entry *cached = mne_cache_lookup(query->pattern, query->flags, query->plan);
+
+  if (cached == NULL)
+    return;
+
+  if (query->candidates < 0) {
+    memset(query->mask, 0, num_blobs);
+    for (n = 0; n < cached->num_blobs; n++)
+      query->mask[cached->blobs[n]] = 1;
+    query->candidates = cached->num_blobs;
+  } else {
+    for (n = 0; n < cached->num_blobs; n++)
+      query->mask[cached->blobs[n]] <<= 1;
+    for (n = 0, query->candidates = 0; n < num_blobs; n++) {
+      query->mask[n] = query->mask[n] == 2;
+      query->candidates += query->mask[n];
+    }
+  }
+
+  printf("Cache: %d blobs left after '%s'.\n\n", query->candidates, cached->pattern);
+}
+
+/* Whether query saw every match: not cancelled, limited or cut short by PCRE. */
+static int mne_search_complete(const mne_search_query *query) {
+  int i, n;
+
+  if (search_cancel != search_cancel_seen || (search_limit > 0 && query->total >= search_limit))
+    return 0;
+
+  for (i = 0; i < num_cores; i++) {
+    for (n = 0; n < search_contexts[i].num_errors; n++) {
+      if (search_contexts[i].errors[n].query == query->id)
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Caches the blobs a complete, unfiltered query matched. */
+static void mne_search_remember(const mne_search_query *query) {
+  unsigned int i, n, count = 0, num_blobs = g_hash_table_size(blobs);
+
+  if (config.cache_bytes == 0 || query->filter.num_prefixes > 0 || query->filter.num_regexes > 0)
+    return;
+
+  unsigned int *matched = malloc(sizeof(unsigned int) * (num_blobs + 1));
+  assert(matched != NULL);
+
+  if (mne_search_recording()) {
+    /* The scan is over, so the schedule's mask is free to reuse. */
+    memset(search_mask, 0, num_blobs);
+    for (i = 0; i < num_cores; i++) {
+      mne_arena *results = mne_search_results(i, query->id);
+      for (n = 0; n < results->count; n++)
+        search_mask[((mne_search_result*)mne_arena_get(results, n))->sha1_offset] = 1;
+    }
+  }
+
+  for (n = 0; n < num_blobs; n++) {
+    if (mne_search_recording() ? search_mask[n] : query->counts[n] > 0)
+      matched[count++] = n;
+  }
+
+  mne_cache_store(query->pattern, query->flags, query->plan, matched, count);
+  free(matched);
+}
+
+static void mne_search_release(mne_search_query *query) {
+  mne_plan_free(query->plan);
+  mne_paths_filter_free(&query->filter);
+  mne_pattern_put(query->compiled);
+  if (query->dfa_caches != NULL) {
+    int i;
+    for (i = 0; i < num_cores; i++)
+      mne_dfa_cache_free(query->dfa_caches[i]);
+    free(query->dfa_caches);
+  }
+  free(query->mask);
+  free(query->counts);
+}
+
+/* Searches for a batch of prepared queries; each thread runs all of them over a chunk before the next. */
+static void mne_search_run(mne_search_query *queries, unsigned int num_queries) {
+  unsigned int i, q, n, num_blobs = g_hash_table_size(blobs);
+  struct timeval candidates_end;
+
+  gettimeofday(&begin, NULL);
+
+  /* The deadline counts from here, so candidate selection is included. */
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += config.timeout_ms / 1000;
+  deadline.tv_nsec += (config.timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  for (q = 0; q < num_queries; q++) {
+    mne_search_query *query = &queries[q];
+    query->id = q;
+    query->mask = malloc(sizeof(unsigned char) * (num_blobs + 1));
+    assert(query->mask != NULL);
+    query->plan = mne_plan_compile(query->pattern);
+    query->candidates = mne_index_candidates(query->plan, query->mask, num_blobs);
+    query->literal = mne_plan_required(query->plan);
+    query->total = 0;
+    query->truncated = 0;
+    query->dfa_gave_up = 0;
+
+    /* The literal matcher is a scan for the same literal; prefiltering would only read it twice. */
+    if (query->compiled->fixed != NULL && query->compiled->fixed->method == MNE_FIXED_LITERAL)
+      query->literal = NULL;
+
+    /* Threads build their DFA caches on first use. */
+    if (query->compiled->dfa != NULL && config.dfa_bytes > 0 && query->dfa_caches == NULL) {
+      query->dfa_caches = calloc(num_cores, sizeof(mne_dfa_cache*));
+      assert(query->dfa_caches != NULL);
+    }
+
+    if (config.mode == MNE_MODE_COUNT || config.mode == MNE_MODE_FILES) {
+      query->counts = calloc(num_blobs + 1, sizeof(unsigned int));
+      assert(query->counts != NULL);
+    }
+  }
+  gettimeofday(&candidates_end, NULL);
+
+  for (q = 0; q < num_queries; q++) {
+    mne_search_query *query = &queries[q];
+    if (query->filter.num_prefixes > 0 || query->filter.num_regexes > 0) {
+      struct timeval filter_begin, filter_end;
+      gettimeofday(&filter_begin, NULL);
+      query->candidates = mne_paths_filter(&query->filter, query->mask, num_blobs, query->candidates >= 0);
+      gettimeofday(&filter_end, NULL);
+      printf("Path filter: %d blobs in ", query->candidates);
+      mne_print_duration(&filter_end, &filter_begin);
+      printf(".\n\n");
+    }
+
+    mne_search_narrow(query);
+  }
+
+  /* The schedule covers the union of the queries' candidates. */
+  for (q = 0, search_candidates = 0; q < num_queries; q++) {
+    if (queries[q].candidates < 0)
+      search_candidates = -1;
+  }
+
+  if (search_candidates == 0) {
+    memset(search_mask, 0, num_blobs);
+    for (q = 0; q < num_queries; q++) {
+      for (n = 0; n < num_blobs; n++)
+        search_mask[n] |= queries[q].mask[n];
+    }
+    for (n = 0; n < num_blobs; n++)
+      search_candidates += search_mask[n];
+  }
+
+  /* Each thread keeps arenas of results and spans per query in the batch. */
+  if (num_queries > search_results_queries) {
+    for (i = 0; i < num_cores; i++) {
+      search_results[i] = realloc(search_results[i], sizeof(mne_arena) * num_queries);
+      search_spans[i] = realloc(search_spans[i], sizeof(mne_arena) * num_queries);
+      assert(search_results[i] != NULL && search_spans[i] != NULL);
+      for (q = search_results_queries; q < num_queries; q++) {
+        mne_arena_init(&search_results[i][q], sizeof(mne_search_result));
+        mne_arena_init(&search_spans[i][q], sizeof(mne_search_span));
+      }
+    }
+    search_results_queries = num_queries;
+  }
+
+  for (i = 0; i < num_cores; i++) {
+    for (q = 0; q < num_queries; q++) {
+      mne_arena_reset(&search_results[i][q]);
+      mne_arena_reset(&search_spans[i][q]);
+    }
+  }
+
+  mne_search_schedule(num_queries);
+
+  if (config.mode == MNE_MODE_COUNT) {
+    if (search_num_work * num_queries > search_tallies_size) {
+      search_tallies_size = search_num_work * num_queries;
+      search_tallies = realloc(search_tallies, sizeof(mne_search_tally) * search_tallies_size);
+      assert(search_tallies != NULL);
+    }
+
+    /* Work a query skips or never reaches counts nothing. */
+    for (i = 0; i < search_num_work * num_queries; i++) {
+      search_tallies[i].count = 0;
+      search_tallies[i].tail = search_work[i % search_num_work].start;
+    }
+  }
+
+  search_queries = queries;
+  search_num_queries = num_queries;
+  search_cancel_seen = search_cancel;
+  search_abandoned = 0;
+  search_limit = config.max_results;
+  search_mode = config.mode;
+  search_format = config.format;
+  search_printed = 0;
+
+  /* A batch prints query by query, so only a single query can stream. */
+  search_streaming = config.stream && num_queries == 1 && mne_search_recording();
+  for (i = 0; i < num_cores; i++) {
+    mne_ring_init(search_contexts[i].ring);
+    search_contexts[i].published = 0;
+  }
+
+  search_running = 1;
+  mne_search_dispatch(config.timeout_ms > 0 ? &deadline : NULL);
+  search_running = 0;
+
+  for (q = 0; q < num_queries; q++) {
+    if (search_split && mne_search_recording())
+      mne_search_dedupe(q);
+    if (search_mode == MNE_MODE_COUNT)
+      mne_search_total_counts(&queries[q]);
+  }
+  gettimeofday(&end, NULL);
+
+  for (q = 0; q < num_queries; q++) {
+    if (mne_search_complete(&queries[q]))
+      mne_search_remember(&queries[q]);
+  }
+
+  for (q = 0; q < num_queries; q++) {
+    mne_search_query *query = &queries[q];
+
+    if (num_queries > 1)
+      printf(mne_output_colors() ? "\033[1;35m#%u\033[0m %s\n\n" : "#%u %s\n\n", q + 1, query->term);
+
+    unsigned long total = search_streaming ? mne_search_print_rest(q) :
+      (mne_search_recording() ? mne_search_print_results(q) : mne_search_print_counts(query));
+    if (search_format != MNE_FORMAT_TEXT)
+      mne_search_encode_summary(query, total);
+    mne_search_print_errors(q);
+    if (num_queries == 1)
+      mne_search_print_cancelled();
+
+    if (search_limit > 0 && query->total >= search_limit)
+      printf("Stopped at the result limit (%u).\n", search_limit);
+
+    if (num_queries > 1)
+      printf("#%u: ", q + 1);
+    printf("%lu %s in %d/%d blobs", total, search_mode == MNE_MODE_FILES ? "files" :
+      (search_mode == MNE_MODE_LINES ? "lines" : "matches"),
+      query->candidates < 0 ? num_blobs : query->candidates, num_blobs);
+    if (num_queries > 1) {
+      printf(" (");
+      mne_search_print_engine(query);
+      printf(").\n\n");
+      continue;
+    }
+
+    printf(". ");
+    mne_print_duration(&end, &begin);
+    printf(" (");
+    if (search_printed > 0) {
+      printf("first result ");
+      mne_print_duration(&search_first, &begin);
+      printf(", ");
+    }
+    printf("compile ");
+    mne_print_duration(&query->compile_end, &query->compile_begin);
+    printf("%s, candidates ", query->compile_cached ? " cached" : "");
+    mne_print_duration(&candidates_end, &begin);
+    printf("; ");
+    mne_search_print_engine(query);
+    printf(").\n");
+  }
+
+  if (num_queries > 1) {
+    struct timeval compile = {0, 0}, zero = {0, 0};
+    for (q = 0; q < num_queries; q++) {
+      compile.tv_sec += queries[q].compile_end.tv_sec - queries[q].compile_begin.tv_sec;
+      compile.tv_usec += queries[q].compile_end.tv_usec - queries[q].compile_begin.tv_usec;
+    }
+
+    mne_search_print_cancelled();
+    printf("%u queries in one pass over %d/%d blobs. ", num_queries,
+      search_candidates < 0 ? num_blobs : search_candidates, num_blobs);
+    mne_print_duration(&end, &begin);
+    printf(" (compile ");
+    mne_print_duration(&compile, &zero);
+    printf(", candidates ");
+    mne_print_duration(&candidates_end, &begin);
+    printf(").\n");
+  }
+
+  search_queries = NULL;
+  search_num_queries = 0;
+}
+
 static void mne_search_initialize() {
+  char index_path[PATH_MAX];
+
+  if (config.index_path != NULL)
+    snprintf(index_path, PATH_MAX, "%s", config.index_path);
+  else
+    snprintf(index_path, PATH_MAX, "%smeanie", mne_git_dir());
+
+  mne_index_open(index_path);
+  mne_cache_init(config.cache_bytes);
+  mne_pattern_init(mne_search_jit_stack, config.match_limit, config.recursion_limit);
   mne_search_build_index();
-  num_cores = mne_detect_logical_cores();
+  mne_topology_detect(&topology);
+  num_cores = mne_topology_workers(&topology, config.workers);
 
-  search_results = malloc(sizeof(mne_search_result*) * num_cores);
-  assert(search_results != NULL);
+  search_results = malloc(sizeof(mne_arena*) * num_cores);
+  search_spans = malloc(sizeof(mne_arena*) * num_cores);
+  search_runs = calloc(num_cores, sizeof(mne_search_result**));
+  search_run_lengths = calloc(num_cores, sizeof(unsigned int));
+  search_runs_size = calloc(num_cores, sizeof(unsigned int));
+  search_bounds = malloc(sizeof(unsigned int) * (num_cores + 1) * num_cores);
+  search_outputs = malloc(sizeof(mne_output) * num_cores);
+  assert(search_results != NULL && search_spans != NULL && search_runs != NULL && search_run_lengths != NULL &&
+    search_runs_size != NULL && search_bounds != NULL && search_outputs != NULL);
 
-  int i, n;
+  int i;
   for (i = 0; i < num_cores; i++) {
-    search_results[i] = malloc(sizeof(mne_search_result) * MAX_SEARCH_RESULTS_PER_THREAD);
-    assert(search_results[i] != NULL);
-    for (n = 0; n < MAX_SEARCH_RESULTS_PER_THREAD; n++)
-      search_results[i][n].fresh = 0;
+    search_results[i] = malloc(sizeof(mne_arena));
+    search_spans[i] = malloc(sizeof(mne_arena));
+    assert(search_results[i] != NULL && search_spans[i] != NULL);
+    mne_arena_init(search_results[i], sizeof(mne_search_result));
+    mne_arena_init(search_spans[i], sizeof(mne_search_span));
+    mne_output_init(&search_outputs[i]);
   }
 
   threads = malloc(sizeof(pthread_t) * num_cores);
@@ -143,13 +758,39 @@ static void mne_search_initialize() {
   search_contexts = malloc(sizeof(mne_search_ctx) * num_cores);
   assert(search_contexts != NULL);
 
+  /* Spinning on a single CPU would only delay the thread we are waiting for. */
+  int spins = topology.allowed > 1 ? MNE_EPOCH_SPINS : 0;
+  mne_epoch_init(&search_start, spins);
+  mne_epoch_init(&search_done, spins);
+  mne_epoch_init(&search_output, spins);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = mne_search_interrupt;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+
   int z, num_blobs = g_hash_table_size(blobs);
+  /* Oversubscribed threads pinned two to a CPU couldn't be moved off it. */
+  int pinned = config.pin && num_cores <= topology.allowed;
 
   for (z = 0; z < num_cores; z++) {
      search_contexts[z].initial = z;
      search_contexts[z].num_blobs = num_blobs;
+     search_contexts[z].errors = NULL;
+     search_contexts[z].num_errors = 0;
+     search_contexts[z].errors_size = 0;
+     search_contexts[z].ring = malloc(sizeof(mne_ring));
+     assert(search_contexts[z].ring != NULL);
      pthread_create(&threads[z], NULL, mne_search, (void *)&search_contexts[z]);
+     if (pinned && !mne_topology_pin(&topology, threads[z], z))
+       pinned = 0;
    }
+
+  mne_topology_print(&topology, config.workers, num_cores, pinned);
+
+  mne_index_sync(sha1_index, blob_index, blob_sizes, num_blobs);
 }
 
 static void mne_search_build_index() {
@@ -165,143 +806,1438 @@ static void mne_search_build_index() {
   blob_sizes = malloc(sizeof(int) * blob_count);
   assert(blob_sizes != NULL);
 
+  search_mask = malloc(sizeof(unsigned char) * (blob_count + 1));
+  assert(search_mask != NULL);
+
+  search_order = malloc(sizeof(unsigned int) * (blob_count + 1));
+  assert(search_order != NULL);
+
   mne_indices_ctx ctx;
   ctx.offset = 0;
 
   g_hash_table_foreach(blobs, mne_search_index_iter, &ctx);
   printf(" ✔\n");
+
+  /* Largest blobs first, so the stragglers at the end of a search are small. */
+  int n;
+  for (n = 0; n < blob_count; n++)
+    search_order[n] = n;
+  qsort(search_order, blob_count, sizeof(unsigned int), mne_search_compare_size);
+
+  mne_paths_build(sha1_index, blob_count);
 }
 
-static void mne_search_index_iter(gpointer key, gpointer value, gpointer user_data) {
-  mne_indices_ctx *ctx = (mne_indices_ctx *)user_data;
-  sha1_index[ctx->offset] = (char*)key;
-  blob_index[ctx->offset] = (char*)value;
-  blob_sizes[ctx->offset] = strlen((char*)value);
-  ctx->offset++;
+/* Reloads blobs from the repository. Only new blobs get indexed. */
+static void mne_search_reload() {
+  free(sha1_index);
+  free(blob_index);
+  free(blob_sizes);
+  free(search_mask);
+  free(search_order);
+  mne_paths_free();
+
+  mne_git_cleanup();
+  mne_cache_advance();
+  mne_git_load_blobs(config.repo_path);
+  mne_search_build_index();
+
+  int z, num_blobs = g_hash_table_size(blobs);
+  for (z = 0; z < num_cores; z++)
+    search_contexts[z].num_blobs = num_blobs;
+
+  mne_index_sync(sha1_index, blob_index, blob_sizes, num_blobs);
 }
 
-static int mne_search_print_results() {
-  int i, n, total_results = 0;
-  for (i = 0; i < num_cores; i++) {
-    for (n = 0; n < MAX_SEARCH_RESULTS_PER_THREAD; n++) {
-      mne_search_result result = search_results[i][n];
-      if (result.fresh == 0)
-        break;
+/*
+ * Groups the blobs to scan into chunks of about SEARCH_CHUNK_BYTES, biggest
+ * first. Blobs over config.segment_bytes are cut into line-aligned segments.
+ */
+static void mne_search_schedule(unsigned int num_queries) {
+  unsigned int i, num_work = 0, num_blobs = g_hash_table_size(blobs);
+  size_t chunk_bytes = SEARCH_CHUNK_BYTES, segment_bytes = config.segment_bytes;
 
-      total_results++;
-      char *sha1 = sha1_index[result.sha1_offset];
-      char *path = (char*)g_hash_table_lookup(paths, sha1);
-      int pad_left = 0, pad_right = 0;
+  if (num_queries > 1 && (segment_bytes == 0 || segment_bytes > SEARCH_CHUNK_BYTES))
+    segment_bytes = SEARCH_CHUNK_BYTES;
 
-      while (1) {
-        if (result.offset - pad_left <= 0)
-          break;    
-        pad_left++;
-        if (pad_left == RESULT_PAD)
-          break;
-        if (blob_index[result.sha1_offset][result.offset - pad_left] == '\n') {
-          pad_left--;
-          break;
-        }
-      }
+  /* One work item per blob, plus the extra segments of large blobs. */
+  unsigned int work_size = num_blobs + 1;
+  for (i = 0; i < num_blobs && segment_bytes > 0 && blob_sizes[search_order[i]] > segment_bytes; i++)
+    work_size += blob_sizes[search_order[i]] / segment_bytes;
 
-      while (1) {
-        if (pad_right >= blob_sizes[result.sha1_offset])
-          break;
-        if (blob_index[result.sha1_offset][result.offset + result.length + pad_right] == '\n') {
-          break;
+  if (work_size > search_work_size) {
+    search_work_size = work_size;
+    search_work = realloc(search_work, sizeof(mne_search_work) * work_size);
+    search_chunks = realloc(search_chunks, sizeof(mne_search_chunk) * work_size);
+    assert(search_work != NULL && search_chunks != NULL);
+  }
+
+  search_num_chunks = 0;
+  search_split = 0;
+  search_segment_bytes = segment_bytes;
+
+  for (i = 0; i < num_blobs; i++) {
+    unsigned int n = search_order[i], size = blob_sizes[n];
+    if (search_candidates >= 0 && !search_mask[n])
+      continue;
+
+    if (segment_bytes > 0 && size > segment_bytes) {
+      unsigned int start = 0, end;
+      search_split = 1;
+
+      while (start < size) {
+        end = size;
+        if (size - start > segment_bytes) {
+          const char *newline = memchr(blob_index[n] + start + segment_bytes, '\n',
+            size - start - segment_bytes);
+          if (newline != NULL)
+            end = newline - blob_index[n] + 1;
         }
-        pad_right++;
-        if (pad_right == RESULT_PAD)
-          break;
+
+        search_work[num_work].blob = n;
+        search_work[num_work].start = start;
+        search_work[num_work].end = end;
+        search_chunks[search_num_chunks].first = num_work++;
+        search_chunks[search_num_chunks++].last = num_work;
+        start = end;
       }
 
-      const char **sha1_refs = g_hash_table_lookup(refs, (gpointer)sha1_index[result.sha1_offset]);
+      chunk_bytes = SEARCH_CHUNK_BYTES;
+      continue;
+    }
 
-      int i;
-      for(i = 0 ; i < total_refs; i++) {
-        if (sha1_refs[i] == NULL)
-          break;
-        printf("\033[36m%s\033[0m ", sha1_refs[i]);
-      }
-      printf("\n\033[1m%s:%d\033[0m\n%.*s\033[1;32m%.*s\033[0m%.*s...\n\n", path, result.offset, pad_left,
-        blob_index[result.sha1_offset] + result.offset - pad_left, result.length, blob_index[result.sha1_offset] + result.offset,
-        pad_right, blob_index[result.sha1_offset] + result.offset + result.length);
+    if (chunk_bytes >= SEARCH_CHUNK_BYTES) {
+      search_chunks[search_num_chunks].first = num_work;
+      search_num_chunks++;
+      chunk_bytes = 0;
     }
+
+    search_work[num_work].blob = n;
+    search_work[num_work].start = 0;
+    search_work[num_work].end = size;
+    num_work++;
+    search_chunks[search_num_chunks - 1].last = num_work;
+    chunk_bytes += size;
   }
 
-  return total_results;
+  search_num_work = num_work;
+  search_cursor = 0;
 }
 
-static void *mne_search(void *_ctx) {
-  int rc, i, num_results, n, matches[MAX_CAPTURES], offset;
-  mne_search_ctx *ctx = (mne_search_ctx *)_ctx;
-  mne_search_result *results = search_results[ctx->initial];
+/* Stops the running query; workers check search_cancel between chunks and matches. Signal safe. */
+static void mne_search_cancel(int reason) {
+  search_cancel_reason = reason;
+  __sync_fetch_and_add(&search_cancel, 1);
+}
 
-  while (1) {
-    pthread_mutex_lock(&search_mutex);
-    pthread_cond_wait(&search_cond, &search_mutex);
-    pthread_mutex_unlock(&search_mutex);
+/* Ctrl-C cancels the running query; at the prompt it quits as usual. */
+static void mne_search_interrupt(int sig) {
+  if (!search_running) {
+    signal(sig, SIG_DFL);
+    raise(sig);
+    return;
+  }
 
-    if (exiting)
-      break;
+  mne_search_cancel(SEARCH_CANCEL_INTERRUPT);
+}
 
-    num_results = 0;
+/* Says why a query stopped early and how much of it was left. */
+static void mne_search_print_cancelled() {
+  if (search_cancel == search_cancel_seen)
+    return;
 
-    for (n = ctx->initial; n < ctx->num_blobs; n += num_cores) {
-      offset = 0;
+  unsigned int cursor = search_cursor < search_num_chunks ? search_cursor : search_num_chunks;
+  unsigned int skipped = search_num_chunks - cursor + search_abandoned;
 
-      while (1) {
-        rc = pcre_exec(re, re_extra, blob_index[n], blob_sizes[n], offset, 0, matches, MAX_CAPTURES);
+  /* Cancelled after the last chunk was done: nothing was missed. */
+  if (skipped == 0)
+    return;
 
-        if (unlikely(rc == 0)) {
-          mne_printf_async("Too many captured substrings in blob %s (> %d).\n", sha1_index[n], MAX_CAPTURES);
-          continue;          
-        }
+  if (search_cancel_reason == SEARCH_CANCEL_DEADLINE)
+    printf("Deadline of %lums exceeded", config.timeout_ms);
+  else
+    printf("Interrupted");
+  printf(", results are incomplete: %u of %u chunks were cut short or not searched.\n", skipped, search_num_chunks);
+}
 
-        if (rc > 0) {
-          for (i = 0; i < rc; ++i) {
-            // TODO: These are captured substrings, they should all be part of the same result.
-            results[num_results].fresh = 1;
-            results[num_results].sha1_offset = n;
-            results[num_results].offset = matches[2*i];
-            results[num_results].length = matches[2*i+1] - matches[2*i];
+/* Which engine ran query: a fixed-length matcher, prefixes, the DFA, or PCRE and why. */
+static void mne_search_print_engine(const mne_search_query *query) {
+  unsigned long built = 0, flushes = 0;
+  int i;
 
-            if (unlikely(num_results == MAX_SEARCH_RESULTS_PER_THREAD))
-              break;
+  if (query->compiled->fixed != NULL) {
+    printf("%s", mne_fixed_name(query->compiled->fixed));
+    return;
+  }
 
-            offset = matches[2*i] + (matches[2*i+1] - matches[2*i]);
-            num_results++;        
-          }    
-        } else {
-          break;
-        }
+  if (query->compiled->prefixes != NULL && query->compiled->prefixes->num_literals == 1)
+    printf("literal prefix, ");
+  else if (query->compiled->prefixes != NULL)
+    printf("%s over %d prefixes, ", mne_multi_name(query->compiled->prefixes),
+      query->compiled->prefixes->num_literals);
 
-        if (unlikely(num_results == MAX_SEARCH_RESULTS_PER_THREAD))
-          break;
-      }
+  if (query->dfa_caches == NULL) {
+    printf("pcre: %s", query->compiled->dfa == NULL ? query->compiled->dfa_unsupported : "dfa disabled");
+    return;
+  }
 
-      if (unlikely(num_results == MAX_SEARCH_RESULTS_PER_THREAD)) {
-        break;
-      }
+  for (i = 0; i < num_cores; i++) {
+    if (query->dfa_caches[i] != NULL) {
+      built += query->dfa_caches[i]->forward.built + query->dfa_caches[i]->reverse.built;
+      flushes += query->dfa_caches[i]->forward.flushes + query->dfa_caches[i]->reverse.flushes;
     }
+  }
 
-    /* Mark the next result as unfresh so the main threads knows how many results we found. */
-    if (num_results < MAX_SEARCH_RESULTS_PER_THREAD)
-      results[num_results].fresh = 0;
-    
-    pthread_mutex_lock(&done_incr_mutex);
-    threads_complete++;
-    if (threads_complete == num_cores)
-      pthread_mutex_unlock(&all_done_mutex);
-    pthread_mutex_unlock(&done_incr_mutex);
+  if (query->dfa_gave_up) {
+    printf("pcre: dfa gave up after %lu states, %lu flushes", built, flushes);
+    return;
   }
 
-  pthread_exit(NULL);
+  printf("dfa, %lu states", built);
+  if (flushes > 0)
+    printf(", %lu flushes", flushes);
+}
+
+/*
+ * A match that runs from one segment into the next makes a sequential scan
+ * resume past where the next one started. Like the recount in count mode,
+ * such a segment drops what it found and is searched again from there.
+ */
+static void mne_search_dedupe(unsigned int query) {
+  unsigned int i, n, num_matches = 0;
+
+  for (i = 0; i < num_cores; i++)
+    num_matches += mne_search_results(i, query)->count;
+
+  mne_search_result **matches = malloc(sizeof(mne_search_result*) * (num_matches + 1));
+  assert(matches != NULL);
+
+  for (i = 0, num_matches = 0; i < num_cores; i++) {
+    mne_arena *results = mne_search_results(i, query);
+    for (n = 0; n < results->count; n++) {
+      mne_search_result *result = mne_arena_get(results, n);
+      if (mne_search_deferred(result))
+        matches[num_matches++] = result;
+    }
+  }
+
+  qsort(matches, num_matches, sizeof(mne_search_result*), mne_search_compare_result);
+
+  mne_search_dedupe_ctx dedupe = {query, matches, num_matches};
+  mne_search_parallel(mne_search_dedupe_task, &dedupe);
+  free(matches);
+}
+
+/* Goes over the segments of the split blobs that fall to the calling thread, in order. */
+static void mne_search_dedupe_task(int thread, void *arg) {
+  const mne_search_dedupe_ctx *dedupe = arg;
+  mne_search_query *query = &search_queries[dedupe->query];
+  mne_arena *results = mne_search_results(thread, dedupe->query), *spans = mne_search_spans(thread, dedupe->query);
+  mne_search_result **matches = dedupe->matches;
+  unsigned int w, i = 0, first, tail = 0;
+
+  for (w = 0; w < search_num_work; w++) {
+    const mne_search_work *work = &search_work[w];
+    unsigned int n = work->blob;
+
+    if (search_segment_bytes == 0 || blob_sizes[n] <= search_segment_bytes || n % num_cores != thread)
+      continue;
+    if (query->candidates >= 0 && !query->mask[n])
+      continue;
+
+    /* A blob's segments come in order, the first at 0. */
+    if (work->start == 0) {
+      unsigned int low = 0, high = dedupe->num_matches;
+      while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (matches[mid]->sha1_offset < n)
+          low = mid + 1;
+        else
+          high = mid;
+      }
+      i = low;
+      tail = 0;
+    }
+
+    for (first = i; i < dedupe->num_matches && matches[i]->sha1_offset == n && matches[i]->offset < work->end; i++);
+
+    if (tail <= work->start) {
+      if (i > first)
+        tail = mne_search_tail(matches[i - 1]);
+      continue;
+    }
+
+    /* Once cancelled nothing is searched again; keep what starts past tail. */
+    if (search_cancel != search_cancel_seen) {
+      for (; first < i; first++) {
+        if (matches[first]->offset < tail)
+          matches[first]->duplicate = 1;
+        else
+          tail = mne_search_tail(matches[first]);
+      }
+      continue;
+    }
+
+    /* The dropped results give their slots of the limit back. */
+    for (; first < i; first++) {
+      matches[first]->duplicate = 1;
+      if (search_limit > 0)
+        __sync_fetch_and_sub(&query->total, 1);
+    }
+
+    if (tail < work->end) {
+      mne_search_work rest = *work;
+      unsigned int count = results->count;
+
+      rest.start = tail;
+      if (search_mode == MNE_MODE_LINES)
+        mne_search_lines(&search_contexts[thread], query, &rest, results, spans);
+      else
+        mne_search_blob(&search_contexts[thread], query, &rest, results, spans);
+
+      if (results->count > count)
+        tail = mne_search_tail(mne_arena_get(results, results->count - 1));
+    }
+  }
+}
+
+/* Where a sequential scan would go on from after result: its match's end, or past its line's newline. */
+static inline unsigned int mne_search_tail(const mne_search_result *result) {
+  return result->offset + result->length + (search_mode == MNE_MODE_LINES);
+}
+
+static int mne_search_compare_result(const void *a, const void *b) {
+  const mne_search_result *x = *(mne_search_result* const*)a, *y = *(mne_search_result* const*)b;
+
+  if (x->sha1_offset != y->sha1_offset)
+    return x->sha1_offset < y->sha1_offset ? -1 : 1;
+  return x->offset < y->offset ? -1 : (x->offset > y->offset ? 1 : 0);
+}
+
+/*
+ * Puts query's results, less duplicates (and only the deferred ones, if
+ * deferred), in search_ordered by path and offset. Returns how many.
+ */
+static unsigned int mne_search_order(unsigned int query, int deferred) {
+  unsigned int r, t, total = 0, longest = 0, stride = num_cores;
+
+  search_order_deferred = deferred;
+  mne_search_parallel(mne_search_sort_task, &query);
+
+  for (r = 0; r < num_cores; r++) {
+    total += search_run_lengths[r];
+    if (search_run_lengths[r] > search_run_lengths[longest])
+      longest = r;
+  }
+
+  if (total > search_ordered_size) {
+    search_ordered_size = total;
+    search_ordered = realloc(search_ordered, sizeof(mne_search_result*) * search_ordered_size);
+    search_ordered_threads = realloc(search_ordered_threads, sizeof(unsigned int) * search_ordered_size);
+    assert(search_ordered != NULL && search_ordered_threads != NULL);
+  }
+
+  /* Share t holds the results from key t up to key t + 1 of every run. */
+  for (r = 0; r < num_cores; r++) {
+    search_bounds[r] = 0;
+    search_bounds[num_cores * stride + r] = search_run_lengths[r];
+  }
+  for (t = 1; t < num_cores; t++) {
+    if (total == 0) {
+      memset(search_bounds + t * stride, 0, sizeof(unsigned int) * num_cores);
+      continue;
+    }
+
+    const mne_search_result *key = search_runs[longest][(unsigned long)search_run_lengths[longest] * t / num_cores];
+    for (r = 0; r < num_cores; r++)
+      search_bounds[t * stride + r] = mne_search_lower_bound(search_runs[r], search_run_lengths[r], key);
+  }
+
+  mne_search_parallel(mne_search_merge_task, NULL);
+  return total;
+}
+
+/* Sorts the calling thread's results for a query, less duplicates, into its run. */
+static void mne_search_sort_task(int thread, void *arg) {
+  mne_arena *results = mne_search_results(thread, *(unsigned int*)arg);
+  unsigned int n, length = 0;
+
+  if (results->count > search_runs_size[thread]) {
+    search_runs_size[thread] = results->count;
+    free(search_runs[thread]);
+    search_runs[thread] = malloc(sizeof(mne_search_result*) * search_runs_size[thread]);
+    assert(search_runs[thread] != NULL);
+  }
+
+  for (n = 0; n < results->count; n++) {
+    mne_search_result *result = mne_arena_get(results, n);
+    if (!result->duplicate && (!search_order_deferred || mne_search_deferred(result)))
+      search_runs[thread][length++] = result;
+  }
+
+  /* A thread with no results never allocated its run. */
+  if (length > 1)
+    qsort(search_runs[thread], length, sizeof(mne_search_result*), mne_search_compare_order);
+  search_run_lengths[thread] = length;
+}
+
+/* Merges the calling thread's share of every run, keeping a heap of the runs by their next result. */
+static void mne_search_merge_task(int thread, void *arg) {
+  unsigned int r, out = 0, size = 0, stride = num_cores;
+  unsigned int *from = search_bounds + thread * stride, *to = search_bounds + (thread + 1) * stride;
+
+  unsigned int *heap = malloc(sizeof(unsigned int) * num_cores), *next = malloc(sizeof(unsigned int) * num_cores);
+  assert(heap != NULL && next != NULL);
+
+  for (r = 0; r < num_cores; r++) {
+    out += from[r];
+    next[r] = from[r];
+  }
+
+  for (r = 0; r < num_cores; r++) {
+    if (next[r] == to[r])
+      continue;
+
+    unsigned int i = size++;
+    while (i > 0 && mne_search_before(search_runs[r][next[r]], search_runs[heap[(i - 1) / 2]][next[heap[(i - 1) / 2]]])) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = r;
+  }
+
+  while (size > 0) {
+    r = heap[0];
+    search_ordered_threads[out] = r;
+    search_ordered[out++] = search_runs[r][next[r]++];
+
+    /* The run drops out when its share is done, else sifts down by its new head. */
+    unsigned int top = next[r] < to[r] ? r : heap[--size], i = 0, child;
+    while ((child = 2 * i + 1) < size) {
+      if (child + 1 < size && mne_search_before(search_runs[heap[child + 1]][next[heap[child + 1]]],
+          search_runs[heap[child]][next[heap[child]]]))
+        child++;
+      if (!mne_search_before(search_runs[heap[child]][next[heap[child]]], search_runs[top][next[top]]))
+        break;
+      heap[i] = heap[child];
+      i = child;
+    }
+    if (size > 0)
+      heap[i] = top;
+  }
+
+  free(heap);
+  free(next);
+}
+
+/* The first of run's length results not before key. */
+static unsigned int mne_search_lower_bound(mne_search_result **run, unsigned int length, const mne_search_result *key) {
+  unsigned int low = 0, high = length;
+
+  while (low < high) {
+    unsigned int middle = low + (high - low) / 2;
+    if (mne_search_before(run[middle], key))
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+/* Whether x comes before y in the output: by path, then offset, then length. */
+static inline int mne_search_before(const mne_search_result *x, const mne_search_result *y) {
+  if (x->sha1_offset != y->sha1_offset)
+    return mne_paths_rank(x->sha1_offset) < mne_paths_rank(y->sha1_offset);
+  if (x->offset != y->offset)
+    return x->offset < y->offset;
+  return x->length < y->length;
+}
+
+static int mne_search_compare_order(const void *a, const void *b) {
+  const mne_search_result *x = *(mne_search_result* const*)a, *y = *(mne_search_result* const*)b;
+  return mne_search_before(x, y) ? -1 : (mne_search_before(y, x) ? 1 : 0);
+}
+
+static int mne_search_compare_size(const void *a, const void *b) {
+  int size_a = blob_sizes[*(const unsigned int*)a], size_b = blob_sizes[*(const unsigned int*)b];
+  return size_a < size_b ? 1 : (size_a > size_b ? -1 : 0);
+}
+
+static void mne_search_index_iter(gpointer key, gpointer value, gpointer user_data) {
+  mne_indices_ctx *ctx = (mne_indices_ctx *)user_data;
+  sha1_index[ctx->offset] = (char*)key;
+  blob_index[ctx->offset] = (char*)value;
+  blob_sizes[ctx->offset] = strlen((char*)value);
+  ctx->offset++;
+}
+
+/* Prints query's results in path order. Returns how many there were. */
+static unsigned long mne_search_print_results(unsigned int query) {
+  unsigned int num_results = mne_search_order(query, 0);
+
+  mne_search_print_ordered(query, num_results);
+  return num_results;
+}
+
+/* Writes out the first num_results of search_ordered, rendered by the threads in rounds. */
+static void mne_search_print_ordered(unsigned int query, unsigned int num_results) {
+  unsigned int i, round = SEARCH_RENDER_RESULTS * num_cores;
+
+  for (search_render_first = 0; search_render_first < num_results; search_render_first += round) {
+    search_render_last = num_results - search_render_first > round ? search_render_first + round : num_results;
+
+    /* A handful of results isn't worth waking the threads for. */
+    if (search_render_last - search_render_first < SEARCH_RENDER_RESULTS) {
+      mne_search_position position = {UINT_MAX, 0, 0, 0};
+      for (i = search_render_first; i < search_render_last; i++)
+        mne_search_render(&search_outputs[0], search_ordered[i], search_ordered_threads[i], query, &position);
+    } else {
+      mne_search_parallel(mne_search_render_task, &query);
+    }
+    mne_search_flush(num_cores, search_render_last - search_render_first);
+  }
+}
+
+/* Renders thread's share of the round's results. */
+static void mne_search_render_task(int thread, void *arg) {
+  unsigned int query = *(unsigned int*)arg, count = search_render_last - search_render_first;
+  unsigned int i, first = search_render_first + (unsigned long)count * thread / num_cores;
+  unsigned int last = search_render_first + (unsigned long)count * (thread + 1) / num_cores;
+  mne_search_position position = {UINT_MAX, 0, 0, 0};
+
+  for (i = first; i < last; i++)
+    mne_search_render(&search_outputs[thread], search_ordered[i], search_ordered_threads[i], query, &position);
+}
+
+/* Writes out what has been rendered, noting when the first results went out. */
+static void mne_search_flush(unsigned int num_outputs, unsigned long rendered) {
+  mne_output_write(search_outputs, num_outputs);
+  if (search_printed == 0 && rendered > 0)
+    gettimeofday(&search_first, NULL);
+  search_printed += rendered;
+}
+
+/* Renders one of query's results, found by thread. Records count lines on from position. */
+static void mne_search_render(mne_output *out, const mne_search_result *result, int thread, unsigned int query,
+    mne_search_position *position) {
+  const mne_arena *spans = mne_search_spans(thread, query);
+  const char *path = mne_paths_get(result->sha1_offset);
+  const char *blob = blob_index[result->sha1_offset];
+  int pad_left = 0, pad_right = 0;
+
+  if (search_format != MNE_FORMAT_TEXT) {
+    mne_search_encode(out, result, thread, query, position);
+    return;
+  }
+
+  while (1) {
+    if (result->offset - pad_left <= 0)
+      break;    
+    pad_left++;
+    if (pad_left == RESULT_PAD)
+      break;
+    if (blob[result->offset - pad_left] == '\n') {
+      pad_left--;
+      break;
+    }
+  }
+
+  while (1) {
+    if (result->offset + result->length + pad_right >= blob_sizes[result->sha1_offset])
+      break;
+    if (blob[result->offset + result->length + pad_right] == '\n') {
+      break;
+    }
+    pad_right++;
+    if (pad_right == RESULT_PAD)
+      break;
+  }
+
+  const char **sha1_refs = g_hash_table_lookup(refs, (gpointer)sha1_index[result->sha1_offset]);
+
+  int r;
+  for(r = 0 ; r < total_refs; r++) {
+    if (sha1_refs[r] == NULL)
+      break;
+    mne_output_color(out, "36");
+    mne_output_string(out, sha1_refs[r]);
+    mne_output_color(out, "0");
+    mne_output_bytes(out, " ", 1);
+  }
+
+  mne_output_bytes(out, "\n", 1);
+  mne_output_color(out, "1");
+  mne_output_string(out, path);
+  mne_output_bytes(out, ":", 1);
+  mne_output_number(out, result->offset);
+  mne_output_color(out, "0");
+  mne_output_bytes(out, "\n", 1);
+
+  if (search_mode == MNE_MODE_LINES) {
+    mne_search_render_line(out, result, spans);
+    return;
+  }
+
+  mne_output_bytes(out, blob + result->offset - pad_left, pad_left);
+  mne_output_color(out, "1;32");
+  mne_output_bytes(out, blob + result->offset, result->length);
+  mne_output_color(out, "0");
+  mne_output_bytes(out, blob + result->offset + result->length, pad_right);
+  mne_output_bytes(out, "...\n", 4);
+
+  unsigned int c;
+  for (c = 0; c < result->num_spans; c++) {
+    const mne_search_span *span = mne_arena_get(spans, result->span + c);
+    mne_output_bytes(out, "  ", 2);
+    mne_output_number(out, c + 1);
+    if (span->offset == SEARCH_SPAN_UNSET) {
+      mne_output_bytes(out, ": unset\n", 8);
+      continue;
+    }
+    mne_output_bytes(out, ": ", 2);
+    mne_output_color(out, "1;32");
+    mne_output_bytes(out, blob + span->offset, span->length);
+    mne_output_color(out, "0");
+    mne_output_bytes(out, "\n", 1);
+  }
+  mne_output_bytes(out, "\n", 1);
+}
+
+/* Lines mode: the whole line, with each of its matches highlighted. */
+static void mne_search_render_line(mne_output *out, const mne_search_result *result, const mne_arena *spans) {
+  const char *blob = blob_index[result->sha1_offset];
+  unsigned int n, offset = result->offset, end = result->offset + result->length;
+
+  for (n = 0; n < result->num_spans; n++) {
+    const mne_search_span *span = mne_arena_get(spans, result->span + n);
+    mne_output_bytes(out, blob + offset, span->offset - offset);
+    mne_output_color(out, "1;32");
+    mne_output_bytes(out, blob + span->offset, span->length);
+    mne_output_color(out, "0");
+    offset = span->offset + span->length;
+  }
+
+  /* A match can take its line's newline along. */
+  mne_output_bytes(out, blob + offset, offset < end ? end - offset : 0);
+  mne_output_bytes(out, "\n\n", 2);
+}
+
+/* A result as a record: blob, position, match, captures or line matches, and context. */
+static void mne_search_encode(mne_output *out, const mne_search_result *result, int thread, unsigned int query,
+    mne_search_position *position) {
+  const mne_arena *spans = mne_search_spans(thread, query);
+  const char *blob = blob_index[result->sha1_offset];
+  unsigned int c, size = blob_sizes[result->sha1_offset];
+  unsigned int begin = result->offset, end = result->offset + result->length;
+  int lines = search_mode == MNE_MODE_LINES;
+
+  mne_search_locate(position, result->sha1_offset, result->offset);
+
+  mne_output_begin_map(out, lines ? 10 : 11);
+  mne_output_key(out, "type");
+  mne_output_value_string(out, lines ? "line" : "match", strlen(lines ? "line" : "match"));
+  mne_search_encode_blob(out, result->sha1_offset);
+  mne_output_key(out, "line");
+  mne_output_value_number(out, position->line);
+  mne_output_key(out, "column");
+  mne_output_value_number(out, result->offset - position->line_start + 1);
+  mne_output_key(out, "offset");
+  mne_output_value_number(out, result->offset);
+  mne_output_key(out, "length");
+  mne_output_value_number(out, result->length);
+  mne_output_key(out, "text");
+  mne_output_value_bytes(out, blob + result->offset, result->length);
+
+  mne_output_key(out, "spans");
+  mne_output_begin_array(out, result->num_spans);
+  for (c = 0; c < result->num_spans; c++) {
+    const mne_search_span *span = mne_arena_get(spans, result->span + c);
+    if (span->offset == SEARCH_SPAN_UNSET)
+      mne_output_value_null(out);
+    else
+      mne_search_encode_span(out, blob, span->offset, span->length);
+  }
+  mne_output_end(out);
+
+  if (!lines) {
+    while (begin > position->line_start && result->offset - begin < SEARCH_CONTEXT_BYTES)
+      begin--;
+    while (end < size && blob[end] != '\n' && end - result->offset - result->length < SEARCH_CONTEXT_BYTES)
+      end++;
+
+    mne_output_key(out, "context");
+    mne_output_begin_map(out, 2);
+    mne_output_key(out, "before");
+    mne_output_value_bytes(out, blob + begin, result->offset - begin);
+    mne_output_key(out, "after");
+    mne_output_value_bytes(out, blob + result->offset + result->length, end - result->offset - result->length);
+    mne_output_end(out);
+  }
+
+  mne_output_end(out);
+  mne_output_end_record(out);
+}
+
+/* The blob's oid, paths and refs, as three fields of the record being written. */
+static void mne_search_encode_blob(mne_output *out, unsigned int blob) {
+  const char **sha1_refs = g_hash_table_lookup(refs, (gpointer)sha1_index[blob]);
+  const char *path = mne_paths_get(blob), **others = g_hash_table_lookup(aliases, (gpointer)sha1_index[blob]);
+  int r, num_refs = 0, num_others = 0;
+
+  while (num_refs < total_refs && sha1_refs[num_refs] != NULL)
+    num_refs++;
+  while (others != NULL && others[num_others] != NULL)
+    num_others++;
+
+  mne_output_key(out, "blob");
+  mne_output_value_string(out, sha1_index[blob], strlen(sha1_index[blob]));
+
+  /* The path the blob was first found at, then any others it is also at. */
+  mne_output_key(out, "paths");
+  mne_output_begin_array(out, num_others + 1);
+  mne_output_value_string(out, path, strlen(path));
+  for (r = 0; r < num_others; r++)
+    mne_output_value_string(out, others[r], strlen(others[r]));
+  mne_output_end(out);
+
+  mne_output_key(out, "refs");
+  mne_output_begin_array(out, num_refs);
+  for (r = 0; r < num_refs; r++)
+    mne_output_value_string(out, sha1_refs[r], strlen(sha1_refs[r]));
+  mne_output_end(out);
+}
+
+static void mne_search_encode_span(mne_output *out, const char *blob, unsigned int offset, unsigned int length) {
+  mne_output_begin_map(out, 3);
+  mne_output_key(out, "offset");
+  mne_output_value_number(out, offset);
+  mne_output_key(out, "length");
+  mne_output_value_number(out, length);
+  mne_output_key(out, "text");
+  mne_output_value_bytes(out, blob + offset, length);
+  mne_output_end(out);
+}
+
+/* Ends a query's records with one that says how many there were and whether that's all of them. */
+static void mne_search_encode_summary(const mne_search_query *query, unsigned long total) {
+  mne_output *out = &search_outputs[0];
+  int num_blobs = g_hash_table_size(blobs);
+
+  mne_output_begin_map(out, 6);
+  mne_output_key(out, "type");
+  mne_output_value_string(out, "summary", 7);
+  mne_output_key(out, "query");
+  mne_output_value_string(out, query->term, strlen(query->term));
+  mne_output_key(out, "results");
+  mne_output_value_number(out, total);
+  mne_output_key(out, "searched");
+  mne_output_value_number(out, query->candidates < 0 ? num_blobs : query->candidates);
+  mne_output_key(out, "blobs");
+  mne_output_value_number(out, num_blobs);
+  mne_output_key(out, "complete");
+  mne_output_value_bool(out, mne_search_complete(query));
+  mne_output_end(out);
+  mne_output_end_record(out);
+  mne_output_write(out, 1);
+}
+
+/* Moves position to offset in blob, counting newlines from where it last was. */
+static void mne_search_locate(mne_search_position *position, unsigned int blob, unsigned int offset) {
+  const char *data = blob_index[blob], *newline;
+
+  if (position->blob != blob || offset < position->offset) {
+    position->blob = blob;
+    position->offset = 0;
+    position->line = 1;
+    position->line_start = 0;
+  }
+
+  while ((newline = memchr(data + position->offset, '\n', offset - position->offset)) != NULL) {
+    position->line++;
+    position->offset = position->line_start = newline - data + 1;
+  }
+  position->offset = offset;
+}
+
+static void *mne_search(void *_ctx) {
+  mne_search_ctx *ctx = (mne_search_ctx *)_ctx;
+  unsigned int epoch = 0;
+
+  /* Without a stack of our own PCRE falls back to 32KB of machine stack. */
+  if (config.jit_stack_bytes > 0) {
+    search_jit_stack = pcre_jit_stack_alloc(config.jit_stack_bytes < 32768 ? config.jit_stack_bytes : 32768,
+      config.jit_stack_bytes);
+    assert(search_jit_stack != NULL);
+  }
+
+  while (1) {
+    epoch = mne_epoch_wait(&search_start, epoch);
+
+    if (exiting)
+      break;
+
+    if (search_task != NULL)
+      search_task(ctx->initial, search_task_arg);
+    else
+      mne_search_scan(ctx);
+
+    /* The last thread out completes the barrier, and wakes the main thread if it is streaming. */
+    if (__sync_sub_and_fetch(&search_remaining, 1) == 0) {
+      mne_epoch_advance(&search_done);
+      mne_epoch_advance(&search_output);
+    }
+  }
+
+  if (search_jit_stack != NULL)
+    pcre_jit_stack_free(search_jit_stack);
+  pthread_exit(NULL);
+}
+
+static void mne_search_scan(mne_search_ctx *ctx) {
+  unsigned int chunk, w, q, active = search_num_queries;
+
+  ctx->num_errors = 0;
+
+  while (active > 0 && search_cancel == search_cancel_seen &&
+      (chunk = __sync_fetch_and_add(&search_cursor, 1)) < search_num_chunks) {
+    /* Every query runs over the chunk while it is still in cache. */
+    for (q = 0, active = 0; q < search_num_queries; q++) {
+      mne_search_query *query = &search_queries[q];
+      mne_arena *results = mne_search_results(ctx->initial, q), *spans = mne_search_spans(ctx->initial, q);
+
+      if (mne_search_limit_reached(query))
+        continue;
+
+      for (w = search_chunks[chunk].first; w < search_chunks[chunk].last; w++) {
+        if (query->candidates >= 0 && !query->mask[search_work[w].blob])
+          continue;
+
+        if (search_mode == MNE_MODE_MATCHES)
+          mne_search_blob(ctx, query, &search_work[w], results, spans);
+        else if (search_mode == MNE_MODE_LINES)
+          mne_search_lines(ctx, query, &search_work[w], results, spans);
+        else if (search_mode == MNE_MODE_COUNT)
+          mne_search_count(ctx, query, &search_work[w], &search_tallies[q * search_num_work + w]);
+        else
+          mne_search_first(ctx, query, &search_work[w]);
+
+        if (search_streaming && results->count > ctx->published)
+          mne_search_publish(ctx, results);
+
+        if (unlikely(mne_search_limit_reached(query)))
+          break;
+        if (unlikely(search_cancel != search_cancel_seen)) {
+          __sync_fetch_and_add(&search_abandoned, 1);
+          return;
+        }
+      }
+
+      if (!mne_search_limit_reached(query))
+        active++;
+    }
+  }
+}
+
+/* A thread's results for one query of the batch. */
+static inline mne_arena *mne_search_results(int thread, unsigned int query) {
+  return &search_results[thread][query];
+}
+
+/* A thread's spans for one query of the batch. */
+static inline mne_arena *mne_search_spans(int thread, unsigned int query) {
+  return &search_spans[thread][query];
+}
+
+/* Whether the running mode records results, rather than counting blobs. */
+static inline int mne_search_recording() {
+  return search_mode == MNE_MODE_MATCHES || search_mode == MNE_MODE_LINES;
+}
+
+/*
+ * Runs query over blob n from offset like pcre_exec on the first limit bytes,
+ * retrying on the whole blob if the cut may matter. PCRE only fills in captures.
+ */
+static int mne_search_exec(mne_search_ctx *ctx, mne_search_query *query, int n, int limit, int offset,
+    int *matches, int size) {
+  int rc, start, end, length = limit;
+
+  if (query->compiled->prefixes != NULL) {
+    offset = mne_multi_find(query->compiled->prefixes, blob_index[n], limit, offset);
+    if (offset < 0)
+      return PCRE_ERROR_NOMATCH;
+  }
+
+  if (query->compiled->fixed != NULL) {
+    if (!mne_fixed_exec(query->compiled->fixed, blob_index[n], length, offset, &start, &end))
+      return PCRE_ERROR_NOMATCH;
+  } else {
+    rc = -1;
+
+    if (query->dfa_caches != NULL && !query->dfa_gave_up) {
+      mne_dfa_cache *cache = mne_search_dfa_cache(ctx, query);
+
+      rc = mne_dfa_exec(cache, blob_index[n], length, offset, &start, &end);
+      if (unlikely(rc > 0 && mne_search_cut(query, n, limit, end))) {
+        length = blob_sizes[n];
+        rc = mne_dfa_exec(cache, blob_index[n], length, offset, &start, &end);
+      }
+
+      if (unlikely(rc == MNE_DFA_GAVE_UP))
+        query->dfa_gave_up = 1;
+      if (rc == 0)
+        return PCRE_ERROR_NOMATCH;
+    }
+
+    /* No DFA, it gave up, or it couldn't place the match's start: PCRE searches instead. */
+    if (rc < 0) {
+      rc = pcre_exec(query->re, query->re_extra, blob_index[n], limit, offset, 0, matches, size);
+
+      if (unlikely(rc >= 0 && mne_search_cut(query, n, limit, matches[1])))
+        rc = pcre_exec(query->re, query->re_extra, blob_index[n], blob_sizes[n], offset, 0, matches, size);
+
+      return rc;
+    }
+  }
+
+  if (size > 3 && query->compiled->captures > 0) {
+    rc = pcre_exec(query->re, query->re_extra, blob_index[n], length, start, PCRE_ANCHORED, matches, size);
+
+    /* Not "no match", or the caller would end the blob's scan without a word. */
+    if (unlikely(rc == PCRE_ERROR_NOMATCH))
+      rc = SEARCH_ERROR_MISMATCH;
+    return rc;
+  }
+
+  matches[0] = start;
+  matches[1] = end;
+  return 1;
+}
+
+/*
+ * Whether the cut at limit may have changed a match ending at end. A
+ * lookahead reaching past limit from further back isn't caught.
+ */
+static inline int mne_search_cut(const mne_search_query *query, int n, int limit, int end) {
+  if (limit == blob_sizes[n])
+    return 0;
+  return end == limit || (query->compiled->looks_ahead && limit - end <= SEARCH_EDGE_BYTES);
+}
+
+/* The calling thread's DFA cache for query, built on first use. */
+static mne_dfa_cache *mne_search_dfa_cache(mne_search_ctx *ctx, const mne_search_query *query) {
+  mne_dfa_cache **cache = &query->dfa_caches[ctx->initial];
+
+  if (unlikely(*cache == NULL))
+    *cache = mne_dfa_cache_new(query->compiled->dfa, config.dfa_bytes);
+  return *cache;
+}
+
+/* Appends the matches starting in work's range to results, with their captures in spans. */
+static void mne_search_blob(mne_search_ctx *ctx, mne_search_query *query, const mne_search_work *work,
+    mne_arena *results, mne_arena *spans) {
+  int rc, i, matches[MAX_CAPTURES], offset, n = work->blob, limit;
+
+  int size = query->flags & PCRE_NO_AUTO_CAPTURE ? 3 : MAX_CAPTURES;
+
+  if (!mne_search_range(query, work, &limit))
+    return;
+
+  offset = work->start;
+
+  while (offset <= limit) {
+    rc = mne_search_exec(ctx, query, n, limit, offset, matches, size);
+
+    if (rc < 0) {
+      if (unlikely(rc != PCRE_ERROR_NOMATCH))
+        mne_search_error_add(ctx, query->id, n, rc);
+      break;
+    }
+
+    /* Matches starting past our end belong to the next segment. */
+    if (matches[0] >= work->end)
+      break;
+
+    /* Not all captures fit; say so once per query. */
+    if (unlikely(rc == 0)) {
+      if (size > 3 && __sync_bool_compare_and_swap(&query->truncated, 0, 1))
+        mne_printf_async("Too many captured substrings (first in blob %s), showing the first %d.\n", sha1_index[n],
+          size / 3 - 1);
+      rc = size / 3;
+    }
+
+    if (search_limit > 0 && __sync_fetch_and_add(&query->total, 1) >= search_limit)
+      break;
+
+    mne_search_result *result = mne_arena_push(results);
+    result->sha1_offset = n;
+    result->offset = matches[0];
+    result->length = matches[1] - matches[0];
+    result->duplicate = 0;
+    result->span = spans->count;
+    result->num_spans = rc - 1;
+
+    for (i = 1; i < rc; i++) {
+      mne_search_span *span = mne_arena_push(spans);
+      span->offset = matches[2*i] >= 0 ? matches[2*i] : SEARCH_SPAN_UNSET;
+      span->length = matches[2*i+1] - matches[2*i];
+    }
+
+    offset = matches[1] > matches[0] ? matches[1] : matches[1] + 1;
+
+    if (unlikely(search_cancel != search_cancel_seen))
+      break;
+  }
+}
+
+/* Lines mode: one result per line with a match starting in work's range, its matches in spans. */
+static void mne_search_lines(mne_search_ctx *ctx, mne_search_query *query, const mne_search_work *work,
+    mne_arena *results, mne_arena *spans) {
+  int rc, matches[3], next, line, line_end, n = work->blob, limit, size = blob_sizes[n];
+  const char *blob = blob_index[n], *newline;
+
+  if (!mne_search_range(query, work, &limit))
+    return;
+
+  /* Segments start at a line, so work's range holds whole lines. */
+  rc = mne_search_exec(ctx, query, n, limit, work->start, matches, 3);
+
+  /* The last segment also has the empty match at the very end, as on a last line with no newline. */
+  while (rc >= 0 && (matches[0] < work->end || (matches[0] == size && work->end == size))) {
+    for (line = matches[0]; line > work->start && blob[line - 1] != '\n'; line--);
+
+    /* A final newline ends the last line; an empty match after it isn't on one. */
+    if (line == size)
+      break;
+
+    if (search_limit > 0 && __sync_fetch_and_add(&query->total, 1) >= search_limit)
+      break;
+
+    mne_search_result *result = mne_arena_push(results);
+    result->sha1_offset = n;
+    result->offset = line;
+    result->duplicate = 0;
+    result->span = spans->count;
+    result->num_spans = 0;
+
+    line_end = -1;
+    do {
+      mne_search_span *span = mne_arena_push(spans);
+      span->offset = matches[0];
+      span->length = matches[1] - matches[0];
+      result->num_spans++;
+
+      /* The line ends at the first newline not inside a match. */
+      int from = matches[1] > matches[0] ? matches[1] - 1 : matches[0];
+      if (from >= line_end || line_end == size) {
+        newline = memchr(blob + from, '\n', size - from);
+        line_end = newline != NULL ? newline - blob : size;
+      }
+
+      next = matches[1] > matches[0] ? matches[1] : matches[1] + 1;
+      rc = next <= limit ? mne_search_exec(ctx, query, n, limit, next, matches, 3) : PCRE_ERROR_NOMATCH;
+    } while (rc >= 0 && matches[0] <= line_end && search_cancel == search_cancel_seen);
+
+    result->length = line_end - line;
+
+    if (unlikely(search_cancel != search_cancel_seen))
+      return;
+  }
+
+  if (unlikely(rc < 0 && rc != PCRE_ERROR_NOMATCH))
+    mne_search_error_add(ctx, query->id, n, rc);
+}
+
+/*
+ * Sets limit to how far a search of work may look and returns 0 when the
+ * range lacks the query's required literal, so it can't match.
+ */
+static inline int mne_search_range(const mne_search_query *query, const mne_search_work *work, int *limit) {
+  int n = work->blob, size = blob_sizes[n];
+
+  *limit = size;
+  if (work->end < size && work->end + config.max_match_bytes < size)
+    *limit = work->end + config.max_match_bytes;
+
+  return query->literal == NULL || mne_literal_find(blob_index[n] + work->start, *limit - work->start,
+    query->literal->literal, query->literal->length, query->literal->caseless) != NULL;
+}
+
+/* Count mode: counts the matches starting in work's range into tally. */
+static void mne_search_count(mne_search_ctx *ctx, mne_search_query *query, const mne_search_work *work,
+    mne_search_tally *tally) {
+  int rc, matches[3], offset = work->start, n = work->blob, limit;
+  unsigned int count = 0;
+
+  tally->count = 0;
+  tally->tail = work->start;
+  if (!mne_search_range(query, work, &limit))
+    return;
+
+  while (offset <= limit) {
+    rc = mne_search_exec(ctx, query, n, limit, offset, matches, 3);
+
+    if (rc < 0) {
+      if (unlikely(rc != PCRE_ERROR_NOMATCH))
+        mne_search_error_add(ctx, query->id, n, rc);
+      break;
+    }
+
+    if (matches[0] >= work->end)
+      break;
+
+    if (search_limit > 0 && __sync_fetch_and_add(&query->total, 1) >= search_limit)
+      break;
+
+    count++;
+    tally->tail = matches[1];
+    offset = matches[1] > matches[0] ? matches[1] : matches[1] + 1;
+
+    if (unlikely(search_cancel != search_cancel_seen))
+      break;
+  }
+
+  tally->count = count;
+}
+
+/* Files mode: one hit anywhere in a blob is enough, so stop at the first. */
+static void mne_search_first(mne_search_ctx *ctx, mne_search_query *query, const mne_search_work *work) {
+  int rc, matches[3], n = work->blob, limit;
+
+  /* Another segment of this blob already matched. */
+  if (query->counts[n] != 0 || !mne_search_range(query, work, &limit))
+    return;
+
+  rc = mne_search_exec(ctx, query, n, limit, work->start, matches, 3);
+
+  if (rc < 0) {
+    if (unlikely(rc != PCRE_ERROR_NOMATCH))
+      mne_search_error_add(ctx, query->id, n, rc);
+    return;
+  }
+
+  if (!__sync_bool_compare_and_swap(&query->counts[n], 0, 1))
+    return;
+
+  if (search_limit > 0 && __sync_fetch_and_add(&query->total, 1) >= search_limit)
+    query->counts[n] = 0;
+}
+
+/*
+ * Count mode: recounts segments that a match from the previous one ran
+ * into, as a sequential scan would, then totals each blob.
+ */
+static void mne_search_total_counts(mne_search_query *query) {
+  mne_search_tally *tallies = search_tallies + query->id * search_num_work;
+  unsigned int w;
+
+  /* On the search threads, so the recounts have their JIT stacks as the first counts did. */
+  mne_search_parallel(mne_search_recount_task, query);
+
+  for (w = 0; w < search_num_work; w++)
+    query->counts[search_work[w].blob] += tallies[w].count;
+}
+
+/* Count mode: recounts the segments of the split blobs that fall to the calling thread, in order. */
+static void mne_search_recount_task(int thread, void *arg) {
+  mne_search_query *query = arg;
+  mne_search_tally *tallies = search_tallies + query->id * search_num_work;
+  unsigned int w;
+
+  for (w = 1; w < search_num_work; w++) {
+    mne_search_work *work = &search_work[w];
+
+    if (work[-1].blob != work->blob || work->blob % num_cores != thread)
+      continue;
+
+    if (tallies[w - 1].tail > work->start && search_cancel == search_cancel_seen) {
+      /* The matches counted before give their slots of the limit back. */
+      if (search_limit > 0)
+        __sync_fetch_and_sub(&query->total, tallies[w].count);
+
+      if (tallies[w - 1].tail >= work->end) {
+        tallies[w].count = 0;
+        tallies[w].tail = tallies[w - 1].tail;
+      } else {
+        mne_search_work rest = *work;
+        rest.start = tallies[w - 1].tail;
+        mne_search_count(&search_contexts[thread], query, &rest, &tallies[w]);
+      }
+    }
+  }
+}
+
+/* Count and files modes: one line per matching blob, in path order. Returns the total. */
+static unsigned long mne_search_print_counts(const mne_search_query *query) {
+  unsigned int r, n, num_blobs = g_hash_table_size(blobs);
+  mne_output *out = &search_outputs[0];
+  unsigned long total = 0;
+
+  for (r = 0; r < num_blobs; r++) {
+    n = mne_paths_blob(r);
+    if (query->counts[n] == 0)
+      continue;
+    total += query->counts[n];
+
+    if (search_format != MNE_FORMAT_TEXT) {
+      const char *type = search_mode == MNE_MODE_COUNT ? "count" : "file";
+      mne_output_begin_map(out, search_mode == MNE_MODE_COUNT ? 5 : 4);
+      mne_output_key(out, "type");
+      mne_output_value_string(out, type, strlen(type));
+      mne_search_encode_blob(out, n);
+      if (search_mode == MNE_MODE_COUNT) {
+        mne_output_key(out, "count");
+        mne_output_value_number(out, query->counts[n]);
+      }
+      mne_output_end(out);
+      mne_output_end_record(out);
+    } else {
+      mne_output_color(out, "1");
+      mne_output_string(out, mne_paths_get(n));
+      mne_output_color(out, "0");
+      if (search_mode == MNE_MODE_COUNT) {
+        mne_output_bytes(out, ": ", 2);
+        mne_output_number(out, query->counts[n]);
+      }
+      mne_output_bytes(out, "\n", 1);
+    }
+
+    if (out->used >= MNE_OUTPUT_FLUSH_BYTES)
+      mne_output_write(out, 1);
+  }
+
+  if (total > 0 && search_format == MNE_FORMAT_TEXT)
+    mne_output_bytes(out, "\n", 1);
+  mne_output_write(out, 1);
+  return total;
+}
+
+/* Whether the query's matches, across all threads, have used up its limit. */
+static inline int mne_search_limit_reached(const mne_search_query *query) {
+  return search_limit > 0 && query->total >= search_limit;
+}
+
+/* Notes that query gave up on blob early: PCRE hit a limit or rejected the subject. */
+static void mne_search_error_add(mne_search_ctx *ctx, unsigned int query, unsigned int blob, int rc) {
+  if (ctx->num_errors == ctx->errors_size) {
+    ctx->errors_size = ctx->errors_size > 0 ? ctx->errors_size * 2 : 16;
+    ctx->errors = realloc(ctx->errors, sizeof(mne_search_error) * ctx->errors_size);
+    assert(ctx->errors != NULL);
+  }
+
+  ctx->errors[ctx->num_errors].query = query;
+  ctx->errors[ctx->num_errors].blob = blob;
+  ctx->errors[ctx->num_errors].rc = rc;
+  ctx->num_errors++;
+}
+
+/* Lists the blobs whose scan for query was cut short, once each. */
+static void mne_search_print_errors(unsigned int query) {
+  unsigned int i, n, num_errors = 0;
+
+  for (i = 0; i < num_cores; i++)
+    num_errors += search_contexts[i].num_errors;
+
+  if (num_errors == 0)
+    return;
+
+  mne_search_error *errors = malloc(sizeof(mne_search_error) * num_errors);
+  assert(errors != NULL);
+  for (i = 0, num_errors = 0; i < num_cores; i++) {
+    for (n = 0; n < search_contexts[i].num_errors; n++) {
+      if (search_contexts[i].errors[n].query == query)
+        errors[num_errors++] = search_contexts[i].errors[n];
+    }
+  }
+
+  if (num_errors == 0) {
+    free(errors);
+    return;
+  }
+
+  qsort(errors, num_errors, sizeof(mne_search_error), mne_search_compare_error);
+
+  for (i = 0, n = 0; i < num_errors; i++)
+    n += i == 0 || errors[i].blob != errors[i - 1].blob;
+  printf("Gave up on part of %u blobs, results may be incomplete:\n", n);
+
+  for (i = 0, n = 0; i < num_errors; i++) {
+    if (i > 0 && errors[i].blob == errors[i - 1].blob)
+      continue;
+
+    if (n++ == SEARCH_MAX_ERRORS_SHOWN) {
+      printf("  ...\n");
+      break;
+    }
+
+    const char *reason;
+    switch (errors[i].rc) {
+      case PCRE_ERROR_MATCHLIMIT: reason = "match limit (-l)"; break;
+      case PCRE_ERROR_RECURSIONLIMIT: reason = "recursion limit (-r)"; break;
+      case PCRE_ERROR_JIT_STACKLIMIT: reason = "JIT stack limit (-j)"; break;
+      case SEARCH_ERROR_MISMATCH: reason = "PCRE didn't confirm a match for its captures"; break;
+      default: reason = "PCRE error"; break;
+    }
+    printf("  %s: %s (%d)\n", mne_paths_get(errors[i].blob), reason, errors[i].rc);
+  }
+
+  free(errors);
+}
+
+static int mne_search_compare_error(const void *a, const void *b) {
+  unsigned int x = ((const mne_search_error*)a)->blob, y = ((const mne_search_error*)b)->blob;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Called by pcre_exec in the searching thread: each thread has its own stack. */
+static pcre_jit_stack *mne_search_jit_stack(void *data) {
+  return search_jit_stack;
+}
+
+/* Wakes every search thread for a new query (or task) and waits for them to finish. */
+static void mne_search_dispatch(const struct timespec *deadline) {
+  unsigned int done = search_done.value;
+  search_remaining = num_cores;
+  mne_epoch_advance(&search_start);
+
+  /* Past the deadline the workers still have to notice and finish their match. */
+  if (search_streaming && search_task == NULL)
+    mne_search_stream(done, deadline);
+  else if (deadline != NULL && !mne_epoch_wait_until(&search_done, done, deadline))
+    mne_search_cancel(SEARCH_CANCEL_DEADLINE);
+  mne_epoch_wait(&search_done, done);
+}
+
+/* Streaming: prints results from the workers' rings until every worker is done. */
+static void mne_search_stream(unsigned int done, const struct timespec *deadline) {
+  while (search_done.value == done) {
+    unsigned int seen = search_output.value;
+
+    if (mne_search_drain(deadline) || search_done.value != done)
+      continue;
+
+    if (deadline == NULL || search_cancel != search_cancel_seen) {
+      mne_epoch_wait(&search_output, seen);
+    } else if (!mne_epoch_wait_until(&search_output, seen, deadline)) {
+      mne_search_cancel(SEARCH_CANCEL_DEADLINE);
+    }
+  }
+}
+
+/* Streaming: queues the calling worker's new results; if the ring is full, the next batch grows. */
+static void mne_search_publish(mne_search_ctx *ctx, const mne_arena *results) {
+  mne_ring_batch batch = {0, ctx->published, results->count - ctx->published};
+
+  if (mne_ring_push(ctx->ring, &batch)) {
+    ctx->published = results->count;
+    mne_epoch_advance(&search_output);
+  }
+}
+
+/* Streaming: prints what the workers have queued. Returns whether there was anything. */
+static int mne_search_drain(const struct timespec *deadline) {
+  mne_ring_batch batch;
+  mne_search_position position = {UINT_MAX, 0, 0, 0};
+  struct timespec now;
+  unsigned int i, n;
+  unsigned long rendered = 0;
+  int drained = 0;
+
+  for (i = 0; i < num_cores; i++) {
+    while (mne_ring_pop(search_contexts[i].ring, &batch)) {
+      const mne_arena *results = mne_search_results(i, batch.stream);
+      for (n = batch.first; n < batch.first + batch.count; n++) {
+        const mne_search_result *result = mne_arena_get(results, n);
+        if (mne_search_deferred(result))
+          continue;
+        mne_search_render(&search_outputs[0], result, i, batch.stream, &position);
+        if (search_outputs[0].used >= MNE_OUTPUT_FLUSH_BYTES) {
+          mne_search_flush(1, rendered + 1);
+          rendered = 0;
+        } else {
+          rendered++;
+        }
+
+        if (deadline != NULL && search_cancel == search_cancel_seen && n % 64 == 0) {
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          if (now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec))
+            mne_search_cancel(SEARCH_CANCEL_DEADLINE);
+        }
+      }
+      drained = 1;
+    }
+  }
+
+  if (rendered > 0)
+    mne_search_flush(1, rendered);
+  return drained;
+}
+
+/* Streaming: prints what the rings had no room for, then the deferred results. Returns the total. */
+static unsigned long mne_search_print_rest(unsigned int query) {
+  mne_search_position position = {UINT_MAX, 0, 0, 0};
+  unsigned int i, n;
+  unsigned long rendered = 0;
+
+  mne_search_drain(NULL);
+
+  for (i = 0; i < num_cores; i++) {
+    const mne_arena *results = mne_search_results(i, query);
+    for (n = search_contexts[i].published; n < results->count; n++) {
+      const mne_search_result *result = mne_arena_get(results, n);
+      if (!mne_search_deferred(result)) {
+        mne_search_render(&search_outputs[0], result, i, query, &position);
+        rendered++;
+      }
+    }
+  }
+  mne_search_flush(1, rendered);
+
+  mne_search_print_ordered(query, mne_search_order(query, 1));
+
+  return search_printed;
+}
+
+/*
+ * Streaming: results in split blobs wait for the end, when mne_search_dedupe
+ * has redone the segments a match from the previous one ran into.
+ */
+static inline int mne_search_deferred(const mne_search_result *result) {
+  return search_segment_bytes > 0 && blob_sizes[result->sha1_offset] > search_segment_bytes;
+}
+
+/* Times empty dispatch round trips: the fixed cost every query pays. */
+static void mne_search_bench(int iterations) {
+  struct timespec begin, end;
+  int i;
+
+  if (iterations <= 0)
+    iterations = 10000;
+
+  double *samples = malloc(sizeof(double) * iterations);
+  assert(samples != NULL);
+
+  for (i = 0; i < iterations; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    mne_search_parallel(mne_search_bench_task, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    samples[i] = (end.tv_sec - begin.tv_sec) * 1000000.0 + (end.tv_nsec - begin.tv_nsec) / 1000.0;
+  }
+
+  qsort(samples, iterations, sizeof(double), mne_search_compare_double);
+
+  double total = 0;
+  for (i = 0; i < iterations; i++)
+    total += samples[i];
+
+  printf("Dispatch: %d round trips on %d threads, mean %.1fus, min %.1fus, p50 %.1fus, p99 %.1fus, max %.1fus.\n",
+    iterations, num_cores, total / iterations, samples[0], samples[iterations / 2], samples[iterations * 99 / 100],
+    samples[iterations - 1]);
+  free(samples);
+}
+
+static void mne_search_bench_task(int thread, void *arg) {
 }
 
-static void mne_search_ready() {
-  pthread_mutex_lock(&search_mutex);
-  pthread_cond_broadcast(&search_cond);
-  pthread_mutex_unlock(&search_mutex);
+static int mne_search_compare_double(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
 }
\ No newline at end of file
@@ -1,24 +1,129 @@
 #include <glib.h>
+#include <pcre.h>
+#include <limits.h>
+#include <sys/time.h>
+
+#include "arena.h"
+#include "ring.h"
+#include "plan.h"
+#include "paths.h"
+#include "pattern.h"
 
 #define RESULT_PAD 20
 #define MAX_CAPTURES 30
-#define MAX_SEARCH_RESULTS_PER_THREAD 10000
+#define SEARCH_SPAN_UNSET UINT_MAX
+#define SEARCH_CHUNK_BYTES (128 * 1024)
+#define SEARCH_MAX_ERRORS_SHOWN 10
+#define SEARCH_MAX_BATCH 32
+#define SEARCH_RENDER_RESULTS 4096 /* Per thread per round of rendering. */
+#define SEARCH_CONTEXT_BYTES 256 /* Records: most of a match's line given on either side. */
+#define SEARCH_EDGE_BYTES 64 /* Segments: how close to the limit a match may be cut short by an assertion. */
+
+/* A search error of our own, next to PCRE's: PCRE found no match where the DFA or a fixed matcher did. */
+#define SEARCH_ERROR_MISMATCH -1000
+
+/* Why a query stopped early. */
+#define SEARCH_CANCEL_DEADLINE 1
+#define SEARCH_CANCEL_INTERRUPT 2
+
+/* A blob whose scan stopped on a PCRE error such as a match limit. */
+typedef struct {
+	unsigned int query;
+	unsigned int blob;
+	int rc;
+} mne_search_error;
 
 typedef struct {
 	unsigned int initial;
 	unsigned int num_blobs;
+	mne_search_error *errors;
+	unsigned int num_errors;
+	unsigned int errors_size;
+	mne_ring *ring; /* Streaming: batches of new results, for the main thread to print. */
+	unsigned int published; /* Streaming: results handed to the ring so far. */
 } mne_search_ctx;
 
 typedef struct {
 	unsigned int offset;
 } mne_indices_ctx;
 
+/* A byte range of one blob; large blobs are split into several. */
+typedef struct {
+	unsigned int blob;
+	unsigned int start;
+	unsigned int end;
+} mne_search_work;
+
+/* Count mode: one query's match count in a work item, and where its last match ended. */
+typedef struct {
+	unsigned int count;
+	unsigned int tail;
+} mne_search_tally;
+
+/*
+ * One regex of a query batch, with everything compiled for it. The batch is
+ * searched in a single pass; results carry the query's id.
+ */
+typedef struct {
+	unsigned int id;
+	const char *term;
+	const char *pattern;
+	int flags; /* PCRE compile flags the mode and config ask for. */
+	mne_path_filter filter;
+	mne_pattern *compiled;
+	int compile_cached;
+	struct timeval compile_begin;
+	struct timeval compile_end;
+	pcre *re;
+	pcre_extra *re_extra;
+	mne_plan_node *plan;
+	const mne_plan_node *literal;
+	unsigned char *mask;
+	int candidates;
+	volatile unsigned int total;
+	volatile unsigned int truncated; /* A match had more captures than fit. */
+	unsigned int *counts;
+	mne_dfa_cache **dfa_caches; /* Per thread, when the query runs on the DFA. */
+	volatile unsigned int dfa_gave_up; /* A thread's DFA cache kept filling up; the rest runs on PCRE. */
+} mne_search_query;
+
+/* A run of search_work entries handed to one thread at a time. */
+typedef struct {
+	unsigned int first;
+	unsigned int last;
+} mne_search_chunk;
+
 typedef struct {
-	unsigned int fresh;
 	unsigned int sha1_offset;
 	unsigned int offset;
 	unsigned int length;
+	unsigned int span; /* The match's captures, or in lines mode the line's matches, in the thread's spans. */
+	unsigned int num_spans : 31;
+	unsigned int duplicate : 1;
 } mne_search_result;
 
+/* One query's results in split blobs, by blob and offset, for mne_search_dedupe. */
+typedef struct {
+	unsigned int query;
+	mne_search_result **matches;
+	unsigned int num_matches;
+} mne_search_dedupe_ctx;
+
+/* Records: the line a renderer last reached in a blob, so the next result's can be counted from there. */
+typedef struct {
+	unsigned int blob;
+	unsigned int offset;
+	unsigned int line;
+	unsigned int line_start;
+} mne_search_position;
+
+/* A capture of a match, or a match on a line recorded in lines mode. */
+typedef struct {
+	unsigned int offset;
+	unsigned int length;
+} mne_search_span;
+
 void mne_search_loop();
-void mne_search_cleanup();
\ No newline at end of file
+void mne_search_cleanup();
+void mne_search_parallel(void (*)(int, void*), void*);
+int mne_search_threads();
\ No newline at end of file
@@ -0,0 +1,871 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <pcre.h>
+
+#include "syntax.h"
+
+/*
+ * A recursive descent parser for the PCRE syntax that means the same thing
+ * to a set of NFA threads: bytes, classes, groups, alternation, greedy and
+ * lazy repeats, anchors and word boundaries, under the i, m and s options.
+ * Case folding and the dot are resolved into byte sets as the tree is built.
+ *
+ * Repeating something that can match nothing is rejected: PCRE ends such a
+ * loop after an empty iteration, which a set of threads can't mimic.
+ */
+
+#define MNE_SYNTAX_FOLD(c) (isupper(c) ? tolower(c) : toupper(c))
+#define MNE_SYNTAX_SUPPORTED_FLAGS (PCRE_CASELESS | PCRE_MULTILINE | PCRE_DOTALL | PCRE_NO_AUTO_CAPTURE)
+
+typedef struct {
+	const char *p;
+	int caseless;
+	int multiline;
+	int dotall;
+	const char *unsupported;
+} mne_syntax_parser;
+
+static mne_syntax_node *mne_syntax_node_new(mne_syntax_op);
+static void mne_syntax_add_child(mne_syntax_node*, mne_syntax_node*);
+static int mne_syntax_flatten(const mne_syntax_node*, unsigned char (*)[32], int, int);
+static void mne_syntax_extend(const mne_syntax_node*, mne_syntax_literal*, int*);
+static void mne_syntax_extend_alt(const mne_syntax_node*, mne_syntax_literal*, int*);
+static void mne_syntax_extend_optional(const mne_syntax_node*, mne_syntax_literal*, int*);
+static int mne_syntax_any_complete(const mne_syntax_literal*, int);
+static void mne_syntax_finish(mne_syntax_literal*, int);
+static mne_syntax_node *mne_syntax_parse_alt(mne_syntax_parser*);
+static mne_syntax_node *mne_syntax_parse_seq(mne_syntax_parser*);
+static mne_syntax_node *mne_syntax_parse_atom(mne_syntax_parser*);
+static mne_syntax_node *mne_syntax_parse_group(mne_syntax_parser*);
+static mne_syntax_node *mne_syntax_parse_escape(mne_syntax_parser*);
+static mne_syntax_node *mne_syntax_parse_quoted(mne_syntax_parser*);
+static mne_syntax_node *mne_syntax_parse_class(mne_syntax_parser*);
+static int mne_syntax_parse_class_atom(mne_syntax_parser*, unsigned char*);
+static int mne_syntax_parse_char_escape(mne_syntax_parser*, char);
+static int mne_syntax_parse_quantifier(mne_syntax_parser*, int*, int*, int*);
+static int mne_syntax_posix(const char*, int, unsigned char*);
+static void mne_syntax_escape_set(char, unsigned char*);
+static mne_syntax_node *mne_syntax_char(mne_syntax_parser*, int);
+static mne_syntax_node *mne_syntax_assert(int);
+static void mne_syntax_fold(unsigned char*);
+
+/*
+ * Parses pattern, given the flags it was compiled with for PCRE, or returns
+ * NULL with unsupported saying why it can't.
+ */
+mne_syntax_node *mne_syntax_parse(const char *pattern, int flags, const char **unsupported) {
+  mne_syntax_parser parser;
+
+  if (flags & ~MNE_SYNTAX_SUPPORTED_FLAGS) {
+    *unsupported = "compile options";
+    return NULL;
+  }
+
+  parser.p = pattern;
+  parser.caseless = (flags & PCRE_CASELESS) != 0;
+  parser.multiline = (flags & PCRE_MULTILINE) != 0;
+  parser.dotall = (flags & PCRE_DOTALL) != 0;
+  parser.unsupported = NULL;
+
+  mne_syntax_node *root = mne_syntax_parse_alt(&parser);
+
+  if (parser.unsupported == NULL && *parser.p != 0)
+    parser.unsupported = "unbalanced parentheses";
+
+  if (parser.unsupported != NULL) {
+    *unsupported = parser.unsupported;
+    mne_syntax_free(root);
+    return NULL;
+  }
+
+  *unsupported = NULL;
+  return root;
+}
+
+/*
+ * If node only ever matches a fixed sequence of up to max bytes, each from
+ * a set (no alternation, assertions or variable repeats), stores the sets
+ * and returns how many there are. Returns 0 otherwise.
+ */
+int mne_syntax_fixed(const mne_syntax_node *node, unsigned char (*sets)[32], int max) {
+  int length = mne_syntax_flatten(node, sets, 0, max);
+  return length > 0 ? length : 0;
+}
+
+/*
+ * Gathers literals, up to MNE_SYNTAX_MAX_PREFIXES, one of which starts every
+ * match of node, and returns how many. Returns 0 when a match can start
+ * with something else. The literals may be cut short, which only makes
+ * them match more places.
+ */
+int mne_syntax_prefixes(const mne_syntax_node *node, mne_syntax_literal *literals) {
+  int i, num_literals = 1;
+
+  memset(&literals[0], 0, sizeof(mne_syntax_literal));
+  literals[0].complete = 1;
+  mne_syntax_extend(node, literals, &num_literals);
+
+  for (i = 0; i < num_literals; i++) {
+    if (literals[i].length == 0)
+      return 0;
+  }
+
+  return num_literals;
+}
+
+/*
+ * Returns the byte set matches when that is a single byte, or a letter in
+ * either case (as its lower case, setting caseless). Returns -1 otherwise.
+ */
+int mne_syntax_byte(const unsigned char *set, int *caseless) {
+  int c, size = 0, first = -1;
+
+  for (c = 0; c < 256; c++) {
+    if (MNE_SYNTAX_HAS(set, c)) {
+      if (size++ == 0)
+        first = c;
+    }
+  }
+
+  *caseless = 0;
+  if (size == 1)
+    return first;
+  if (size == 2 && first >= 'A' && first <= 'Z' && MNE_SYNTAX_HAS(set, first + 32)) {
+    *caseless = 1;
+    return first + 32;
+  }
+
+  return -1;
+}
+
+void mne_syntax_free(mne_syntax_node *node) {
+  int i;
+
+  if (node == NULL)
+    return;
+
+  for (i = 0; i < node->num_children; i++)
+    mne_syntax_free(node->children[i]);
+  free(node->children);
+  free(node);
+}
+
+int mne_syntax_nullable(const mne_syntax_node *node) {
+  int i;
+
+  switch (node->op) {
+    case MNE_SYNTAX_SET:
+      return 0;
+    case MNE_SYNTAX_CAT:
+      for (i = 0; i < node->num_children; i++) {
+        if (!mne_syntax_nullable(node->children[i]))
+          return 0;
+      }
+      return 1;
+    case MNE_SYNTAX_ALT:
+      for (i = 0; i < node->num_children; i++) {
+        if (mne_syntax_nullable(node->children[i]))
+          return 1;
+      }
+      return 0;
+    case MNE_SYNTAX_REPEAT:
+      return node->min == 0 || mne_syntax_nullable(node->children[0]);
+    default:
+      return 1;
+  }
+}
+
+/* Whether node has an assertion about the byte after it: $, \z, \Z or a word boundary. */
+int mne_syntax_looks_ahead(const mne_syntax_node *node) {
+  int i;
+
+  if (node->op == MNE_SYNTAX_ASSERT)
+    return node->assertion != MNE_SYNTAX_BEGIN_TEXT && node->assertion != MNE_SYNTAX_BEGIN_LINE;
+
+  for (i = 0; i < node->num_children; i++) {
+    if (mne_syntax_looks_ahead(node->children[i]))
+      return 1;
+  }
+  return 0;
+}
+
+static mne_syntax_node *mne_syntax_node_new(mne_syntax_op op) {
+  mne_syntax_node *node = malloc(sizeof(mne_syntax_node));
+  assert(node != NULL);
+  memset(node, 0, sizeof(mne_syntax_node));
+  node->op = op;
+  return node;
+}
+
+static void mne_syntax_add_child(mne_syntax_node *parent, mne_syntax_node *child) {
+  parent->children = realloc(parent->children, sizeof(mne_syntax_node*) * (parent->num_children + 1));
+  assert(parent->children != NULL);
+  parent->children[parent->num_children++] = child;
+}
+
+static int mne_syntax_flatten(const mne_syntax_node *node, unsigned char (*sets)[32], int length, int max) {
+  int i;
+
+  switch (node->op) {
+    case MNE_SYNTAX_SET:
+      if (length == max)
+        return -1;
+      memcpy(sets[length], node->set, 32);
+      return length + 1;
+    case MNE_SYNTAX_CAT:
+      for (i = 0; i < node->num_children && length >= 0; i++)
+        length = mne_syntax_flatten(node->children[i], sets, length, max);
+      return length;
+    case MNE_SYNTAX_REPEAT:
+      if (node->min != node->max)
+        return -1;
+      for (i = 0; i < node->min && length >= 0; i++)
+        length = mne_syntax_flatten(node->children[0], sets, length, max);
+      return length;
+    case MNE_SYNTAX_EMPTY:
+      return length;
+    default:
+      return -1;
+  }
+}
+
+/* Appends what node matches to each complete literal, finishing those it can't extend. */
+static void mne_syntax_extend(const mne_syntax_node *node, mne_syntax_literal *literals, int *num_literals) {
+  int i, c, caseless;
+
+  switch (node->op) {
+    case MNE_SYNTAX_SET:
+      c = mne_syntax_byte(node->set, &caseless);
+      for (i = 0; i < *num_literals; i++) {
+        mne_syntax_literal *literal = &literals[i];
+        if (!literal->complete)
+          continue;
+        if (c < 0 || literal->length == MNE_SYNTAX_MAX_PREFIX) {
+          literal->complete = 0;
+          continue;
+        }
+        literal->bytes[literal->length++] = c;
+        literal->caseless |= caseless;
+      }
+      return;
+    case MNE_SYNTAX_CAT:
+      for (i = 0; i < node->num_children && mne_syntax_any_complete(literals, *num_literals); i++)
+        mne_syntax_extend(node->children[i], literals, num_literals);
+      return;
+    case MNE_SYNTAX_ALT:
+      mne_syntax_extend_alt(node, literals, num_literals);
+      return;
+    case MNE_SYNTAX_REPEAT:
+      if (node->min == 0) {
+        mne_syntax_extend_optional(node, literals, num_literals);
+        return;
+      }
+      for (i = 0; i < node->min && mne_syntax_any_complete(literals, *num_literals); i++)
+        mne_syntax_extend(node->children[0], literals, num_literals);
+      if (node->max != node->min)
+        mne_syntax_finish(literals, *num_literals);
+      return;
+    default:
+      /* Assertions and empty groups match no bytes. */
+      return;
+  }
+}
+
+/*
+ * Each branch extends its own copy of the complete literals. If the copies
+ * don't fit, the literals end before the alternation instead.
+ */
+static void mne_syntax_extend_alt(const mne_syntax_node *node, mne_syntax_literal *literals, int *num_literals) {
+  mne_syntax_literal *branch = malloc(sizeof(mne_syntax_literal) * MNE_SYNTAX_MAX_PREFIXES);
+  mne_syntax_literal *result = malloc(sizeof(mne_syntax_literal) * MNE_SYNTAX_MAX_PREFIXES);
+  int i, j, num_branch, num_result = 0;
+
+  assert(branch != NULL && result != NULL);
+
+  for (i = 0; i < *num_literals; i++) {
+    if (!literals[i].complete)
+      result[num_result++] = literals[i];
+  }
+
+  for (i = 0; i < node->num_children; i++) {
+    num_branch = 0;
+    for (j = 0; j < *num_literals; j++) {
+      if (literals[j].complete)
+        branch[num_branch++] = literals[j];
+    }
+
+    mne_syntax_extend(node->children[i], branch, &num_branch);
+
+    if (num_result + num_branch > MNE_SYNTAX_MAX_PREFIXES) {
+      mne_syntax_finish(literals, *num_literals);
+      free(branch);
+      free(result);
+      return;
+    }
+    memcpy(result + num_result, branch, sizeof(mne_syntax_literal) * num_branch);
+    num_result += num_branch;
+  }
+
+  memcpy(literals, result, sizeof(mne_syntax_literal) * num_result);
+  *num_literals = num_result;
+  free(branch);
+  free(result);
+}
+
+/* x? or x*: the literals as they are, plus copies extended by one x. */
+static void mne_syntax_extend_optional(const mne_syntax_node *node, mne_syntax_literal *literals, int *num_literals) {
+  mne_syntax_literal *branch = malloc(sizeof(mne_syntax_literal) * MNE_SYNTAX_MAX_PREFIXES);
+  int i, num_branch = 0;
+
+  assert(branch != NULL);
+
+  for (i = 0; i < *num_literals; i++) {
+    if (literals[i].complete)
+      branch[num_branch++] = literals[i];
+  }
+
+  mne_syntax_extend(node->children[0], branch, &num_branch);
+  if (node->max != 1)
+    mne_syntax_finish(branch, num_branch);
+
+  if (*num_literals + num_branch > MNE_SYNTAX_MAX_PREFIXES) {
+    mne_syntax_finish(literals, *num_literals);
+  } else {
+    memcpy(literals + *num_literals, branch, sizeof(mne_syntax_literal) * num_branch);
+    *num_literals += num_branch;
+  }
+
+  free(branch);
+}
+
+static int mne_syntax_any_complete(const mne_syntax_literal *literals, int num_literals) {
+  int i;
+
+  for (i = 0; i < num_literals; i++) {
+    if (literals[i].complete)
+      return 1;
+  }
+
+  return 0;
+}
+
+static void mne_syntax_finish(mne_syntax_literal *literals, int num_literals) {
+  int i;
+
+  for (i = 0; i < num_literals; i++)
+    literals[i].complete = 0;
+}
+
+static mne_syntax_node *mne_syntax_parse_alt(mne_syntax_parser *parser) {
+  mne_syntax_node *node = mne_syntax_node_new(MNE_SYNTAX_ALT);
+  mne_syntax_add_child(node, mne_syntax_parse_seq(parser));
+
+  while (*parser->p == '|' && parser->unsupported == NULL) {
+    parser->p++;
+    mne_syntax_add_child(node, mne_syntax_parse_seq(parser));
+  }
+
+  if (node->num_children == 1) {
+    mne_syntax_node *child = node->children[0];
+    node->num_children = 0;
+    mne_syntax_free(node);
+    return child;
+  }
+
+  return node;
+}
+
+static mne_syntax_node *mne_syntax_parse_seq(mne_syntax_parser *parser) {
+  mne_syntax_node *node = mne_syntax_node_new(MNE_SYNTAX_CAT);
+  int min, max, greedy;
+
+  while (*parser->p != 0 && *parser->p != '|' && *parser->p != ')' && parser->unsupported == NULL) {
+    mne_syntax_node *atom = mne_syntax_parse_atom(parser);
+
+    if (parser->unsupported == NULL && mne_syntax_parse_quantifier(parser, &min, &max, &greedy)) {
+      if (atom->op == MNE_SYNTAX_ASSERT || atom->op == MNE_SYNTAX_EMPTY)
+        parser->unsupported = "a quantified assertion";
+      else if (max != 1 && mne_syntax_nullable(atom))
+        parser->unsupported = "a repeated group that can match nothing";
+
+      mne_syntax_node *repeat = mne_syntax_node_new(MNE_SYNTAX_REPEAT);
+      repeat->min = min;
+      repeat->max = max;
+      repeat->greedy = greedy;
+      mne_syntax_add_child(repeat, atom);
+      atom = repeat;
+    }
+
+    mne_syntax_add_child(node, atom);
+  }
+
+  return node;
+}
+
+static mne_syntax_node *mne_syntax_parse_atom(mne_syntax_parser *parser) {
+  mne_syntax_node *node;
+  int c = (unsigned char)*parser->p;
+
+  switch (c) {
+    case '(':
+      return mne_syntax_parse_group(parser);
+    case '[':
+      return mne_syntax_parse_class(parser);
+    case '\\':
+      return mne_syntax_parse_escape(parser);
+    case '.':
+      parser->p++;
+      node = mne_syntax_node_new(MNE_SYNTAX_SET);
+      memset(node->set, 0xff, sizeof(node->set));
+      if (!parser->dotall)
+        node->set['\n' >> 3] &= ~(1 << ('\n' & 7));
+      return node;
+    case '^':
+      parser->p++;
+      return mne_syntax_assert(parser->multiline ? MNE_SYNTAX_BEGIN_LINE : MNE_SYNTAX_BEGIN_TEXT);
+    case '$':
+      parser->p++;
+      return mne_syntax_assert(parser->multiline ? MNE_SYNTAX_END_LINE : MNE_SYNTAX_END_TEXT_NEWLINE);
+    case '*':
+    case '+':
+    case '?':
+      parser->unsupported = "a quantifier with nothing to repeat";
+      return mne_syntax_node_new(MNE_SYNTAX_EMPTY);
+    default:
+      parser->p++;
+      return mne_syntax_char(parser, c);
+  }
+}
+
+static mne_syntax_node *mne_syntax_parse_group(mne_syntax_parser *parser) {
+  int caseless = parser->caseless, multiline = parser->multiline, dotall = parser->dotall;
+  const char *p = parser->p + 1;
+
+  if (*p == '*') {
+    parser->unsupported = "a backtracking verb";
+    return mne_syntax_node_new(MNE_SYNTAX_EMPTY);
+  }
+
+  if (*p == '?') {
+    p++;
+
+    if (*p == '#') {
+      while (*p != 0 && *p != ')')
+        p++;
+      parser->p = *p == ')' ? p + 1 : p;
+      return mne_syntax_node_new(MNE_SYNTAX_EMPTY);
+    }
+
+    if (*p == '=' || *p == '!' || (p[0] == '<' && (p[1] == '=' || p[1] == '!')))
+      parser->unsupported = "lookaround";
+    else if (*p == '>')
+      parser->unsupported = "an atomic group";
+    else if (*p == '(')
+      parser->unsupported = "a conditional group";
+    else if (*p == 'R' || *p == '&' || *p == '+' || isdigit((unsigned char)*p) ||
+        (*p == '-' && isdigit((unsigned char)p[1])) || (p[0] == 'P' && p[1] == '>'))
+      parser->unsupported = "recursion";
+    else if (p[0] == 'P' && p[1] == '=')
+      parser->unsupported = "a backreference";
+    else if (*p == 'C')
+      parser->unsupported = "a callout";
+
+    if (parser->unsupported != NULL)
+      return mne_syntax_node_new(MNE_SYNTAX_EMPTY);
+
+    if (*p == ':' || *p == '|') {
+      p++;
+    } else if (*p == '<' || *p == '\'' || (p[0] == 'P' && p[1] == '<')) {
+      char close = *p == '\'' ? '\'' : '>';
+      while (*p != 0 && *p != close)
+        p++;
+      if (*p != 0)
+        p++;
+    } else {
+      /* Of i, m and s only; the group restores them when it ends. */
+      int on = 1;
+      for (; *p != 0 && *p != ')' && *p != ':'; p++) {
+        if (*p == '-')
+          on = 0;
+        else if (*p == 'i')
+          parser->caseless = on;
+        else if (*p == 'm')
+          parser->multiline = on;
+        else if (*p == 's')
+          parser->dotall = on;
+        else
+          parser->unsupported = "an unsupported option";
+      }
+
+      if (*p == ')') {
+        parser->p = p + 1;
+        return mne_syntax_node_new(MNE_SYNTAX_EMPTY);
+      }
+
+      if (*p == ':')
+        p++;
+    }
+  }
+
+  parser->p = p;
+  mne_syntax_node *node = mne_syntax_parse_alt(parser);
+
+  if (*parser->p == ')')
+    parser->p++;
+  else if (parser->unsupported == NULL)
+    parser->unsupported = "unbalanced parentheses";
+
+  parser->caseless = caseless;
+  parser->multiline = multiline;
+  parser->dotall = dotall;
+  return node;
+}
+
+static mne_syntax_node *mne_syntax_parse_escape(mne_syntax_parser *parser) {
+  char c = parser->p[1];
+  mne_syntax_node *node;
+
+  if (c == 0) {
+    parser->unsupported = "a trailing backslash";
+    parser->p++;
+    return mne_syntax_node_new(MNE_SYNTAX_EMPTY);
+  }
+
+  switch (c) {
+    case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+      parser->p += 2;
+      node = mne_syntax_node_new(MNE_SYNTAX_SET);
+      mne_syntax_escape_set(c, node->set);
+      return node;
+    case 'b':
+      parser->p += 2;
+      return mne_syntax_assert(MNE_SYNTAX_WORD_BOUNDARY);
+    case 'B':
+      parser->p += 2;
+      return mne_syntax_assert(MNE_SYNTAX_NOT_WORD_BOUNDARY);
+    case 'A':
+      parser->p += 2;
+      return mne_syntax_assert(MNE_SYNTAX_BEGIN_TEXT);
+    case 'z':
+      parser->p += 2;
+      return mne_syntax_assert(MNE_SYNTAX_END_TEXT);
+    case 'Z':
+      parser->p += 2;
+      return mne_syntax_assert(MNE_SYNTAX_END_TEXT_NEWLINE);
+    case 'Q':
+      parser->p += 2;
+      return mne_syntax_parse_quoted(parser);
+    case 'E':
+      parser->p += 2;
+      return mne_syntax_node_new(MNE_SYNTAX_EMPTY);
+  }
+
+  int value = mne_syntax_parse_char_escape(parser, c);
+  if (value < 0)
+    return mne_syntax_node_new(MNE_SYNTAX_EMPTY);
+  return mne_syntax_char(parser, value);
+}
+
+/* \Q...\E: literal bytes. A quantifier after \E would repeat only the last. */
+static mne_syntax_node *mne_syntax_parse_quoted(mne_syntax_parser *parser) {
+  mne_syntax_node *node = mne_syntax_node_new(MNE_SYNTAX_CAT);
+
+  while (*parser->p != 0 && strncmp(parser->p, "\\E", 2) != 0)
+    mne_syntax_add_child(node, mne_syntax_char(parser, (unsigned char)*parser->p++));
+
+  if (*parser->p != 0) {
+    parser->p += 2;
+    if (strchr("*+?{", *parser->p) != NULL && *parser->p != 0)
+      parser->unsupported = "a quantifier after \\E";
+  }
+
+  return node;
+}
+
+/*
+ * Parses a backslash escape standing for a single byte, at parser->p, and
+ * returns the byte. Anything else is unsupported and returns -1.
+ */
+static int mne_syntax_parse_char_escape(mne_syntax_parser *parser, char c) {
+  int value = 0, digits;
+
+  parser->p += 2;
+
+  if (!isalnum((unsigned char)c))
+    return (unsigned char)c;
+
+  switch (c) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'e': return 27;
+    case 'a': return 7;
+    case 'x':
+      if (*parser->p == '{') {
+        const char *p = parser->p + 1;
+        for (digits = 0; isxdigit((unsigned char)*p) && value <= 0xff; p++, digits++)
+          value = value * 16 + (isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10);
+        if (digits == 0 || *p != '}' || value > 0xff) {
+          parser->unsupported = "a character above \\xff";
+          return -1;
+        }
+        parser->p = p + 1;
+        return value;
+      }
+      for (digits = 0; digits < 2 && isxdigit((unsigned char)*parser->p); digits++, parser->p++)
+        value = value * 16 + (isdigit((unsigned char)*parser->p) ? *parser->p - '0' :
+          tolower((unsigned char)*parser->p) - 'a' + 10);
+      return value;
+    case '0':
+      for (digits = 0; digits < 2 && *parser->p >= '0' && *parser->p <= '7'; digits++, parser->p++)
+        value = value * 8 + *parser->p - '0';
+      return value;
+    case 'g':
+    case 'k':
+    case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+      parser->unsupported = "a backreference";
+      return -1;
+    default:
+      parser->unsupported = "an unsupported escape";
+      return -1;
+  }
+}
+
+static mne_syntax_node *mne_syntax_parse_class(mne_syntax_parser *parser) {
+  mne_syntax_node *node = mne_syntax_node_new(MNE_SYNTAX_SET);
+  unsigned char other[32];
+  int i, negate = 0, first = 1;
+
+  parser->p++;
+  if (*parser->p == '^') {
+    negate = 1;
+    parser->p++;
+  }
+
+  while (parser->unsupported == NULL) {
+    const char *p = parser->p;
+
+    if (*p == 0) {
+      parser->unsupported = "an unterminated class";
+      break;
+    }
+
+    if (*p == ']' && !first) {
+      parser->p++;
+      break;
+    }
+    first = 0;
+
+    if (p[0] == '[' && p[1] == ':') {
+      const char *close = strstr(p + 2, ":]");
+      if (close == NULL || !mne_syntax_posix(p + 2, close - p - 2, node->set)) {
+        parser->unsupported = "an unsupported POSIX class";
+        break;
+      }
+      parser->p = close + 2;
+      continue;
+    }
+
+    int low = mne_syntax_parse_class_atom(parser, node->set);
+    if (low < 0)
+      continue;
+
+    /* A range, unless the hyphen ends the class or the other end is a class of its own. */
+    if (parser->p[0] == '-' && parser->p[1] != ']' && parser->p[1] != 0 &&
+        !(parser->p[1] == '[' && parser->p[2] == ':')) {
+      parser->p++;
+      memset(other, 0, sizeof(other));
+      int high = mne_syntax_parse_class_atom(parser, other);
+
+      if (high < 0) {
+        MNE_SYNTAX_ADD(node->set, low);
+        MNE_SYNTAX_ADD(node->set, '-');
+        for (i = 0; i < 32; i++)
+          node->set[i] |= other[i];
+      } else if (high < low) {
+        parser->unsupported = "a reversed range";
+      } else {
+        for (i = low; i <= high; i++)
+          MNE_SYNTAX_ADD(node->set, i);
+      }
+      continue;
+    }
+
+    MNE_SYNTAX_ADD(node->set, low);
+  }
+
+  if (parser->caseless)
+    mne_syntax_fold(node->set);
+
+  if (negate) {
+    for (i = 0; i < 32; i++)
+      node->set[i] = ~node->set[i];
+  }
+
+  return node;
+}
+
+/*
+ * Parses one member of a class: returns its byte, or adds a class escape
+ * such as \d to set and returns -1.
+ */
+static int mne_syntax_parse_class_atom(mne_syntax_parser *parser, unsigned char *set) {
+  char c = parser->p[0];
+
+  if (c != '\\') {
+    parser->p++;
+    return (unsigned char)c;
+  }
+
+  c = parser->p[1];
+  switch (c) {
+    case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+      parser->p += 2;
+      mne_syntax_escape_set(c, set);
+      return -1;
+    case 'b':
+      parser->p += 2;
+      return '\b';
+    case 0:
+      parser->unsupported = "an unterminated class";
+      return -1;
+  }
+
+  return mne_syntax_parse_char_escape(parser, c);
+}
+
+/* Consumes a quantifier, setting its bounds (max -1 when unbounded) and greediness. Returns 0 if there is none. */
+static int mne_syntax_parse_quantifier(mne_syntax_parser *parser, int *min, int *max, int *greedy) {
+  const char *p = parser->p;
+
+  switch (*p) {
+    case '*': *min = 0; *max = -1; p++; break;
+    case '+': *min = 1; *max = -1; p++; break;
+    case '?': *min = 0; *max = 1; p++; break;
+    case '{':
+      if (!isdigit((unsigned char)p[1]))
+        return 0;
+      p++;
+      *min = atoi(p);
+      while (isdigit((unsigned char)*p))
+        p++;
+      *max = *min;
+      if (*p == ',') {
+        p++;
+        *max = isdigit((unsigned char)*p) ? atoi(p) : -1;
+        while (isdigit((unsigned char)*p))
+          p++;
+      }
+      if (*p != '}')
+        return 0;
+      p++;
+      break;
+    default:
+      return 0;
+  }
+
+  *greedy = 1;
+  if (*p == '?') {
+    *greedy = 0;
+    p++;
+  } else if (*p == '+') {
+    parser->unsupported = "a possessive quantifier";
+    p++;
+  }
+
+  if (*max == 0 || *min > MNE_SYNTAX_MAX_REPEAT || *max > MNE_SYNTAX_MAX_REPEAT)
+    parser->unsupported = "a repeat count of 0 or over 4096";
+
+  parser->p = p;
+  return 1;
+}
+
+/* Adds POSIX class name (or its complement, with a leading ^) to set. */
+static int mne_syntax_posix(const char *name, int length, unsigned char *set) {
+  static const char *names[] = {
+    "alpha", "digit", "alnum", "space", "upper", "lower", "xdigit", "punct", "print", "graph", "cntrl",
+    "blank", "word", "ascii", NULL
+  };
+  int i, c, negate = 0;
+
+  if (length > 0 && *name == '^') {
+    negate = 1;
+    name++;
+    length--;
+  }
+
+  for (i = 0; names[i] != NULL; i++) {
+    if (strlen(names[i]) == length && strncmp(names[i], name, length) == 0)
+      break;
+  }
+
+  if (names[i] == NULL)
+    return 0;
+
+  for (c = 0; c < 256; c++) {
+    int in;
+    switch (i) {
+      case 0: in = isalpha(c); break;
+      case 1: in = isdigit(c); break;
+      case 2: in = isalnum(c); break;
+      case 3: in = isspace(c); break;
+      case 4: in = isupper(c); break;
+      case 5: in = islower(c); break;
+      case 6: in = isxdigit(c); break;
+      case 7: in = ispunct(c); break;
+      case 8: in = isprint(c); break;
+      case 9: in = isgraph(c); break;
+      case 10: in = iscntrl(c); break;
+      case 11: in = c == ' ' || c == '\t'; break;
+      case 12: in = MNE_SYNTAX_WORD(c); break;
+      default: in = c < 128; break;
+    }
+    if ((in != 0) != negate)
+      MNE_SYNTAX_ADD(set, c);
+  }
+
+  return 1;
+}
+
+/* Adds \d, \w, \s or their complements to set. PCRE's \s leaves out \v. */
+static void mne_syntax_escape_set(char escape, unsigned char *set) {
+  int c;
+
+  for (c = 0; c < 256; c++) {
+    int in;
+    switch (tolower((unsigned char)escape)) {
+      case 'd': in = isdigit(c); break;
+      case 'w': in = MNE_SYNTAX_WORD(c); break;
+      default: in = c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r'; break;
+    }
+    if ((in != 0) != (isupper((unsigned char)escape) != 0))
+      MNE_SYNTAX_ADD(set, c);
+  }
+}
+
+static mne_syntax_node *mne_syntax_char(mne_syntax_parser *parser, int c) {
+  mne_syntax_node *node = mne_syntax_node_new(MNE_SYNTAX_SET);
+  MNE_SYNTAX_ADD(node->set, c);
+  if (parser->caseless)
+    mne_syntax_fold(node->set);
+  return node;
+}
+
+static mne_syntax_node *mne_syntax_assert(int assertion) {
+  mne_syntax_node *node = mne_syntax_node_new(MNE_SYNTAX_ASSERT);
+  node->assertion = assertion;
+  return node;
+}
+
+/* ASCII case folding, as PCRE's default tables do outside UTF mode. */
+static void mne_syntax_fold(unsigned char *set) {
+  int c;
+
+  for (c = 0; c < 256; c++) {
+    if (isalpha(c) && MNE_SYNTAX_HAS(set, c))
+      MNE_SYNTAX_ADD(set, MNE_SYNTAX_FOLD(c));
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef MEANIE_SYNTAX_H
+#define MEANIE_SYNTAX_H
+
+/*
+ * The regex syntax the matchers other than PCRE understand, parsed into a
+ * small tree of byte sets. Only syntax whose meaning we are sure of is
+ * accepted; anything else leaves the pattern to PCRE, with a reason.
+ */
+
+#define MNE_SYNTAX_MAX_REPEAT 4096
+#define MNE_SYNTAX_MAX_PREFIX 32
+#define MNE_SYNTAX_MAX_PREFIXES 1024
+
+#define MNE_SYNTAX_HAS(set, c) ((set)[(c) >> 3] & (1 << ((c) & 7)))
+#define MNE_SYNTAX_ADD(set, c) ((set)[(c) >> 3] |= (1 << ((c) & 7)))
+#define MNE_SYNTAX_WORD(c) (isalnum(c) || (c) == '_')
+
+#define MNE_SYNTAX_BEGIN_TEXT 0
+#define MNE_SYNTAX_END_TEXT 1
+#define MNE_SYNTAX_END_TEXT_NEWLINE 2
+#define MNE_SYNTAX_BEGIN_LINE 3
+#define MNE_SYNTAX_END_LINE 4
+#define MNE_SYNTAX_WORD_BOUNDARY 5
+#define MNE_SYNTAX_NOT_WORD_BOUNDARY 6
+
+typedef enum {
+	MNE_SYNTAX_SET,
+	MNE_SYNTAX_CAT,
+	MNE_SYNTAX_ALT,
+	MNE_SYNTAX_REPEAT,
+	MNE_SYNTAX_ASSERT,
+	MNE_SYNTAX_EMPTY
+} mne_syntax_op;
+
+typedef struct mne_syntax_node {
+	mne_syntax_op op;
+	unsigned char set[32];
+	int assertion;
+	int min;
+	int max;      /* -1 when unbounded. */
+	int greedy;
+	struct mne_syntax_node **children;
+	int num_children;
+} mne_syntax_node;
+
+/* A literal a match may start with; caseless when some letter in it matches either case. */
+typedef struct {
+	unsigned char bytes[MNE_SYNTAX_MAX_PREFIX];
+	int length;
+	int caseless;
+	int complete;  /* Still being extended while the prefixes are gathered. */
+} mne_syntax_literal;
+
+mne_syntax_node *mne_syntax_parse(const char*, int, const char**);
+void mne_syntax_free(mne_syntax_node*);
+int mne_syntax_nullable(const mne_syntax_node*);
+int mne_syntax_looks_ahead(const mne_syntax_node*);
+int mne_syntax_fixed(const mne_syntax_node*, unsigned char (*)[32], int);
+int mne_syntax_prefixes(const mne_syntax_node*, mne_syntax_literal*);
+int mne_syntax_byte(const unsigned char*, int*);
+
+#endif
@@ -0,0 +1,309 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+#include "valgrind.h"
+#include "config.h"
+#include "topology.h"
+
+/*
+ * Everything here is read once at startup from /proc and /sys. Anything
+ * missing (no sysfs topology, no cgroup filesystem) falls back to treating
+ * each online CPU as a core of its own with no quota.
+ */
+
+#ifdef __linux__
+static void mne_topology_detect_linux(mne_topology*);
+static int mne_topology_siblings(int, cpu_set_t*);
+static double mne_topology_quota();
+static double mne_topology_quota_v2();
+static double mne_topology_quota_v1();
+static int mne_topology_cgroup(const char*, char*, size_t);
+static int mne_topology_parent(char*);
+static int mne_topology_read(const char*, char*, size_t);
+#endif
+
+void mne_topology_detect(mne_topology *topology) {
+  topology->online = sysconf(_SC_NPROCESSORS_ONLN);
+  if (topology->online < 1)
+    topology->online = 1;
+  topology->allowed = topology->online;
+  topology->cores = topology->online;
+  topology->quota = 0;
+  topology->cpus = NULL;
+
+#ifdef __linux__
+  mne_topology_detect_linux(topology);
+#elif __APPLE__
+  int cores;
+  size_t size = sizeof(cores);
+  if (sysctlbyname("hw.physicalcpu", &cores, &size, NULL, 0) == 0 && cores > 0 && cores <= topology->online)
+    topology->cores = cores;
+#endif
+}
+
+void mne_topology_free(mne_topology *topology) {
+  free(topology->cpus);
+  topology->cpus = NULL;
+}
+
+/*
+ * How many search threads to run for policy: a fixed count, one per physical
+ * core or one per allowed CPU. The latter two never exceed the cgroup quota,
+ * since threads beyond it would only be throttled. Valgrind runs one thread
+ * at a time anyway, so there two are enough.
+ */
+int mne_topology_workers(const mne_topology *topology, int policy) {
+  if (policy > 0)
+    return policy;
+  if (RUNNING_ON_VALGRIND)
+    return 2;
+
+  int workers = policy == MNE_WORKERS_THREADS ? topology->allowed : topology->cores;
+
+  if (topology->quota > 0) {
+    int limit = (int)topology->quota;
+    if (limit < topology->quota)
+      limit++;
+    if (workers > limit)
+      workers = limit;
+  }
+
+  return workers < 1 ? 1 : workers;
+}
+
+/* Pins thread to the CPU for worker n. Returns 0 where pinning isn't supported. */
+int mne_topology_pin(const mne_topology *topology, pthread_t thread, int n) {
+#ifdef __linux__
+  if (topology->cpus == NULL)
+    return 0;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(topology->cpus[n % topology->allowed], &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#else
+  return 0;
+#endif
+}
+
+void mne_topology_print(const mne_topology *topology, int policy, int workers, int pinned) {
+  printf(" * topology: %d online CPUs, %d allowed, %d physical cores", topology->online, topology->allowed,
+    topology->cores);
+  if (topology->quota > 0)
+    printf(", cgroup quota %.2f CPUs", topology->quota);
+  printf("\n");
+
+  int uncapped = policy == MNE_WORKERS_THREADS ? topology->allowed : topology->cores;
+
+  printf(" * workers: %d ", workers);
+  if (policy > 0)
+    printf("(-w %d)", policy);
+  else if (workers < uncapped)
+    printf("(capped by the cgroup quota)");
+  else
+    printf("(one per %s)", policy == MNE_WORKERS_THREADS ? "logical CPU" : "physical core");
+  printf(", %s\n", pinned ? "pinned" : "not pinned");
+}
+
+#ifdef __linux__
+static void mne_topology_detect_linux(mne_topology *topology) {
+  cpu_set_t allowed, siblings, leaders;
+  int cpu, n = 0;
+
+  topology->quota = mne_topology_quota();
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return;
+
+  topology->allowed = CPU_COUNT(&allowed);
+  if (topology->allowed < 1) {
+    topology->allowed = topology->online;
+    return;
+  }
+
+  /* A core's leader is its lowest allowed CPU; a CPU without sysfs topology leads itself. */
+  CPU_ZERO(&leaders);
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+
+    int leader = cpu;
+    if (mne_topology_siblings(cpu, &siblings)) {
+      CPU_AND(&siblings, &siblings, &allowed);
+      for (leader = 0; leader < cpu && !CPU_ISSET(leader, &siblings); leader++);
+    }
+    if (leader == cpu)
+      CPU_SET(cpu, &leaders);
+  }
+
+  topology->cores = CPU_COUNT(&leaders);
+  topology->cpus = malloc(sizeof(int) * topology->allowed);
+  assert(topology->cpus != NULL);
+
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &leaders))
+      topology->cpus[n++] = cpu;
+  }
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &leaders))
+      topology->cpus[n++] = cpu;
+  }
+}
+
+/* Reads the CPUs sharing cpu's core, a list like "0,64" or "2-3". */
+static int mne_topology_siblings(int cpu, cpu_set_t *siblings) {
+  char path[PATH_MAX], list[256], *p;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  if (!mne_topology_read(path, list, sizeof(list)))
+    return 0;
+
+  CPU_ZERO(siblings);
+  p = list;
+  while (*p >= '0' && *p <= '9') {
+    long first = strtol(p, &p, 10), last = first;
+    if (*p == '-')
+      last = strtol(p + 1, &p, 10);
+    for (; first <= last && first < CPU_SETSIZE; first++)
+      CPU_SET(first, siblings);
+    if (*p == ',')
+      p++;
+  }
+
+  return CPU_ISSET(cpu, siblings);
+}
+
+static double mne_topology_quota() {
+  double quota = mne_topology_quota_v2();
+  return quota > 0 ? quota : mne_topology_quota_v1();
+}
+
+/*
+ * cgroup v2 keeps "<quota> <period>" or "max <period>" in cpu.max. A limit
+ * on any ancestor applies too, so take the tightest from our cgroup up.
+ */
+static double mne_topology_quota_v2() {
+  char cgroup[PATH_MAX], path[PATH_MAX + 32], line[64];
+  double quota = 0;
+
+  if (!mne_topology_cgroup(NULL, cgroup, sizeof(cgroup)))
+    return 0;
+
+  do {
+    long long limit, period;
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", strcmp(cgroup, "/") == 0 ? "" : cgroup);
+    if (mne_topology_read(path, line, sizeof(line)) && sscanf(line, "%lld %lld", &limit, &period) == 2 &&
+        limit > 0 && period > 0 && (quota == 0 || (double)limit / period < quota))
+      quota = (double)limit / period;
+  } while (mne_topology_parent(cgroup));
+
+  return quota;
+}
+
+/*
+ * cgroup v1 splits it in two files, with a quota of -1 meaning none, under
+ * the cpu controller's own hierarchy. Ancestors count here too.
+ */
+static double mne_topology_quota_v1() {
+  char cgroup[PATH_MAX], path[PATH_MAX + 64], line[64];
+  double quota = 0;
+
+  if (!mne_topology_cgroup("cpu", cgroup, sizeof(cgroup)))
+    strcpy(cgroup, "/");
+
+  do {
+    long long limit, period;
+    const char *dir = strcmp(cgroup, "/") == 0 ? "" : cgroup;
+
+    snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_quota_us", dir);
+    if (!mne_topology_read(path, line, sizeof(line)) || sscanf(line, "%lld", &limit) != 1 || limit <= 0)
+      continue;
+    snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu%s/cpu.cfs_period_us", dir);
+    if (!mne_topology_read(path, line, sizeof(line)) || sscanf(line, "%lld", &period) != 1 || period <= 0)
+      continue;
+
+    if (quota == 0 || (double)limit / period < quota)
+      quota = (double)limit / period;
+  } while (mne_topology_parent(cgroup));
+
+  return quota;
+}
+
+/*
+ * Our cgroup from /proc/self/cgroup: the v2 one for a NULL controller, else
+ * the v1 hierarchy whose controller list ("cpu,cpuacct") names controller.
+ */
+static int mne_topology_cgroup(const char *controller, char *cgroup, size_t size) {
+  char line[PATH_MAX];
+  int found = 0;
+  FILE *fp = fopen("/proc/self/cgroup", "r");
+
+  if (fp == NULL)
+    return 0;
+
+  while (!found && fgets(line, sizeof(line), fp) != NULL) {
+    char *list = strchr(line, ':'), *path = list != NULL ? strchr(list + 1, ':') : NULL;
+    if (path == NULL)
+      continue;
+    *list++ = 0;
+    *path++ = 0;
+
+    if (controller == NULL) {
+      found = strcmp(line, "0") == 0 && *list == 0;
+    } else {
+      char *name;
+      for (name = strtok(list, ","); name != NULL && !found; name = strtok(NULL, ","))
+        found = strcmp(name, controller) == 0;
+    }
+
+    if (found) {
+      snprintf(cgroup, size, "%s", path);
+      cgroup[strcspn(cgroup, "\n")] = 0;
+    }
+  }
+  fclose(fp);
+
+  return found && cgroup[0] == '/';
+}
+
+/*
+ * Moves cgroup up to its parent. Returns 0 at the root. In a container the
+ * path may be the host's, which the container's mount lacks, but some
+ * ancestor (at worst the root) is where the limits are.
+ */
+static int mne_topology_parent(char *cgroup) {
+  char *slash = strrchr(cgroup, '/');
+
+  if (slash == NULL || strcmp(cgroup, "/") == 0)
+    return 0;
+  if (slash == cgroup)
+    slash[1] = 0;
+  else
+    *slash = 0;
+  return 1;
+}
+
+/* Reads the first line of a small file. */
+static int mne_topology_read(const char *path, char *line, size_t size) {
+  FILE *fp = fopen(path, "r");
+
+  if (fp == NULL)
+    return 0;
+
+  int ok = fgets(line, size, fp) != NULL;
+  fclose(fp);
+  return ok;
+}
+#endif
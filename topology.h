@@ -0,0 +1,27 @@
+#ifndef MEANIE_TOPOLOGY_H
+#define MEANIE_TOPOLOGY_H
+
+#include <pthread.h>
+
+/*
+ * The CPUs this process may actually use: its affinity mask (which already
+ * reflects any cpuset it was started in), the cgroup CPU quota, and which of
+ * the allowed CPUs are SMT siblings sharing one physical core. The search
+ * pool is sized from this and its threads pinned to distinct cores.
+ */
+
+typedef struct {
+	int online;    /* CPUs the kernel has online. */
+	int allowed;   /* CPUs in the affinity mask. */
+	int cores;     /* Physical cores with at least one allowed CPU. */
+	double quota;  /* CPUs' worth of cgroup quota, 0 when unlimited. */
+	int *cpus;     /* Allowed CPUs, one per core first, then their siblings; NULL if unknown. */
+} mne_topology;
+
+void mne_topology_detect(mne_topology*);
+void mne_topology_free(mne_topology*);
+int mne_topology_workers(const mne_topology*, int);
+int mne_topology_pin(const mne_topology*, pthread_t, int);
+void mne_topology_print(const mne_topology*, int, int, int);
+
+#endif
@@ -5,7 +5,6 @@
 #include <pthread.h>
 
 #include "util.h"
-#include "valgrind.h"
 
 static pthread_mutex_t printf_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -31,27 +30,3 @@ void mne_check_error(const char *name, int err, const char *file, int line) {
     exit(1);
   }
 }
-
-int mne_detect_logical_cores() {
-  const char *cmd;
-#ifdef __linux__
-  cmd = "cat /proc/cpuinfo | grep processor | wc -l";
-#elif __APPLE__
-  cmd = "sysctl hw.ncpu | awk '{print 2}'";
-#else
-  printf("I don't know how to detect the number of logical cores for this OS!\n");
-  exit(1);
-#endif  
-
-  if (!RUNNING_ON_VALGRIND) {
-    FILE *fd = popen(cmd, "r");
-    assert(fd != NULL);
-    char output[3];
-    fgets(output, 3, fd);
-    pclose(fd);
-    output[2] = 0;
-    return atoi(output);
-  } else {
-    return 2;
-  }
-}
\ No newline at end of file
@@ -6,6 +6,5 @@
 void mne_printf_async(const char *format, ...);
 void mne_print_duration(struct timeval*, struct timeval*);
 void mne_check_error(const char*, int, const char*, int);
-int mne_detect_logical_cores();
 
 #endif
\ No newline at end of file